@@ -0,0 +1,85 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <inttypes.h>
+#include "agent-stats.h"
+
+static const char *const grant_stats_names[GRANT_STATS_COUNT] = {
+    [GRANT_STATS_SHARED_PAGES] = "grant.shared_pages",
+    [GRANT_STATS_PEAK_SHARED_PAGES] = "grant.peak_shared_pages",
+    [GRANT_STATS_ALLOC_FAILURES] = "grant.alloc_failures",
+    [GRANT_STATS_ACK_QUEUE_DEPTH] = "window_dump.ack_queue_depth",
+    [GRANT_STATS_ACK_QUEUE_MAX_DEPTH] = "window_dump.ack_queue_max_depth",
+    [GRANT_STATS_PIXMAPS_4K] = "grant.pixmaps.4k",
+    [GRANT_STATS_PIXMAPS_64K] = "grant.pixmaps.64k",
+    [GRANT_STATS_PIXMAPS_1M] = "grant.pixmaps.1m",
+    [GRANT_STATS_PIXMAPS_8M] = "grant.pixmaps.8m",
+    [GRANT_STATS_PIXMAPS_32M] = "grant.pixmaps.32m",
+    [GRANT_STATS_PIXMAPS_LARGER] = "grant.pixmaps.larger",
+};
+
+void resync_stats_add(struct resync_stats *st, size_t windows, size_t skipped,
+                      long ms, long query_ms)
+{
+    st->count++;
+    st->windows += windows;
+    st->skipped += skipped;
+    st->last_windows = windows;
+    st->last_skipped = skipped;
+    st->last_ms = ms;
+    st->last_query_ms = query_ms;
+    if (ms > st->max_ms)
+        st->max_ms = ms;
+}
+
+void resync_stats_write(FILE *f, const struct resync_stats *st)
+{
+    if (!st->count)
+        return;
+    fprintf(f, "resync.count %" PRIu64 "\n", st->count);
+    fprintf(f, "resync.windows %" PRIu64 "\n", st->windows);
+    fprintf(f, "resync.skipped %" PRIu64 "\n", st->skipped);
+    fprintf(f, "resync.last.windows %" PRIu64 "\n", st->last_windows);
+    fprintf(f, "resync.last.skipped %" PRIu64 "\n", st->last_skipped);
+    fprintf(f, "resync.last.time_ms %ld\n", st->last_ms);
+    fprintf(f, "resync.last.query_time_ms %ld\n", st->last_query_ms);
+    fprintf(f, "resync.max_time_ms %ld\n", st->max_ms);
+}
+
+bool grant_stats_parse(uint32_t stats[GRANT_STATS_COUNT], const long *values,
+                       unsigned long nitems)
+{
+    int i;
+
+    if (nitems != GRANT_STATS_COUNT ||
+            values[GRANT_STATS_VERSION_IDX] != GRANT_STATS_VERSION)
+        return false;
+    for (i = 0; i < GRANT_STATS_COUNT; i++)
+        stats[i] = values[i];
+    return true;
+}
+
+void grant_stats_write(FILE *f, const uint32_t stats[GRANT_STATS_COUNT])
+{
+    int i;
+
+    for (i = 0; i < GRANT_STATS_COUNT; i++)
+        if (grant_stats_names[i])
+            fprintf(f, "%s %" PRIu32 "\n", grant_stats_names[i], stats[i]);
+}
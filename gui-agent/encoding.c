@@ -21,6 +21,10 @@
  */
 #include "encoding.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 /* validate single UTF-8 character
  * return bytes count of this character, or 0 if the character is invalid */
 static int validate_utf8_char(unsigned char *untrusted_c) {
@@ -89,6 +93,7 @@ static int validate_utf8_char(unsigned char *untrusted_c) {
             break;
         case 0xF4:
             untrusted_c++;
+            total_size = 4;
             if (*untrusted_c >= 0x80 && *untrusted_c <= 0x8F)
                 tails_count = 2;
             else
@@ -106,6 +111,24 @@ static int validate_utf8_char(unsigned char *untrusted_c) {
     return total_size;
 }
 
+/* validate single clipboard character (plain ASCII, \n, \t, \r\n or UTF-8)
+ * return bytes count of this character, 0 if the character is invalid, or -1
+ * for terminating NULL */
+static int validate_clipboard_char(const unsigned char *untrusted_c)
+{
+    // allow only non-control ASCII chars
+    if ((*untrusted_c >= 0x20 && *untrusted_c <= 0x7E) ||
+         *untrusted_c == '\n' || *untrusted_c == '\t')
+        return 1;
+    if (*untrusted_c == '\r')
+        return untrusted_c[1] == '\n' ? 1 : 0;
+    if (*untrusted_c >= 0x80)
+        return validate_utf8_char((unsigned char *)untrusted_c);
+    if (*untrusted_c == 0)
+        return -1;
+    return 0;
+}
+
 /* replace non-printable characters with '_'
  * given string must be NULL terminated already */
 bool is_valid_clipboard_string_from_vm(unsigned char *untrusted_s)
@@ -130,6 +153,323 @@ bool is_valid_clipboard_string_from_vm(unsigned char *untrusted_s)
     return true;
 }
 
+/* ASCII fast path: return the number of leading bytes that are all plain
+ * characters (0x20-0x7E, \n or \t). Such bytes are complete characters on
+ * their own, so the scan can resume at any of them. \r and NULL are left for
+ * validate_clipboard_char(). */
+static size_t skip_plain_ascii_scalar(const unsigned char *untrusted_s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (!((untrusted_s[i] >= 0x20 && untrusted_s[i] <= 0x7E) ||
+              untrusted_s[i] == '\n' || untrusted_s[i] == '\t'))
+            break;
+    }
+    return i;
+}
+
+#if defined(__SSE2__)
+static size_t skip_plain_ascii_sse2(const unsigned char *untrusted_s, size_t len)
+{
+    const __m128i ctrl_max = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(untrusted_s + i));
+        /* signed compare, so bytes >= 0x80 are excluded too */
+        __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del),
+                                      _mm_cmpgt_epi8(v, ctrl_max));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, tab));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, lf));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(ok);
+        if (mask != 0xFFFF)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + skip_plain_ascii_scalar(untrusted_s + i, len - i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t skip_plain_ascii_avx2(const unsigned char *untrusted_s, size_t len)
+{
+    const __m256i ctrl_max = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(untrusted_s + i));
+        /* signed compare, so bytes >= 0x80 are excluded too */
+        __m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del),
+                                         _mm256_cmpgt_epi8(v, ctrl_max));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, tab));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, lf));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(ok);
+        if (mask != 0xFFFFFFFFU)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + skip_plain_ascii_scalar(untrusted_s + i, len - i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Error bits of the UTF-8 lookup tables below, for a byte pair: the
+ * previous byte (byte 1) and the current one (byte 2) */
+#define UTF8_TOO_SHORT  (1 << 0) /* 11______ 0_______, 11______ 11______ */
+#define UTF8_TOO_LONG   (1 << 1) /* 0_______ 10______ */
+#define UTF8_OVERLONG_3 (1 << 2) /* 11100000 100_____ */
+#define UTF8_TOO_LARGE  (1 << 3) /* 11110100 1001____ and above */
+#define UTF8_SURROGATE  (1 << 4) /* 11101101 101_____ */
+#define UTF8_OVERLONG_2 (1 << 5) /* 1100000_ 10______ */
+/* 11110101 1000____ and above, or 11110000 1000____ (overlong 4) */
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+/* 10______ 10______, an error unless it is the 3rd or 4th byte */
+#define UTF8_TWO_CONTS  (1 << 7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+/* the 32 bytes ending n bytes before the end of cur, prev preceding it */
+#define UTF8_PREV(cur, prev, n) \
+    _mm256_alignr_epi8((cur), _mm256_permute2x128_si256((prev), (cur), 0x21), \
+                       16 - (n))
+
+/* The lookup algorithm of Keiser and Lemire, "Validating UTF-8 in less than
+ * one instruction per byte": three table lookups, by the high nibble of the
+ * previous byte, its low nibble and the high nibble of the current byte, give
+ * the errors of each byte pair; 3rd and 4th bytes are told apart from extra
+ * continuation bytes by the lead byte two or three bytes back. Returns a
+ * non-zero vector on error. Sequences cut at the end of the block are
+ * checked with the next one. */
+__attribute__((target("avx2")))
+static __m256i utf8_errors_avx2(__m256i cur, __m256i prev)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m256i byte_1_low_table = _mm256_setr_epi8(
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m256i byte_2_high_table = _mm256_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+    __m256i prev1 = UTF8_PREV(cur, prev, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table,
+        _mm256_and_si256(prev1, nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+        _mm256_and_si256(_mm256_srli_epi16(cur, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high,
+                                                        byte_1_low),
+                                       byte_2_high);
+    /* only 111_____ two bytes back and 1111____ three bytes back stay
+     * >= 0x80 */
+    __m256i is_third = _mm256_subs_epu8(UTF8_PREV(cur, prev, 2),
+                                        _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i is_fourth = _mm256_subs_epu8(UTF8_PREV(cur, prev, 3),
+                                         _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must_be_cont = _mm256_and_si256(_mm256_or_si256(is_third,
+                                                            is_fourth),
+                                            _mm256_set1_epi8((char) 0x80));
+
+    return _mm256_xor_si256(must_be_cont, special);
+}
+
+/* Back from end to the start of the character that may be cut there, or of
+ * a \r whose \n was not checked yet. untrusted_s[0] starts a character. */
+static size_t clipboard_char_boundary(const unsigned char *untrusted_s,
+                                      size_t end)
+{
+    size_t i = end;
+
+    while (i > 0 && end - i < 3 && (untrusted_s[i - 1] & 0xC0) == 0x80)
+        i--;
+    if (i > 0 && untrusted_s[i - 1] >= 0xC0)
+        return i - 1;
+    if (i == end && i > 0 && untrusted_s[i - 1] == '\r')
+        return i - 1;
+    return end;
+}
+
+/* Return the number of leading bytes that are complete, valid clipboard
+ * characters: plain ASCII as for skip_plain_ascii_scalar(), \r\n and UTF-8,
+ * checked 32 bytes at a time. A block with a NULL or an invalid character
+ * is left to validate_clipboard_char(). */
+__attribute__((target("avx2")))
+static size_t skip_valid_clipboard_avx2(const unsigned char *untrusted_s,
+                                        size_t len)
+{
+    const __m256i ctrl_max = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i high = _mm256_set1_epi8((char) 0x80);
+    __m256i prev, v, plain, bad, err;
+    int all_plain;
+    size_t i = 0, end;
+
+    for (;;) {
+        /* plain bytes are complete characters, the blocks below can start
+         * right after them */
+        i += skip_plain_ascii_avx2(untrusted_s + i, len - i);
+        if (i + 32 > len)
+            return i;
+        prev = _mm256_setzero_si256();
+        do {
+            v = _mm256_loadu_si256((const __m256i *)(untrusted_s + i));
+            plain = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del),
+                                        _mm256_cmpgt_epi8(v, ctrl_max));
+            plain = _mm256_or_si256(plain, _mm256_cmpeq_epi8(v, tab));
+            plain = _mm256_or_si256(plain, _mm256_cmpeq_epi8(v, lf));
+            all_plain = (unsigned int) _mm256_movemask_epi8(plain) ==
+                0xFFFFFFFFU;
+            /* not plain and not >= 0x80: other control characters
+             * (including NULL), DEL and \r */
+            bad = _mm256_andnot_si256(_mm256_or_si256(plain, v), high);
+            /* \r must be followed by \n, possibly in the next block */
+            bad = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, cr), bad);
+            bad = _mm256_or_si256(bad, _mm256_andnot_si256(
+                    _mm256_cmpeq_epi8(v, lf),
+                    _mm256_cmpeq_epi8(UTF8_PREV(v, prev, 1), cr)));
+            if (!_mm256_testz_si256(bad, bad))
+                goto out;
+            /* the UTF-8 check is only needed around bytes >= 0x80 */
+            if (!_mm256_testz_si256(v, high) ||
+                    !_mm256_testz_si256(prev, high)) {
+                err = utf8_errors_avx2(v, prev);
+                if (!_mm256_testz_si256(err, err))
+                    goto out;
+            }
+            prev = v;
+            i += 32;
+        } while (!all_plain && i + 32 <= len);
+        /* the last block may end in a character continued after it */
+        if (!all_plain)
+            break;
+    }
+out:
+    end = clipboard_char_boundary(untrusted_s, i);
+    if (end < i)
+        return end;
+    return i + skip_plain_ascii_scalar(untrusted_s + i, len - i);
+}
+#endif
+
+static size_t skip_valid_select(const unsigned char *untrusted_s, size_t len);
+
+/* resolved on first use */
+static size_t (*skip_valid)(const unsigned char *, size_t) = skip_valid_select;
+
+static size_t skip_valid_select(const unsigned char *untrusted_s, size_t len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        skip_valid = skip_valid_clipboard_avx2;
+    else
+#endif
+#if defined(__SSE2__)
+        skip_valid = skip_plain_ascii_sse2;
+#else
+        skip_valid = skip_plain_ascii_scalar;
+#endif
+    return skip_valid(untrusted_s, len);
+}
+
+/* Same as is_valid_clipboard_string_from_vm(), but checked many bytes at a
+ * time: runs of plain ASCII, and with AVX2 also UTF-8 and \r\n.
+ * untrusted_s[len] must be readable and the string must be NULL terminated at
+ * or before it; validation stops at the first NULL, like for the NULL
+ * terminated variant. */
+bool is_valid_clipboard_buffer_from_vm(const unsigned char *untrusted_s,
+                                       size_t len)
+{
+    size_t i = 0;
+    int ret;
+
+    while (i < len) {
+        i += skip_valid(untrusted_s + i, len - i);
+        if (i >= len)
+            break;
+        ret = validate_clipboard_char(untrusted_s + i);
+        if (ret < 0)
+            return true;
+        if (ret == 0)
+            return false;
+        i += ret;
+    }
+    return true;
+}
+
 /* replace non-printable characters with '_'
  * given string must be NULL terminated already */
 void sanitize_string_from_vm(unsigned char *untrusted_s, int allow_utf8)
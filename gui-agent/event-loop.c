@@ -0,0 +1,186 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Minimal epoll based event loop: fd sources reported back to the caller as
+ * a bitmask, plus timerfd backed one-shot timers dispatched internally. No
+ * timeout is ever used, so an idle agent does not wake up at all. */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "event-loop.h"
+
+struct event_source {
+    int fd;
+    /* bit reported by event_loop_wait(), -1 for internal sources */
+    int id;
+    /* set only for timers */
+    struct event_timer *timer;
+};
+
+struct event_timer {
+    struct event_source source;
+    event_timer_cb *cb;
+    void *opaque;
+};
+
+static int epoll_fd = -1;
+static struct event_source wakeup_source = { .fd = -1, .id = -1 };
+static struct event_source fd_sources[EVENT_LOOP_MAX_SOURCES];
+
+static void event_loop_add(struct event_source *source)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = source,
+    };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) < 0)
+        err(1, "epoll_ctl add");
+}
+
+void event_loop_init(void)
+{
+    unsigned int i;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        err(1, "epoll_create1");
+    wakeup_source.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup_source.fd < 0)
+        err(1, "eventfd");
+    event_loop_add(&wakeup_source);
+    for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        fd_sources[i].fd = -1;
+        fd_sources[i].id = (int)i;
+    }
+}
+
+void event_loop_set_fd(unsigned int id, int fd)
+{
+    struct event_source *source;
+
+    if (id >= EVENT_LOOP_MAX_SOURCES)
+        errx(1, "invalid event source %u", id);
+    source = &fd_sources[id];
+    if (source->fd == fd)
+        return;
+    /* the old fd may be already closed, in which case epoll has dropped it
+     * itself */
+    if (source->fd >= 0 &&
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) < 0 &&
+            errno != EBADF && errno != ENOENT)
+        err(1, "epoll_ctl del");
+    source->fd = fd;
+    if (fd >= 0)
+        event_loop_add(source);
+}
+
+void event_loop_wakeup(void)
+{
+    uint64_t one = 1;
+    int saved_errno = errno;
+
+    if (wakeup_source.fd >= 0 &&
+            write(wakeup_source.fd, &one, sizeof(one)) < 0) {
+        /* counter overflow (EAGAIN) still leaves it readable */
+    }
+    errno = saved_errno;
+}
+
+uint32_t event_loop_wait(void)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_SOURCES];
+    struct event_source *source;
+    uint32_t ready = 0;
+    uint64_t count;
+    int i, n;
+
+    n = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_SOURCES, -1);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        err(1, "epoll_wait");
+    }
+    for (i = 0; i < n; i++) {
+        source = events[i].data.ptr;
+        if (source->id >= 0) {
+            ready |= 1U << source->id;
+            continue;
+        }
+        /* both eventfd and timerfd are non-blocking; a timer disarmed by an
+         * earlier callback in this batch reads nothing and is skipped */
+        if (read(source->fd, &count, sizeof(count)) != sizeof(count))
+            continue;
+        if (source->timer)
+            source->timer->cb(source->timer->opaque);
+    }
+    return ready;
+}
+
+struct event_timer *event_timer_new(event_timer_cb *cb, void *opaque)
+{
+    struct event_timer *timer;
+
+    timer = calloc(1, sizeof(*timer));
+    if (!timer) {
+        fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+        exit(1);
+    }
+    timer->source.fd = timerfd_create(CLOCK_MONOTONIC,
+                                      TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer->source.fd < 0)
+        err(1, "timerfd_create");
+    timer->source.id = -1;
+    timer->source.timer = timer;
+    timer->cb = cb;
+    timer->opaque = opaque;
+    event_loop_add(&timer->source);
+    return timer;
+}
+
+static void event_timer_set(struct event_timer *timer, unsigned int timeout_ms)
+{
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = (long)(timeout_ms % 1000) * 1000000L,
+        },
+    };
+
+    if (timerfd_settime(timer->source.fd, 0, &spec, NULL) < 0)
+        err(1, "timerfd_settime");
+}
+
+void event_timer_arm(struct event_timer *timer, unsigned int timeout_ms)
+{
+    /* zero would disarm the timer instead */
+    event_timer_set(timer, timeout_ms ? timeout_ms : 1);
+}
+
+void event_timer_disarm(struct event_timer *timer)
+{
+    event_timer_set(timer, 0);
+}
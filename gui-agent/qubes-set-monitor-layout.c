@@ -0,0 +1,391 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* qubes.SetMonitorLayout service: apply the monitor layout sent by the GUI
+ * daemon to the DUMMY* outputs of the local Xorg. Each line on stdin
+ * describes one monitor:
+ *
+ *   width height x y [width_mm height_mm]
+ *
+ * Outputs not listed are turned off. Modes are computed here (CVT, 60Hz),
+ * created only if not present yet, and the whole layout is applied with the
+ * server grabbed, so clients see a single configuration change. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xrandr.h>
+
+#define OUTPUT_NAME_FMT "DUMMY%u"
+#define MODE_NAME_FMT "QB%dx%d"
+/* big enough for any sane setup, dummyqbs has only a few outputs anyway */
+#define MAX_MONITORS 16
+#define MAX_COORD 32767
+/* used for the physical screen size when the current one is unknown */
+#define DEFAULT_DPI 96.0
+
+struct monitor {
+    int width, height;
+    int x, y;
+    /* -1 if not given */
+    long width_mm, height_mm;
+
+    RROutput output;
+    XRROutputInfo *output_info;
+    RRCrtc crtc;
+    RRMode mode;
+};
+
+/* CVT timings (VESA Coordinated Video Timings, non-reduced blanking), the
+ * same as cvt(1) prints */
+#define CVT_H_GRANULARITY 8
+#define CVT_MIN_V_PORCH 3
+#define CVT_MIN_VSYNC_BP 550.0
+#define CVT_HSYNC_PERCENTAGE 8
+#define CVT_C_PRIME 30.0
+#define CVT_M_PRIME 300.0
+#define CVT_CLOCK_STEP 250
+#define CVT_REFRESH 60.0
+
+static void cvt_mode(XRRModeInfo *mode, int width, int height)
+{
+    /* timings are computed for the width rounded up to the character cell,
+     * the visible area is exactly what was requested */
+    int hdisplay = (width + CVT_H_GRANULARITY - 1) & ~(CVT_H_GRANULARITY - 1);
+    int vsync, vsync_bp, hblank, clock;
+    double hperiod, hblank_percentage;
+
+    if (!(height % 3) && height * 4 / 3 == hdisplay)
+        vsync = 4;
+    else if (!(height % 9) && height * 16 / 9 == hdisplay)
+        vsync = 5;
+    else if (!(height % 10) && height * 16 / 10 == hdisplay)
+        vsync = 6;
+    else if (!(height % 4) && height * 5 / 4 == hdisplay)
+        vsync = 7;
+    else if (!(height % 9) && height * 15 / 9 == hdisplay)
+        vsync = 7;
+    else
+        vsync = 10;
+
+    hperiod = (1000000.0 / CVT_REFRESH - CVT_MIN_VSYNC_BP) /
+        (height + CVT_MIN_V_PORCH);
+    vsync_bp = (int)(CVT_MIN_VSYNC_BP / hperiod) + 1;
+    if (vsync_bp < vsync + CVT_MIN_V_PORCH)
+        vsync_bp = vsync + CVT_MIN_V_PORCH;
+
+    hblank_percentage = CVT_C_PRIME - CVT_M_PRIME * hperiod / 1000.0;
+    if (hblank_percentage < 20)
+        hblank_percentage = 20;
+    hblank = (int)(hdisplay * hblank_percentage / (100.0 - hblank_percentage));
+    hblank -= hblank % (2 * CVT_H_GRANULARITY);
+
+    memset(mode, 0, sizeof(*mode));
+    mode->width = width;
+    mode->height = height;
+    mode->hTotal = hdisplay + hblank;
+    mode->hSyncEnd = hdisplay + hblank / 2;
+    mode->hSyncStart = mode->hSyncEnd -
+        (mode->hTotal * CVT_HSYNC_PERCENTAGE) / 100;
+    mode->hSyncStart += CVT_H_GRANULARITY -
+        mode->hSyncStart % CVT_H_GRANULARITY;
+    mode->vSyncStart = height + CVT_MIN_V_PORCH;
+    mode->vSyncEnd = mode->vSyncStart + vsync;
+    mode->vTotal = height + vsync_bp + CVT_MIN_V_PORCH;
+    clock = (int)(mode->hTotal * 1000.0 / hperiod);
+    clock -= clock % CVT_CLOCK_STEP;
+    mode->dotClock = (unsigned long)clock * 1000;
+    mode->modeFlags = RR_HSyncNegative | RR_VSyncPositive;
+}
+
+static int read_layout(struct monitor *monitors)
+{
+    char line[256];
+    int count = 0;
+    int n;
+
+    while (fgets(line, sizeof(line), stdin)) {
+        struct monitor *m = &monitors[count];
+
+        if (count == MAX_MONITORS)
+            errx(1, "too many monitors");
+        m->width_mm = m->height_mm = -1;
+        n = sscanf(line, "%d %d %d %d %ld %ld", &m->width, &m->height,
+                   &m->x, &m->y, &m->width_mm, &m->height_mm);
+        if (n != 4 && n != 6)
+            errx(1, "invalid layout line: %s", line);
+        if (m->width <= 0 || m->height <= 0 || m->x < 0 || m->y < 0 ||
+                m->x + m->width > MAX_COORD || m->y + m->height > MAX_COORD)
+            errx(1, "invalid monitor geometry %dx%d+%d+%d",
+                 m->width, m->height, m->x, m->y);
+        count++;
+    }
+    return count;
+}
+
+static Display *open_display(const char *name)
+{
+    Display *dpy;
+
+    /* this may be called before Xorg is fully started */
+    while (!(dpy = XOpenDisplay(name)))
+        usleep(100000);
+    return dpy;
+}
+
+static RROutput find_output(Display *dpy, XRRScreenResources *res,
+                            const char *name, XRROutputInfo **info_ret)
+{
+    XRROutputInfo *info;
+    int i;
+
+    for (i = 0; i < res->noutput; i++) {
+        info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+        if (!info)
+            continue;
+        if (strcmp(info->name, name) == 0) {
+            *info_ret = info;
+            return res->outputs[i];
+        }
+        XRRFreeOutputInfo(info);
+    }
+    return None;
+}
+
+static RRMode find_mode(XRRScreenResources *res, const char *name)
+{
+    int i;
+
+    for (i = 0; i < res->nmode; i++)
+        if (strcmp(res->modes[i].name, name) == 0)
+            return res->modes[i].id;
+    return None;
+}
+
+static void ensure_output_mode(Display *dpy, XRRScreenResources *res,
+                               Window root, struct monitor *m)
+{
+    char mode_name[32];
+    XRRModeInfo mode_info;
+    int i;
+
+    snprintf(mode_name, sizeof(mode_name), MODE_NAME_FMT,
+             m->width, m->height);
+    m->mode = find_mode(res, mode_name);
+    if (m->mode == None) {
+        cvt_mode(&mode_info, m->width, m->height);
+        mode_info.name = mode_name;
+        mode_info.nameLength = strlen(mode_name);
+        m->mode = XRRCreateMode(dpy, root, &mode_info);
+    }
+    for (i = 0; i < m->output_info->nmode; i++)
+        if (m->output_info->modes[i] == m->mode)
+            return;
+    XRRAddOutputMode(dpy, m->output, m->mode);
+}
+
+/* keep the CRTC already driving the output, otherwise take the first one
+ * not used by anything else */
+static RRCrtc pick_crtc(struct monitor *monitors, int count, int idx)
+{
+    struct monitor *m = &monitors[idx];
+    int i, j;
+
+    if (m->output_info->crtc != None)
+        return m->output_info->crtc;
+    for (i = 0; i < m->output_info->ncrtc; i++) {
+        RRCrtc crtc = m->output_info->crtcs[i];
+
+        for (j = 0; j < count; j++)
+            if (j != idx && (monitors[j].crtc == crtc ||
+                        monitors[j].output_info->crtc == crtc))
+                break;
+        if (j == count)
+            return crtc;
+    }
+    return None;
+}
+
+static void set_output_mm(Display *dpy, RROutput output, Atom prop, long value)
+{
+    XRRChangeOutputProperty(dpy, output, prop, XA_INTEGER, 32,
+                            PropModeReplace, (unsigned char *)&value, 1);
+}
+
+int main(int argc, char **argv)
+{
+    struct monitor monitors[MAX_MONITORS];
+    const char *display_name = ":0";
+    XRRScreenResources *res;
+    XRRCrtcInfo *crtc_info;
+    Display *dpy;
+    Window root;
+    Atom width_mm_atom, height_mm_atom;
+    int count, i, j, screen, height_mm;
+    int fb_width = 0, fb_height = 0;
+    int min_width, min_height, max_width, max_height;
+    int failed = 0;
+    double dpi;
+
+    (void)argc;
+    (void)argv;
+
+    /* This may be called before qubes-session is fully initialized, so do
+     * not rely on having DISPLAY set from there */
+    if (access("/run/qubes-service/guivm-gui-agent", F_OK) == 0)
+        /* on sys-gui, adjust monitor layout of the parent Xorg */
+        display_name = ":1";
+
+    memset(monitors, 0, sizeof(monitors));
+    count = read_layout(monitors);
+
+    dpy = open_display(display_name);
+    screen = DefaultScreen(dpy);
+    root = RootWindow(dpy, screen);
+    width_mm_atom = XInternAtom(dpy, "WIDTH_MM", False);
+    height_mm_atom = XInternAtom(dpy, "HEIGHT_MM", False);
+    XRRGetScreenSizeRange(dpy, root, &min_width, &min_height,
+                          &max_width, &max_height);
+
+    res = XRRGetScreenResourcesCurrent(dpy, root);
+    if (!res)
+        errx(1, "Failed to get RandR screen resources");
+
+    for (i = 0; i < count; i++) {
+        char output_name[32];
+
+        snprintf(output_name, sizeof(output_name), OUTPUT_NAME_FMT, i);
+        monitors[i].output = find_output(dpy, res, output_name,
+                                         &monitors[i].output_info);
+        if (monitors[i].output == None) {
+            fprintf(stderr, "No output %s, ignoring remaining monitors\n",
+                    output_name);
+            count = i;
+            break;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        monitors[i].crtc = pick_crtc(monitors, count, i);
+        if (monitors[i].crtc == None)
+            errx(1, "No CRTC available for " OUTPUT_NAME_FMT, i);
+        ensure_output_mode(dpy, res, root, &monitors[i]);
+        if (monitors[i].x + monitors[i].width > fb_width)
+            fb_width = monitors[i].x + monitors[i].width;
+        if (monitors[i].y + monitors[i].height > fb_height)
+            fb_height = monitors[i].y + monitors[i].height;
+    }
+    if (fb_width < min_width)
+        fb_width = min_width;
+    if (fb_height < min_height)
+        fb_height = min_height;
+    if (fb_width > max_width || fb_height > max_height)
+        errx(1, "Layout %dx%d exceeds maximum screen size %dx%d",
+             fb_width, fb_height, max_width, max_height);
+    /* adding modes changes the config timestamp, so refresh resources
+     * before using them for the actual configuration */
+    XSync(dpy, False);
+    XRRFreeScreenResources(res);
+    res = XRRGetScreenResourcesCurrent(dpy, root);
+    if (!res)
+        errx(1, "Failed to get RandR screen resources");
+
+    XGrabServer(dpy);
+
+    for (i = 0; i < count; i++) {
+        if (monitors[i].width_mm >= 0) {
+            set_output_mm(dpy, monitors[i].output, width_mm_atom,
+                          monitors[i].width_mm);
+            set_output_mm(dpy, monitors[i].output, height_mm_atom,
+                          monitors[i].height_mm);
+        }
+    }
+
+    /* Disable every CRTC that will not keep its configuration, the screen
+     * cannot be resized while an enabled CRTC does not fit in it. Unused
+     * CRTCs are the ones for outputs that are turned off. */
+    for (i = 0; i < res->ncrtc; i++) {
+        crtc_info = XRRGetCrtcInfo(dpy, res, res->crtcs[i]);
+        if (!crtc_info)
+            continue;
+        if (crtc_info->mode != None) {
+            for (j = 0; j < count; j++)
+                if (monitors[j].crtc == res->crtcs[i])
+                    break;
+            if (j == count ||
+                    crtc_info->mode != monitors[j].mode ||
+                    crtc_info->x != monitors[j].x ||
+                    crtc_info->y != monitors[j].y ||
+                    crtc_info->noutput != 1 ||
+                    crtc_info->outputs[0] != monitors[j].output) {
+                if (XRRSetCrtcConfig(dpy, res, res->crtcs[i], CurrentTime,
+                                     0, 0, None, RR_Rotate_0, NULL, 0) !=
+                        RRSetConfigSuccess) {
+                    warnx("Failed to disable CRTC 0x%lx", res->crtcs[i]);
+                    failed = 1;
+                }
+            }
+        }
+        XRRFreeCrtcInfo(crtc_info);
+    }
+
+    if (fb_width != DisplayWidth(dpy, screen) ||
+            fb_height != DisplayHeight(dpy, screen)) {
+        /* keep the current DPI */
+        height_mm = DisplayHeightMM(dpy, screen);
+        if (height_mm > 0)
+            dpi = 25.4 * DisplayHeight(dpy, screen) / height_mm;
+        else
+            dpi = DEFAULT_DPI;
+        XRRSetScreenSize(dpy, root, fb_width, fb_height,
+                         (int)(25.4 * fb_width / dpi),
+                         (int)(25.4 * fb_height / dpi));
+    }
+
+    for (i = 0; i < count; i++) {
+        if (XRRSetCrtcConfig(dpy, res, monitors[i].crtc, CurrentTime,
+                             monitors[i].x, monitors[i].y, monitors[i].mode,
+                             RR_Rotate_0, &monitors[i].output, 1) !=
+                RRSetConfigSuccess) {
+            warnx("Failed to configure " OUTPUT_NAME_FMT " at %dx%d+%d+%d",
+                  i, monitors[i].width, monitors[i].height,
+                  monitors[i].x, monitors[i].y);
+            failed = 1;
+        }
+    }
+
+    XUngrabServer(dpy);
+    XSync(dpy, False);
+
+    for (i = 0; i < count; i++)
+        XRRFreeOutputInfo(monitors[i].output_info);
+    XRRFreeScreenResources(res);
+
+    /* Let the server re-probe outputs, so the ones enabled for the first
+     * time get reported as connected */
+    res = XRRGetScreenResources(dpy, root);
+    if (res)
+        XRRFreeScreenResources(res);
+
+    XCloseDisplay(dpy);
+    return failed;
+}
@@ -0,0 +1,169 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Test of the counters gui-agent writes to its stats file (agent-stats.c):
+ * the exact "name value" lines, as read by the test harness, the validation
+ * of the grant table usage published by dummyqbs, and its pixmap size
+ * classes (grant-stats.h).
+ *
+ * Usage: agent-stats-test */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agent-stats.h"
+
+static int failures;
+
+/* Compare the output of write(), run on a memory stream, to expected */
+#define CHECK_OUTPUT(write, expected) do { \
+        char *buf = NULL; \
+        size_t len = 0; \
+        FILE *f = open_memstream(&buf, &len); \
+        if (!f) { \
+            perror("open_memstream"); \
+            exit(1); \
+        } \
+        write; \
+        fclose(f); \
+        if (strcmp(buf, expected)) { \
+            fprintf(stderr, "%s:%d: got:\n%sexpected:\n%s", __FILE__, \
+                    __LINE__, buf, expected); \
+            failures++; \
+        } \
+        free(buf); \
+    } while (0)
+
+static void test_resync_stats(void)
+{
+    struct resync_stats st = { 0 };
+
+    /* no resync yet: nothing, rather than misleading zero durations */
+    CHECK_OUTPUT(resync_stats_write(f, &st), "");
+
+    resync_stats_add(&st, 120, 3, 45, 2);
+    CHECK_OUTPUT(resync_stats_write(f, &st),
+                 "resync.count 1\n"
+                 "resync.windows 120\n"
+                 "resync.skipped 3\n"
+                 "resync.last.windows 120\n"
+                 "resync.last.skipped 3\n"
+                 "resync.last.time_ms 45\n"
+                 "resync.last.query_time_ms 2\n"
+                 "resync.max_time_ms 45\n");
+
+    /* a shorter one keeps the maximum */
+    resync_stats_add(&st, 80, 0, 20, 1);
+    CHECK_OUTPUT(resync_stats_write(f, &st),
+                 "resync.count 2\n"
+                 "resync.windows 200\n"
+                 "resync.skipped 3\n"
+                 "resync.last.windows 80\n"
+                 "resync.last.skipped 0\n"
+                 "resync.last.time_ms 20\n"
+                 "resync.last.query_time_ms 1\n"
+                 "resync.max_time_ms 45\n");
+}
+
+static void test_grant_stats(void)
+{
+    long values[GRANT_STATS_COUNT + 1];
+    uint32_t stats[GRANT_STATS_COUNT];
+    int i;
+
+    for (i = 0; i < GRANT_STATS_COUNT + 1; i++)
+        values[i] = 100 + i;
+    values[GRANT_STATS_VERSION_IDX] = GRANT_STATS_VERSION;
+    if (!grant_stats_parse(stats, values, GRANT_STATS_COUNT)) {
+        fprintf(stderr, "grant stats: valid property rejected\n");
+        failures++;
+    }
+    CHECK_OUTPUT(grant_stats_write(f, stats),
+                 "grant.shared_pages 101\n"
+                 "grant.peak_shared_pages 102\n"
+                 "grant.alloc_failures 103\n"
+                 "window_dump.ack_queue_depth 104\n"
+                 "window_dump.ack_queue_max_depth 105\n"
+                 "grant.pixmaps.4k 106\n"
+                 "grant.pixmaps.64k 107\n"
+                 "grant.pixmaps.1m 108\n"
+                 "grant.pixmaps.8m 109\n"
+                 "grant.pixmaps.32m 110\n"
+                 "grant.pixmaps.larger 111\n");
+
+    /* another layout must not be misread */
+    if (grant_stats_parse(stats, values, GRANT_STATS_COUNT - 1) ||
+            grant_stats_parse(stats, values, GRANT_STATS_COUNT + 1)) {
+        fprintf(stderr, "grant stats: wrong item count accepted\n");
+        failures++;
+    }
+    values[GRANT_STATS_VERSION_IDX] = GRANT_STATS_VERSION + 1;
+    if (grant_stats_parse(stats, values, GRANT_STATS_COUNT)) {
+        fprintf(stderr, "grant stats: unknown version accepted\n");
+        failures++;
+    }
+}
+
+static void test_grant_size_classes(void)
+{
+    static const struct {
+        size_t pages;
+        enum grant_stats class;
+    } cases[] = {
+        { 0, GRANT_STATS_PIXMAPS_4K },
+        { 1, GRANT_STATS_PIXMAPS_4K },
+        { 2, GRANT_STATS_PIXMAPS_64K },
+        { 16, GRANT_STATS_PIXMAPS_64K },
+        { 17, GRANT_STATS_PIXMAPS_1M },
+        { 256, GRANT_STATS_PIXMAPS_1M },
+        { 257, GRANT_STATS_PIXMAPS_8M },
+        { 2048, GRANT_STATS_PIXMAPS_8M },
+        /* a 1920x1080 32 bpp window */
+        { 2025, GRANT_STATS_PIXMAPS_8M },
+        { 2049, GRANT_STATS_PIXMAPS_32M },
+        { 8192, GRANT_STATS_PIXMAPS_32M },
+        /* a 3840x2160 one */
+        { 8100, GRANT_STATS_PIXMAPS_32M },
+        { 8193, GRANT_STATS_PIXMAPS_LARGER },
+        { 1 << 20, GRANT_STATS_PIXMAPS_LARGER },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (grant_stats_size_class(cases[i].pages) != cases[i].class) {
+            fprintf(stderr, "grant stats: %zu pages in class %d, not %d\n",
+                    cases[i].pages, grant_stats_size_class(cases[i].pages),
+                    cases[i].class);
+            failures++;
+        }
+    }
+}
+
+int main(void)
+{
+    test_resync_stats();
+    test_grant_stats();
+    test_grant_size_classes();
+    if (failures)
+        return 1;
+    printf("agent-stats-test: ok\n");
+    return 0;
+}
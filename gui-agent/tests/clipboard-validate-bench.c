@@ -0,0 +1,120 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Micro-benchmark of clipboard validation: is_valid_clipboard_string_from_vm()
+ * (one byte at a time) against is_valid_clipboard_buffer_from_vm()
+ * (vectorized), on plain ASCII text, on text with some UTF-8 and on text with
+ * UTF-8 in every word.
+ *
+ * Usage: clipboard-validate-bench [size_in_bytes] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "encoding.h"
+
+/* repeat each measurement for at least this long */
+#define MIN_TIME_NS 200000000LL
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Lines of text; every utf8_every-th word is "zażółć" if utf8_every != 0 */
+static void fill_text(unsigned char *buf, size_t len, int utf8_every)
+{
+    static const char word[] = "lorem ";
+    static const char utf8_word[] = "za\xc5\xbc\xc3\xb3\xc5\x82\xc4\x87 ";
+    size_t i = 0;
+    int n = 0;
+
+    while (i < len) {
+        const char *w = utf8_every && ++n % utf8_every == 0 ? utf8_word : word;
+        size_t wlen = strlen(w);
+
+        if (n % 12 == 0) {
+            buf[i++] = '\n';
+            continue;
+        }
+        if (wlen > len - i)
+            w = word, wlen = 1;
+        memcpy(buf + i, w, wlen);
+        i += wlen;
+    }
+    buf[len] = 0;
+}
+
+/* Return ns per call */
+static double bench(unsigned char *buf, size_t len, int vectorized)
+{
+    long long start = now_ns(), elapsed;
+    long calls = 0;
+    bool ok = true;
+
+    do {
+        if (vectorized)
+            ok &= is_valid_clipboard_buffer_from_vm(buf, len);
+        else
+            ok &= is_valid_clipboard_string_from_vm(buf);
+        calls++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_TIME_NS);
+    if (!ok) {
+        fprintf(stderr, "benchmark input rejected\n");
+        exit(1);
+    }
+    return (double)elapsed / calls;
+}
+
+static void run(const char *name, unsigned char *buf, size_t len)
+{
+    double old_ns = bench(buf, len, 0);
+    double new_ns = bench(buf, len, 1);
+    double mib = len / (1024.0 * 1024.0);
+
+    printf("%-10s %8zu bytes: byte at a time %8.1f MiB/s, "
+           "vectorized %8.1f MiB/s, %5.1fx\n",
+           name, len, mib / (old_ns / 1e9), mib / (new_ns / 1e9),
+           old_ns / new_ns);
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoul(argv[1], NULL, 0) : 4 << 20;
+    unsigned char *buf = malloc(len + 1);
+
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    fill_text(buf, len, 0);
+    run("ascii", buf, len);
+    fill_text(buf, len, 8);
+    run("utf-8", buf, len);
+    fill_text(buf, len, 1);
+    run("utf-8 only", buf, len);
+    free(buf);
+    return 0;
+}
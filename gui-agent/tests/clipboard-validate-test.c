@@ -0,0 +1,215 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Differential test of is_valid_clipboard_buffer_from_vm() against the
+ * byte at a time is_valid_clipboard_string_from_vm(), on random inputs that
+ * are mostly plain ASCII with \r, NULL, control characters, valid and
+ * invalid UTF-8 mixed in, at every alignment. Some inputs are only valid
+ * characters, dense UTF-8 included, with at most one byte changed, so that
+ * the vectorized UTF-8 check sees long valid runs and errors at every
+ * position within its blocks.
+ *
+ * Usage: clipboard-validate-test [iterations [seed]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "encoding.h"
+
+#define MAX_LEN 4096
+/* room for misaligning the buffer by up to 63 bytes */
+#define ALIGN_SLACK 64
+
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* Append a random UTF-8 sequence, valid or not, return its length */
+static size_t put_utf8(unsigned char *p, size_t room)
+{
+    static const unsigned char leads[] = {
+        0xC0, 0xC1, 0xC2, 0xDF, 0xE0, 0xE1, 0xEC, 0xED, 0xEE, 0xEF,
+        0xF0, 0xF1, 0xF3, 0xF4, 0xF5, 0xFF, 0x80, 0xBF,
+    };
+    size_t n = 1 + rng() % 4, i;
+
+    if (n > room)
+        n = room;
+    if (rng() % 2) {
+        /* a valid code point */
+        uint32_t cp = 0x80 + rng() % 0x10FF80;
+
+        if (cp >= 0xD800 && cp <= 0xDFFF)
+            cp -= 0x800;
+        if (cp < 0x800 && room >= 2) {
+            p[0] = 0xC0 | cp >> 6;
+            p[1] = 0x80 | (cp & 0x3F);
+            return 2;
+        } else if (cp < 0x10000 && room >= 3) {
+            p[0] = 0xE0 | cp >> 12;
+            p[1] = 0x80 | ((cp >> 6) & 0x3F);
+            p[2] = 0x80 | (cp & 0x3F);
+            return 3;
+        } else if (room >= 4) {
+            p[0] = 0xF0 | cp >> 18;
+            p[1] = 0x80 | ((cp >> 12) & 0x3F);
+            p[2] = 0x80 | ((cp >> 6) & 0x3F);
+            p[3] = 0x80 | (cp & 0x3F);
+            return 4;
+        }
+    }
+    /* an interesting lead byte followed by random tails */
+    p[0] = leads[rng() % sizeof(leads)];
+    for (i = 1; i < n; i++)
+        p[i] = rng() % 4 ? 0x80 + rng() % 0x40 : rng() % 256;
+    return n;
+}
+
+static void fill(unsigned char *buf, size_t len)
+{
+    size_t i = 0;
+    /* per buffer probability of a special character, so that both long
+     * plain runs and dense special cases are covered */
+    uint32_t special = 1 + rng() % 64;
+
+    while (i < len) {
+        uint32_t r = rng();
+
+        if (r % special) {
+            buf[i++] = 0x20 + rng() % 0x5F;
+            continue;
+        }
+        switch (rng() % 6) {
+        case 0:
+            buf[i++] = '\r';
+            if (i < len && rng() % 2)
+                buf[i++] = '\n';
+            break;
+        case 1:
+            buf[i++] = rng() % 2 ? '\n' : '\t';
+            break;
+        case 2:
+            /* other control characters, DEL, and rarely NULL */
+            buf[i++] = rng() % 8 ? rng() % 0x20 : rng() % 2 ? 0x7F : 0;
+            break;
+        default:
+            i += put_utf8(buf + i, len - i);
+            break;
+        }
+    }
+}
+
+/* Whether the n bytes at p form valid characters on their own */
+static bool is_valid_clipboard_string_from_vm_n(const unsigned char *p,
+                                                size_t n)
+{
+    unsigned char tmp[8];
+
+    memcpy(tmp, p, n);
+    tmp[n] = 0;
+    return is_valid_clipboard_string_from_vm(tmp);
+}
+
+/* Only valid characters, then maybe one random byte */
+static void fill_valid(unsigned char *buf, size_t len)
+{
+    static const char *const plain[] = { "\r\n", "\n", "\t", "a" };
+    size_t i = 0, n;
+    uint32_t ascii = rng() % 4;
+
+    while (i < len) {
+        if (rng() % 4 < ascii) {
+            n = rng() % 4;
+            if (strlen(plain[n]) > len - i)
+                n = 3;
+            memcpy(buf + i, plain[n], strlen(plain[n]));
+            i += strlen(plain[n]);
+            if (n == 3)
+                buf[i - 1] = 0x20 + rng() % 0x5F;
+            continue;
+        }
+        /* put_utf8() writes an invalid sequence or one that does not fit,
+         * undo it */
+        n = put_utf8(buf + i, len - i);
+        if (is_valid_clipboard_string_from_vm_n(buf + i, n))
+            i += n;
+        else
+            buf[i++] = 'b';
+    }
+    if (len && rng() % 2)
+        buf[rng() % len] = rng() % 256;
+}
+
+static void dump(const unsigned char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        fprintf(stderr, "%02x%c", buf[i], i % 32 == 31 ? '\n' : ' ');
+    fputc('\n', stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned char storage[MAX_LEN + 1 + ALIGN_SLACK];
+    static unsigned char copy[MAX_LEN + 1];
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    unsigned long i, accepted = 0;
+
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x9E3779B97F4A7C15ULL;
+    if (!rng_state)
+        rng_state = 1;
+
+    for (i = 0; i < iterations; i++) {
+        /* mostly short inputs, around the vector widths, some long ones */
+        size_t len = rng() % 8 ? rng() % 130 : rng() % (MAX_LEN + 1);
+        unsigned char *buf = storage + rng() % ALIGN_SLACK;
+        bool old_ret, new_ret;
+
+        if (rng() % 4)
+            fill(buf, len);
+        else
+            fill_valid(buf, len);
+        buf[len] = 0;
+        memcpy(copy, buf, len + 1);
+
+        old_ret = is_valid_clipboard_string_from_vm(copy);
+        new_ret = is_valid_clipboard_buffer_from_vm(buf, len);
+        if (old_ret != new_ret) {
+            fprintf(stderr,
+                    "mismatch at iteration %lu (len %zu): old %d, new %d\n",
+                    i, len, old_ret, new_ret);
+            dump(buf, len);
+            return 1;
+        }
+        accepted += old_ret;
+    }
+    printf("clipboard-validate-test: %lu inputs, %lu accepted, no mismatch\n",
+           iterations, accepted);
+    return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Benchmark of damage reporting: XDamage events against the damage ring.
+ *
+ * The ring part runs a producer and a consumer thread following the protocol
+ * of damage-ring.h, with the same steps as dummy_damage_publish() and
+ * drain_damage_ring(); the 'D' xdriver command is replaced by an eventfd. It
+ * also checks that every rectangle arrives in order, including with a ring
+ * small enough to be full most of the time, which exercises the
+ * producer_waiting handshake: a lost wakeup shows as a timeout.
+ *
+ * The XDamage part needs an X server ($DISPLAY). It draws rectangles into a
+ * window and receives their DamageNotify events (DamageReportRawRectangles,
+ * like gui-agent), and subtracts the time of the same drawing without a
+ * damage object. The damage accumulation inside the X server, which both
+ * paths share, is not part of the ring figure.
+ *
+ * Usage: damage-ring-bench [rects_per_frame [frames]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "damage-ring.h"
+
+/* a wakeup not arriving within this time is considered lost */
+#define WAKEUP_TIMEOUT_MS 5000
+#define RECT_SIZE 8
+
+struct ring_bench {
+    struct damage_ring *ring;
+    int event_fd;   /* producer -> consumer, like the ring eventfd */
+    int wakeup_fd;  /* consumer -> producer, like the 'D' xdriver command */
+    unsigned int frames;
+    unsigned int rects;
+    /* results */
+    unsigned long consumer_wakeups;
+    unsigned long producer_wakeups;
+    int failed;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Block until fd is readable and consume its counter; 0 on timeout */
+static int wait_eventfd(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t count;
+    int ret;
+
+    do
+        ret = poll(&pfd, 1, WAKEUP_TIMEOUT_MS);
+    while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return 0;
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return 1;
+}
+
+static void signal_eventfd(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+        perror("write eventfd");
+}
+
+static void *ring_producer(void *arg)
+{
+    struct ring_bench *b = arg;
+    struct damage_ring *ring = b->ring;
+    uint32_t head, tail, start, seq = 0;
+    unsigned int frame, pending;
+
+    for (frame = 0; frame < b->frames; frame++) {
+        pending = b->rects;
+        while (pending) {
+            /* dummy_damage_publish(), one rectangle per window */
+            head = start = ring->head;
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            while (pending) {
+                struct damage_ring_rect *rect;
+
+                if (ring->entries - (head - tail) < 1) {
+                    __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+                    tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+                    if (ring->entries - (head - tail) < 1)
+                        break;
+                    __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+                }
+                rect = &ring->rects[head & (ring->entries - 1)];
+                rect->window = seq++;
+                rect->x = (seq % 64) * RECT_SIZE;
+                rect->y = (seq / 64 % 64) * RECT_SIZE;
+                rect->width = RECT_SIZE;
+                rect->height = RECT_SIZE;
+                head++;
+                pending--;
+            }
+            if (head != start) {
+                __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+                signal_eventfd(b->event_fd);
+            }
+            /* the X server waits for 'D' in its main loop */
+            if (pending) {
+                if (!wait_eventfd(b->wakeup_fd)) {
+                    fprintf(stderr, "producer: lost 'D' wakeup at rect %u\n",
+                            seq);
+                    b->failed = 1;
+                    return NULL;
+                }
+                b->producer_wakeups++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *ring_consumer(void *arg)
+{
+    struct ring_bench *b = arg;
+    struct damage_ring *ring = b->ring;
+    uint64_t total = (uint64_t)b->frames * b->rects;
+    uint32_t head, tail, expected = 0;
+
+    while (expected < total) {
+        if (!wait_eventfd(b->event_fd)) {
+            fprintf(stderr, "consumer: no damage after rect %u\n", expected);
+            b->failed = 1;
+            return NULL;
+        }
+        b->consumer_wakeups++;
+        /* drain_damage_ring() */
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        tail = ring->tail;
+        for (; tail != head; tail++) {
+            struct damage_ring_rect rect = ring->rects[tail & (ring->entries - 1)];
+
+            if (rect.window != expected) {
+                fprintf(stderr, "consumer: got rect %u, expected %u\n",
+                        rect.window, expected);
+                b->failed = 1;
+                return NULL;
+            }
+            expected++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&ring->producer_waiting, 0, __ATOMIC_ACQ_REL))
+            signal_eventfd(b->wakeup_fd);
+    }
+    return NULL;
+}
+
+static int run_ring(uint32_t entries, unsigned int rects, unsigned int frames)
+{
+    struct ring_bench b = { .frames = frames, .rects = rects };
+    pthread_t producer, consumer;
+    long long start, elapsed;
+    size_t size = DAMAGE_RING_SIZE(entries);
+
+    /* aligned_alloc() wants a multiple of the alignment */
+    b.ring = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!b.ring) {
+        perror("aligned_alloc");
+        return 1;
+    }
+    memset(b.ring, 0, size);
+    b.ring->version = DAMAGE_RING_VERSION;
+    b.ring->entries = entries;
+    b.event_fd = eventfd(0, EFD_CLOEXEC);
+    b.wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (b.event_fd < 0 || b.wakeup_fd < 0) {
+        perror("eventfd");
+        return 1;
+    }
+
+    start = now_ns();
+    if (pthread_create(&consumer, NULL, ring_consumer, &b) ||
+            pthread_create(&producer, NULL, ring_producer, &b)) {
+        fprintf(stderr, "pthread_create failed\n");
+        return 1;
+    }
+    pthread_join(producer, NULL);
+    if (b.failed)
+        /* the consumer would wait for rectangles never published */
+        signal_eventfd(b.event_fd);
+    pthread_join(consumer, NULL);
+    elapsed = now_ns() - start;
+
+    if (!b.failed)
+        printf("ring    %5u entries: %7.1f ns/rect, %lu agent wakeups, "
+               "%lu 'D' wakeups\n", entries,
+               (double)elapsed / ((double)frames * rects),
+               b.consumer_wakeups, b.producer_wakeups);
+    close(b.event_fd);
+    close(b.wakeup_fd);
+    free(b.ring);
+    return b.failed;
+}
+
+/* Draw frames of rects small rectangles; with damage, also receive their
+ * DamageNotify events. Returns the elapsed time in ns. */
+static long long run_xdamage_frames(Display *dpy, Window win, GC gc,
+                                    int damage_event, Bool with_damage,
+                                    unsigned int rects, unsigned int frames,
+                                    unsigned long *events)
+{
+    Damage damage = None;
+    XEvent ev;
+    long long start;
+    unsigned int frame, i;
+
+    if (with_damage)
+        damage = XDamageCreate(dpy, win, XDamageReportRawRectangles);
+    XSync(dpy, False);
+    while (XPending(dpy))
+        XNextEvent(dpy, &ev);
+
+    *events = 0;
+    start = now_ns();
+    for (frame = 0; frame < frames; frame++) {
+        for (i = 0; i < rects; i++)
+            XFillRectangle(dpy, win, gc, (i % 64) * RECT_SIZE,
+                           (i / 64 % 64) * RECT_SIZE, RECT_SIZE, RECT_SIZE);
+        /* all the events generated by the drawing are queued after this */
+        XSync(dpy, False);
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            if (ev.type == damage_event + XDamageNotify)
+                (*events)++;
+        }
+    }
+    start = now_ns() - start;
+    if (with_damage)
+        XDamageDestroy(dpy, damage);
+    return start;
+}
+
+static int run_xdamage(unsigned int rects, unsigned int frames)
+{
+    Display *dpy = XOpenDisplay(NULL);
+    Window win;
+    GC gc;
+    XEvent ev;
+    int damage_event, damage_error;
+    long long plain_ns, damage_ns;
+    unsigned long events;
+
+    if (!dpy) {
+        printf("xdamage: no X server, skipped\n");
+        return 0;
+    }
+    if (!XDamageQueryExtension(dpy, &damage_event, &damage_error)) {
+        printf("xdamage: no DAMAGE extension, skipped\n");
+        XCloseDisplay(dpy);
+        return 0;
+    }
+    win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0,
+                              64 * RECT_SIZE, 64 * RECT_SIZE, 0, 0, 0);
+    XSelectInput(dpy, win, ExposureMask);
+    XMapWindow(dpy, win);
+    do
+        XNextEvent(dpy, &ev);
+    while (ev.type != Expose);
+    gc = XCreateGC(dpy, win, 0, NULL);
+
+    plain_ns = run_xdamage_frames(dpy, win, gc, damage_event, False,
+                                  rects, frames, &events);
+    damage_ns = run_xdamage_frames(dpy, win, gc, damage_event, True,
+                                   rects, frames, &events);
+    /* X events are 32 bytes each */
+    printf("xdamage              : %7.1f ns/rect, %lu events, %lu bytes "
+           "on the wire\n",
+           (double)(damage_ns - plain_ns) / ((double)frames * rects),
+           events, events * 32);
+
+    XFreeGC(dpy, gc);
+    XDestroyWindow(dpy, win);
+    XCloseDisplay(dpy);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int rects = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+    unsigned int frames = argc > 2 ? strtoul(argv[2], NULL, 0) : 2000;
+    int ret = 0;
+
+    if (!rects || !frames) {
+        fprintf(stderr, "Usage: %s [rects_per_frame [frames]]\n", argv[0]);
+        return 1;
+    }
+    printf("%u frames of %u rects\n", frames, rects);
+    ret |= run_ring(DAMAGE_RING_ENTRIES, rects, frames);
+    /* full most of the time */
+    ret |= run_ring(64, rects, frames);
+    ret |= run_xdamage(rects, frames);
+    return ret;
+}
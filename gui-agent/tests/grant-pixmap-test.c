@@ -0,0 +1,171 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Test that client pixmaps are grant-backed memory, with glamor too (see
+ * qubes_create_pixmap() in dummyqbs): creating and freeing pixmaps must show
+ * in the pages and pixmap size classes that dummyqbs publishes in the
+ * _QUBES_GRANT_STATS root property (grant-stats.h), and content drawn into
+ * them and copied between them must read back unchanged.
+ *
+ * It needs the dummyqbs X server ($DISPLAY), and is skipped without it. The
+ * counters are global, so other clients allocating at the same time could
+ * make it fail; run it on an idle server.
+ *
+ * Usage: grant-pixmap-test */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+#include "grant-stats.h"
+
+#define PIXMAPS 4
+#define PIXMAP_SIZE 1024
+/* depth 24 is stored in 32 bits per pixel */
+#define PIXMAP_PAGES (PIXMAP_SIZE * PIXMAP_SIZE * 4 / 4096)
+
+/* Wait for the next update of the property and read it; 0 if there is
+ * none, e.g. not dummyqbs */
+static int read_grant_stats(Display *dpy, long stats[GRANT_STATS_COUNT])
+{
+    Atom atom = XInternAtom(dpy, GRANT_STATS_PROP, False);
+    Atom act_type;
+    int act_fmt;
+    unsigned long nitems, bytes_after;
+    unsigned char *data;
+    int ret = 0;
+
+    XSync(dpy, False);
+    usleep((GRANT_STATS_UPDATE_INTERVAL + 200) * 1000);
+    if (XGetWindowProperty(dpy, DefaultRootWindow(dpy), atom, 0,
+                GRANT_STATS_COUNT, False, XA_CARDINAL, &act_type, &act_fmt,
+                &nitems, &bytes_after, &data) != Success)
+        return 0;
+    if (act_type == XA_CARDINAL && act_fmt == 32 &&
+            nitems == GRANT_STATS_COUNT &&
+            ((long *)data)[GRANT_STATS_VERSION_IDX] == GRANT_STATS_VERSION) {
+        memcpy(stats, data, GRANT_STATS_COUNT * sizeof(long));
+        ret = 1;
+    }
+    XFree(data);
+    return ret;
+}
+
+/* Fill a pixmap with a pattern through XPutImage, copy it into another one
+ * and compare what the server reads back from the copy */
+static int check_content(Display *dpy, Pixmap src, Pixmap dst)
+{
+    int screen = DefaultScreen(dpy);
+    GC gc = XCreateGC(dpy, src, 0, NULL);
+    XImage *image, *copy;
+    int x, y, ret = 1;
+
+    image = XGetImage(dpy, src, 0, 0, PIXMAP_SIZE, PIXMAP_SIZE, AllPlanes,
+                      ZPixmap);
+    if (!image)
+        return 0;
+    for (y = 0; y < PIXMAP_SIZE; y++)
+        for (x = 0; x < PIXMAP_SIZE; x++)
+            XPutPixel(image, x, y, (x * 2654435761U ^ y * 40503U) & 0xffffff);
+    XPutImage(dpy, src, gc, image, 0, 0, 0, 0, PIXMAP_SIZE, PIXMAP_SIZE);
+    XSetForeground(dpy, gc, BlackPixel(dpy, screen));
+    XFillRectangle(dpy, dst, gc, 0, 0, PIXMAP_SIZE, PIXMAP_SIZE);
+    XCopyArea(dpy, src, dst, gc, 0, 0, PIXMAP_SIZE, PIXMAP_SIZE, 0, 0);
+    copy = XGetImage(dpy, dst, 0, 0, PIXMAP_SIZE, PIXMAP_SIZE, AllPlanes,
+                     ZPixmap);
+    if (!copy) {
+        ret = 0;
+    } else {
+        for (y = 0; y < PIXMAP_SIZE && ret; y++)
+            for (x = 0; x < PIXMAP_SIZE && ret; x++)
+                if (XGetPixel(copy, x, y) != XGetPixel(image, x, y)) {
+                    fprintf(stderr, "content differs at %d,%d\n", x, y);
+                    ret = 0;
+                }
+        XDestroyImage(copy);
+    }
+    XDestroyImage(image);
+    XFreeGC(dpy, gc);
+    return ret;
+}
+
+int main(void)
+{
+    Display *dpy = XOpenDisplay(NULL);
+    long before[GRANT_STATS_COUNT], during[GRANT_STATS_COUNT];
+    long after[GRANT_STATS_COUNT];
+    Pixmap pixmaps[PIXMAPS];
+    int i, ret = 0;
+
+    if (!dpy) {
+        printf("grant-pixmap-test: no X server, skipped\n");
+        return 0;
+    }
+    if (DefaultDepth(dpy, DefaultScreen(dpy)) != 24 ||
+            !read_grant_stats(dpy, before)) {
+        printf("grant-pixmap-test: not dummyqbs, skipped\n");
+        XCloseDisplay(dpy);
+        return 0;
+    }
+
+    for (i = 0; i < PIXMAPS; i++)
+        pixmaps[i] = XCreatePixmap(dpy, DefaultRootWindow(dpy), PIXMAP_SIZE,
+                                   PIXMAP_SIZE, 24);
+    if (!check_content(dpy, pixmaps[0], pixmaps[1])) {
+        fprintf(stderr, "grant-pixmap-test: pixmap content not preserved\n");
+        ret = 1;
+    }
+    read_grant_stats(dpy, during);
+    if (during[GRANT_STATS_PIXMAPS_8M] - before[GRANT_STATS_PIXMAPS_8M] <
+                PIXMAPS ||
+            during[GRANT_STATS_SHARED_PAGES] -
+                before[GRANT_STATS_SHARED_PAGES] < PIXMAPS * PIXMAP_PAGES) {
+        fprintf(stderr, "grant-pixmap-test: %d pixmaps of %d pages not "
+                "shared: pixmaps.8m %ld -> %ld, shared_pages %ld -> %ld\n",
+                PIXMAPS, PIXMAP_PAGES, before[GRANT_STATS_PIXMAPS_8M],
+                during[GRANT_STATS_PIXMAPS_8M],
+                before[GRANT_STATS_SHARED_PAGES],
+                during[GRANT_STATS_SHARED_PAGES]);
+        ret = 1;
+    }
+
+    for (i = 0; i < PIXMAPS; i++)
+        XFreePixmap(dpy, pixmaps[i]);
+    read_grant_stats(dpy, after);
+    if (during[GRANT_STATS_PIXMAPS_8M] - after[GRANT_STATS_PIXMAPS_8M] <
+                PIXMAPS ||
+            during[GRANT_STATS_SHARED_PAGES] -
+                after[GRANT_STATS_SHARED_PAGES] < PIXMAPS * PIXMAP_PAGES) {
+        fprintf(stderr, "grant-pixmap-test: freed pixmaps still shared: "
+                "pixmaps.8m %ld -> %ld, shared_pages %ld -> %ld\n",
+                during[GRANT_STATS_PIXMAPS_8M], after[GRANT_STATS_PIXMAPS_8M],
+                during[GRANT_STATS_SHARED_PAGES],
+                after[GRANT_STATS_SHARED_PAGES]);
+        ret = 1;
+    }
+    if (!ret)
+        printf("grant-pixmap-test: %d pixmaps of %d pages shared and "
+               "unshared, content preserved\n", PIXMAPS, PIXMAP_PAGES);
+    XCloseDisplay(dpy);
+    return ret;
+}
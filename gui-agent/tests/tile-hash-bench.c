@@ -0,0 +1,115 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Micro-benchmark of the TileHash tile hash of dummyqbs (dummy_hash.h):
+ * hashing every 64x64 tile of a 32 bpp frame, as a full screen repaint does
+ * on the X server main thread. A large frame does not fit in the cache, so
+ * a small one (e.g. 256x256) shows the speed of the hash itself.
+ *
+ * Usage: tile-hash-bench [width height] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dummy_hash.h"
+
+#define TILE_SIZE 64
+#define BPP 4
+/* repeat each measurement for at least this long */
+#define MIN_TIME_NS 200000000LL
+
+typedef uint64_t hash_fn(const uint8_t *data, int stride, int width_bytes,
+                         int height);
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Return ms per frame */
+static double bench(hash_fn *fn, const uint8_t *frame, int width, int height)
+{
+    long long start = now_ns(), elapsed;
+    long frames = 0;
+    uint64_t sum = 0;
+    int stride = width * BPP, x, y, w, h;
+
+    do {
+        for (y = 0; y < height; y += TILE_SIZE) {
+            for (x = 0; x < width; x += TILE_SIZE) {
+                w = width - x < TILE_SIZE ? width - x : TILE_SIZE;
+                h = height - y < TILE_SIZE ? height - y : TILE_SIZE;
+                sum += fn(frame + (size_t)y * stride + x * BPP, stride,
+                          w * BPP, h);
+            }
+        }
+        frames++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_TIME_NS);
+    /* keep the hashes alive */
+    if (sum == 42)
+        printf("\n");
+    return elapsed / 1e6 / frames;
+}
+
+int main(int argc, char **argv)
+{
+    int width = argc > 2 ? atoi(argv[1]) : 3840;
+    int height = argc > 2 ? atoi(argv[2]) : 2160;
+    size_t size, i;
+    uint8_t *frame;
+    double scalar_ms;
+
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "invalid frame size\n");
+        return 1;
+    }
+    size = (size_t)width * height * BPP;
+    frame = malloc(size);
+    if (!frame) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < size; i++)
+        frame[i] = i * 2654435761U >> 13;
+
+    scalar_ms = bench(dummy_hash_block_scalar, frame, width, height);
+    printf("tile hash %dx%d frame: scalar %.2f ms", width, height, scalar_ms);
+#ifdef __SSE2__
+    {
+        double sse2_ms = bench(dummy_hash_block_sse2, frame, width, height);
+
+        printf(", sse2 %.2f ms, %.1fx", sse2_ms, scalar_ms / sse2_ms);
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        double avx2_ms = bench(dummy_hash_block_avx2, frame, width, height);
+
+        printf(", avx2 %.2f ms, %.1fx", avx2_ms, scalar_ms / avx2_ms);
+    }
+#endif
+    printf("\n");
+    free(frame);
+    return 0;
+}
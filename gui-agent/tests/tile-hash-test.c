@@ -0,0 +1,175 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Test of the TileHash tile hash of dummyqbs (dummy_hash.h): every variant
+ * must notice the changes a repaint typically makes to a tile - a single bit,
+ * two pixels, two rows or two 16 byte stripes swapped - on random tiles of
+ * every width up to a full 64 pixel, 32 bpp tile row.
+ *
+ * Usage: tile-hash-test [tiles [seed]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dummy_hash.h"
+
+#define TILE_SIZE 64
+#define BPP 4
+/* wider than a tile row, like the stride of a window pixmap */
+#define STRIDE (TILE_SIZE * BPP + 48)
+
+typedef uint64_t hash_fn(const uint8_t *data, int stride, int width_bytes,
+                         int height);
+
+static const struct {
+    const char *name;
+    hash_fn *fn;
+} variants[] = {
+    { "scalar", dummy_hash_block_scalar },
+#ifdef __SSE2__
+    { "sse2", dummy_hash_block_sse2 },
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", dummy_hash_block_avx2 },
+#endif
+};
+
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void swap_bytes(uint8_t *a, uint8_t *b, size_t len)
+{
+    uint8_t t;
+
+    while (len--) {
+        t = *a;
+        *a++ = *b;
+        *b++ = t;
+    }
+}
+
+/* Apply a random change to the tile and return its description, or NULL if
+ * the change happens to leave the tile as it was */
+static const char *mutate(uint8_t *tile, int width, int height)
+{
+    int x1, x2, y1, y2, len;
+
+    switch (rng() % 4) {
+    case 0:
+        y1 = rng() % height;
+        x1 = rng() % width;
+        tile[y1 * STRIDE + x1] ^= 1 << (rng() % 8);
+        return "bit flip";
+    case 1:
+        if (width < 2 * BPP)
+            return NULL;
+        y1 = rng() % height;
+        x1 = rng() % (width / BPP) * BPP;
+        x2 = rng() % (width / BPP) * BPP;
+        if (x1 == x2 || !memcmp(tile + y1 * STRIDE + x1,
+                                tile + y1 * STRIDE + x2, BPP))
+            return NULL;
+        swap_bytes(tile + y1 * STRIDE + x1, tile + y1 * STRIDE + x2, BPP);
+        return "pixel swap";
+    case 2:
+        y1 = rng() % height;
+        y2 = rng() % height;
+        if (y1 == y2 || !memcmp(tile + y1 * STRIDE, tile + y2 * STRIDE, width))
+            return NULL;
+        swap_bytes(tile + y1 * STRIDE, tile + y2 * STRIDE, width);
+        return "row swap";
+    default:
+        len = 16;
+        if (width < 2 * len)
+            return NULL;
+        y1 = rng() % height;
+        x1 = rng() % (width / len) * len;
+        x2 = rng() % (width / len) * len;
+        if (x1 == x2 || !memcmp(tile + y1 * STRIDE + x1,
+                                tile + y1 * STRIDE + x2, len))
+            return NULL;
+        swap_bytes(tile + y1 * STRIDE + x1, tile + y1 * STRIDE + x2, len);
+        return "stripe swap";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t tile[TILE_SIZE * STRIDE];
+    unsigned long tiles = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+    unsigned long t, changes = 0;
+    size_t v, i, nvariants;
+
+    nvariants = sizeof(variants) / sizeof(variants[0]);
+#if defined(__x86_64__) || defined(__i386__)
+    /* the last one */
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("tile-hash-test: no AVX2, skipping that variant\n");
+        nvariants--;
+    }
+#endif
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x9E3779B97F4A7C15ULL;
+    if (!rng_state)
+        rng_state = 1;
+
+    for (t = 0; t < tiles; t++) {
+        /* edge tiles are narrower or shorter; few colors, like real
+         * content, so that swaps often exchange equal pixels */
+        int width = 1 + rng() % (TILE_SIZE * BPP);
+        int height = 1 + rng() % TILE_SIZE;
+        uint32_t colors = 1 + rng() % 4;
+        const char *change;
+        uint64_t before[sizeof(variants) / sizeof(variants[0])];
+
+        for (i = 0; i < sizeof(tile); i++)
+            tile[i] = rng() % colors * 85;
+        for (v = 0; v < nvariants; v++) {
+            before[v] = variants[v].fn(tile, STRIDE, width, height);
+            if (before[v] == 0 ||
+                    variants[v].fn(tile, STRIDE, width, height) != before[v]) {
+                fprintf(stderr, "%s: unstable or zero hash\n",
+                        variants[v].name);
+                return 1;
+            }
+        }
+        change = mutate(tile, width, height);
+        if (!change)
+            continue;
+        changes++;
+        for (v = 0; v < nvariants; v++) {
+            if (variants[v].fn(tile, STRIDE, width, height) == before[v]) {
+                fprintf(stderr,
+                        "%s: %s not detected in a %dx%d byte tile (tile %lu)\n",
+                        variants[v].name, change, width, height, t);
+                return 1;
+            }
+        }
+    }
+    printf("tile-hash-test: %lu changes detected by every variant\n",
+           changes);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Micro-benchmark of the Xv conversion kernel of dummyqbs (dummy_yuv.h):
+ * yuv_row_to_xrgb() against a loop over the scalar yuv_pixel().
+ *
+ * Usage: yuv-convert-bench [row_width] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dummy_yuv.h"
+
+/* repeat each measurement for at least this long */
+#define MIN_TIME_NS 200000000LL
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static __attribute__((noinline)) void
+scalar_row(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+           const uint8_t *v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        dst[i] = yuv_pixel(y[i], u[i / 2], v[i / 2]);
+}
+
+static __attribute__((noinline)) void
+kernel_row(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+           const uint8_t *v, int n)
+{
+    yuv_row_to_xrgb(dst, y, u, v, n);
+}
+
+/* Return ns per pixel */
+static double bench(void (*convert)(uint32_t *, const uint8_t *,
+                                    const uint8_t *, const uint8_t *, int),
+                    uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                    const uint8_t *v, int n)
+{
+    long long start = now_ns(), elapsed;
+    long rows = 0;
+
+    do {
+        convert(dst, y, u, v, n);
+        rows++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_TIME_NS);
+    return (double)elapsed / rows / n;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 4096;
+    uint8_t *y, *u, *v;
+    uint32_t *dst;
+    double scalar_ns, kernel_ns;
+    int i;
+
+    if (n <= 0) {
+        fprintf(stderr, "invalid row width\n");
+        return 1;
+    }
+    y = malloc(n);
+    u = malloc(n / 2 + 1);
+    v = malloc(n / 2 + 1);
+    dst = malloc(n * sizeof(*dst));
+    if (!y || !u || !v || !dst) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+        y[i] = 16 + i * 7 % 220;
+    for (i = 0; i < n / 2 + 1; i++) {
+        u[i] = 16 + i * 13 % 225;
+        v[i] = 16 + i * 29 % 225;
+    }
+
+    scalar_ns = bench(scalar_row, dst, y, u, v, n);
+    kernel_ns = bench(kernel_row, dst, y, u, v, n);
+    printf("yuv %d px row: scalar %.2f ns/px, yuv_row_to_xrgb %.2f ns/px, "
+           "%.1fx\n", n, scalar_ns, kernel_ns, scalar_ns / kernel_ns);
+    free(y);
+    free(u);
+    free(v);
+    free(dst);
+    return 0;
+}
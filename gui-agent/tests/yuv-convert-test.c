@@ -0,0 +1,119 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Test of the Xv conversion kernel of dummyqbs (dummy_yuv.h): the vectorized
+ * yuv_row_to_xrgb() must give exactly the output of the scalar yuv_pixel(),
+ * and both must be within 1 LSB of a floating point BT.601 reference.
+ *
+ * Usage: yuv-convert-test [rows [seed]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "dummy_yuv.h"
+
+#define MAX_ROW 300
+
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static int reference_channel(double value)
+{
+    long r = lround(value);
+
+    return r < 0 ? 0 : r > 255 ? 255 : (int)r;
+}
+
+static uint32_t reference_pixel(int y, int u, int v)
+{
+    double c = 1.164 * (y - 16), d = u - 128, e = v - 128;
+
+    return 0xff000000 |
+        (uint32_t)reference_channel(c + 1.596 * e) << 16 |
+        (uint32_t)reference_channel(c - 0.392 * d - 0.813 * e) << 8 |
+        (uint32_t)reference_channel(c + 2.017 * d);
+}
+
+static int max_channel_diff(uint32_t a, uint32_t b)
+{
+    int shift, diff, max = 0;
+
+    for (shift = 0; shift < 32; shift += 8) {
+        diff = abs((int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff));
+        if (diff > max)
+            max = diff;
+    }
+    return max;
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t y[MAX_ROW], u[MAX_ROW / 2 + 1], v[MAX_ROW / 2 + 1];
+    static uint32_t dst[MAX_ROW];
+    unsigned long rows = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+    unsigned long row, pixels = 0;
+    int i, n;
+
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x9E3779B97F4A7C15ULL;
+    if (!rng_state)
+        rng_state = 1;
+
+    for (row = 0; row < rows; row++) {
+        n = rng() % (MAX_ROW + 1);
+        for (i = 0; i < n; i++)
+            y[i] = rng();
+        for (i = 0; i < (n + 1) / 2; i++) {
+            u[i] = rng();
+            v[i] = rng();
+        }
+        yuv_row_to_xrgb(dst, y, u, v, n);
+        for (i = 0; i < n; i++) {
+            uint32_t scalar = yuv_pixel(y[i], u[i / 2], v[i / 2]);
+            uint32_t reference = reference_pixel(y[i], u[i / 2], v[i / 2]);
+
+            if (dst[i] != scalar) {
+                fprintf(stderr,
+                        "row %lu pixel %d (y %d u %d v %d): "
+                        "vectorized %08x, scalar %08x\n",
+                        row, i, y[i], u[i / 2], v[i / 2], dst[i], scalar);
+                return 1;
+            }
+            if (max_channel_diff(scalar, reference) > 1) {
+                fprintf(stderr,
+                        "row %lu pixel %d (y %d u %d v %d): "
+                        "got %08x, reference %08x\n",
+                        row, i, y[i], u[i / 2], v[i / 2], scalar, reference);
+                return 1;
+            }
+        }
+        pixels += n;
+    }
+    printf("yuv-convert-test: %lu pixels, vectorized output identical, "
+           "within 1 LSB of reference\n", pixels);
+    return 0;
+}
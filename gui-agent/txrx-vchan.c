@@ -22,33 +22,236 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include <libvchan.h>
+#include <qubes-gui-protocol.h>
 #include <errno.h>
-#include <poll.h>
 #include <err.h>
 
 #include "txrx.h"
+#include "event-loop.h"
 
 static void (*vchan_at_eof)(void) = NULL;
+/* the protocol handshake with the connected gui-daemon is done */
+static bool vchan_handshake_done;
+
+/* Messages that could not be sent immediately because the vchan ring was
+ * full. Interactive ones (cursor, window state) are sent before bulk ones
+ * (images, window dumps, clipboard), but only when that does not reorder
+ * messages of a single window, and never across window creation or
+ * destruction, as other messages may reference those windows. */
+struct queued_message {
+    struct queued_message *next;
+    uint32_t type;
+    uint32_t window;
+    size_t len;
+    char buf[];
+};
+
+struct message_queue {
+    struct queued_message *head;
+    struct queued_message **tail;
+};
+
+static struct message_queue interactive_queue = { NULL, &interactive_queue.head };
+static struct message_queue bulk_queue = { NULL, &bulk_queue.head };
+/* message being sent, possibly partially */
+static struct queued_message *current_message;
+static size_t current_offset;
+static size_t queued_bytes;
+/* MSG_CREATE and MSG_DESTROY in bulk_queue */
+static unsigned int queued_barriers;
+
+/* Above this, writers block until the queue is flushed, as without the queue */
+#define MAX_QUEUED_BYTES (1024 * 1024)
 
 void vchan_register_at_eof(void (*new_vchan_at_eof)(void))
 {
     vchan_at_eof = new_vchan_at_eof;
 }
 
-static _Noreturn void handle_vchan_error(libvchan_t *vchan, const char *op)
+void vchan_set_handshake_done(bool done)
+{
+    vchan_handshake_done = done;
+}
+
+static void discard_queued_messages(void);
+
+static _Noreturn void handle_vchan_error(const char *op)
 {
-    if (!libvchan_is_open(vchan) && vchan_at_eof)
-        vchan_at_eof();
     errx(1, "Error while vchan %s\n, terminating", op);
 }
 
+/* Losing gui-daemon while writing is not fatal: the message (and all the
+ * following ones) is dropped, until the main loop notices EOF and calls
+ * vchan_at_eof(). The new daemon gets the full state anyway. */
+static void handle_vchan_write_error(libvchan_t *vchan, const char *op)
+{
+    if (libvchan_is_open(vchan) || !vchan_at_eof)
+        handle_vchan_error(op);
+    discard_queued_messages();
+}
+
+static void handle_vchan_eof(unsigned int vchan_source)
+{
+    fprintf(stderr, "libvchan_is_eof\n");
+    if (vchan_at_eof == NULL)
+        exit(0);
+    discard_queued_messages();
+    vchan_handshake_done = false;
+    vchan_at_eof();
+    /* vchan was replaced, the caller needs to register the new one; its fd
+     * number may be the same as the old one */
+    event_loop_set_fd(vchan_source, -1);
+}
+
+static bool is_interactive_message(uint32_t type)
+{
+    switch (type) {
+        case MSG_CURSOR:
+        case MSG_WINDOW_FLAGS:
+        case MSG_MAP:
+        case MSG_UNMAP:
+        case MSG_WMNAME:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_barrier_message(uint32_t type)
+{
+    return type == MSG_CREATE || type == MSG_DESTROY;
+}
+
+static bool bulk_queued_for_window(uint32_t window)
+{
+    struct queued_message *msg;
+
+    for (msg = bulk_queue.head; msg; msg = msg->next)
+        if (msg->window == window)
+            return true;
+    return false;
+}
+
+static void queue_message(const struct msg_hdr *hdr, size_t size,
+                          const char *data, size_t datasize)
+{
+    struct queued_message *msg;
+    struct message_queue *queue;
+
+    msg = malloc(sizeof(*msg) + size + datasize);
+    if (!msg) {
+        fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+        exit(1);
+    }
+    msg->next = NULL;
+    msg->type = hdr->type;
+    msg->window = hdr->window;
+    msg->len = size + datasize;
+    memcpy(msg->buf, hdr, size);
+    if (datasize)
+        memcpy(msg->buf + size, data, datasize);
+
+    if (is_interactive_message(msg->type) && !queued_barriers &&
+            !bulk_queued_for_window(msg->window)) {
+        queue = &interactive_queue;
+    } else {
+        queue = &bulk_queue;
+        if (is_barrier_message(msg->type))
+            queued_barriers++;
+    }
+    *queue->tail = msg;
+    queue->tail = &msg->next;
+    queued_bytes += msg->len;
+}
+
+static struct queued_message *dequeue_message(struct message_queue *queue)
+{
+    struct queued_message *msg = queue->head;
+
+    if (msg) {
+        queue->head = msg->next;
+        if (!queue->head)
+            queue->tail = &queue->head;
+    }
+    return msg;
+}
+
+static void discard_queued_messages(void)
+{
+    struct queued_message *msg;
+
+    free(current_message);
+    current_message = NULL;
+    while ((msg = dequeue_message(&interactive_queue)))
+        free(msg);
+    while ((msg = dequeue_message(&bulk_queue)))
+        free(msg);
+    queued_bytes = 0;
+    queued_barriers = 0;
+}
+
+void flush_queued_messages(libvchan_t *vchan, bool block)
+{
+    size_t remaining;
+    int space;
+    int ret;
+
+    for (;;) {
+        if (!current_message) {
+            current_message = dequeue_message(&interactive_queue);
+            if (!current_message) {
+                current_message = dequeue_message(&bulk_queue);
+                if (!current_message)
+                    return;
+                if (is_barrier_message(current_message->type))
+                    queued_barriers--;
+            }
+            current_offset = 0;
+        }
+        remaining = current_message->len - current_offset;
+        space = libvchan_buffer_space(vchan);
+        if (space <= 0) {
+            if (!block)
+                return;
+            /* libvchan_write will wait for the space */
+            space = (int)remaining;
+        }
+        ret = libvchan_write(vchan, current_message->buf + current_offset,
+                             (size_t)space < remaining ? (size_t)space : remaining);
+        if (ret <= 0) {
+            handle_vchan_write_error(vchan, "write data");
+            return;
+        }
+        current_offset += ret;
+        if (current_offset == current_message->len) {
+            queued_bytes -= current_message->len;
+            free(current_message);
+            current_message = NULL;
+        }
+    }
+}
+
 int real_write_message(libvchan_t *vchan, char *hdr, int size, char *data, int datasize)
 {
-    if (libvchan_send(vchan, hdr, size) < 0)
-        handle_vchan_error(vchan, "send hdr");
-    if (libvchan_send(vchan, data, datasize) < 0)
-        handle_vchan_error(vchan, "send data");
+    /* no gui-daemon connected (or it has just gone), or it may have just
+     * connected and waits for the handshake first; drop the message, the
+     * daemon gets the full state after the handshake */
+    if (!vchan_handshake_done || libvchan_is_open(vchan) != VCHAN_CONNECTED)
+        return 0;
+
+    /* fast path, nothing to reorder */
+    if (!current_message && size + datasize <= libvchan_buffer_space(vchan)) {
+        if (libvchan_send(vchan, hdr, size) < 0)
+            handle_vchan_write_error(vchan, "send hdr");
+        else if (datasize && libvchan_send(vchan, data, datasize) < 0)
+            handle_vchan_write_error(vchan, "send data");
+        return 0;
+    }
+    queue_message((struct msg_hdr *) hdr, size, data, datasize);
+    flush_queued_messages(vchan, queued_bytes > MAX_QUEUED_BYTES);
     return 0;
 }
 
@@ -57,11 +260,14 @@ int write_data(libvchan_t *vchan, char *buf, int size)
     int written = 0;
     int ret;
 
+    /* raw data must not overtake queued messages */
+    flush_queued_messages(vchan, true);
+
     while (written < size) {
         /* cannot use libvchan_send b/c buf can be bigger than ring buffer */
         ret = libvchan_write(vchan, buf + written, size - written);
         if (ret <= 0)
-            handle_vchan_error(vchan, "write data");
+            handle_vchan_error("write data");
         written += ret;
     }
     //      fprintf(stderr, "sent %d bytes\n", size);
@@ -75,41 +281,33 @@ int read_data(libvchan_t *vchan, char *buf, int size)
     while (written < size) {
         ret = libvchan_read(vchan, buf + written, size - written);
         if (ret <= 0)
-            handle_vchan_error(vchan, "read data");
+            handle_vchan_error("read data");
         written += ret;
     }
     //      fprintf(stderr, "read %d bytes\n", size);
     return size;
 }
 
-static int wait_for_vchan_or_argfd_once(libvchan_t *vchan, struct pollfd *const fds, size_t const nfds)
+uint32_t wait_for_vchan_or_events(libvchan_t *vchan, unsigned int vchan_source)
 {
-    int ret;
-    ret = poll(fds, nfds, 1000);
-    if (ret < 0) {
-        if (errno == EINTR)
-            return -1;
-        err(1, "poll");
+    uint32_t ready;
+
+    /* EOF notification may have been consumed already by a failed write */
+    if (!libvchan_is_open(vchan)) {
+        handle_vchan_eof(vchan_source);
+        return 0;
     }
+    ready = event_loop_wait();
     if (!libvchan_is_open(vchan)) {
-        fprintf(stderr, "libvchan_is_eof\n");
-        if (vchan_at_eof != NULL) {
-            vchan_at_eof();
-            return -1;
-        } else
-            exit(0);
+        handle_vchan_eof(vchan_source);
+        return ready & ~(1U << vchan_source);
     }
-    if (fds[0].revents) {
+    if (ready & (1U << vchan_source)) {
         // the following will never block; we need to do this to
         // clear libvchan_fd pending state 
         libvchan_wait(vchan);
+        /* the daemon may have made space for queued messages */
+        flush_queued_messages(vchan, false);
     }
-    return ret;
-}
-
-int wait_for_vchan_or_argfd(libvchan_t *vchan, struct pollfd *const fds, size_t nfds)
-{
-    int ret;
-    while ((ret=wait_for_vchan_or_argfd_once(vchan, fds, nfds)) == 0);
-    return ret;
+    return ready;
 }
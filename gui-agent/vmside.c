@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 
 #include <unistd.h>
@@ -35,8 +36,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <grp.h>
 #include <err.h>
+#include <pthread.h>
+#include <sched.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xcomposite.h>
@@ -45,16 +50,22 @@
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 #include <qubes-gui-protocol.h>
 #include <qubes-xorg-tray-defs.h>
 #include "xdriver-shm-cmd.h"
+#include "damage-ring.h"
+#include "cursor-export.h"
+#include "grant-stats.h"
 #include "txrx.h"
 #include "list.h"
 #include "error.h"
 #include "encoding.h"
+#include "agent-stats.h"
 #include "unix-addr.h"
+#include "event-loop.h"
 #include <libvchan.h>
-#include <poll.h>
 #include "unistr.h"
 
 
@@ -66,6 +77,15 @@
 
 /* Time in milliseconds after which the clipboard data should be wiped */
 #define CLIPBOARD_WIPE_TIME 60000
+/* Time in milliseconds after which a stalled INCR selection transfer, in
+ * either direction, is aborted */
+#define CLIPBOARD_INCR_TIMEOUT 10000
+
+/* Main loop event sources, see event-loop.h */
+#define EVENT_SOURCE_VCHAN 0
+#define EVENT_SOURCE_X 1
+#define EVENT_SOURCE_XDRIVER 2
+#define EVENT_SOURCE_DAMAGE 3
 
 /* Get the size of an array.  Error out on pointers. */
 #define QUBES_ARRAY_SIZE(x) (0 * sizeof(struct { \
@@ -75,6 +95,7 @@
 #define SOCKET_ADDRESS  "/var/run/xf86-qubes-socket"
 
 #define STATUS_FILE_PATH  "/run/qubes/gui-agent.status"
+#define STATS_FILE_PATH  "/run/qubes/gui-agent.stats"
 
 /* Supported protocol version */
 
@@ -100,6 +121,141 @@ extern int print_x11_errors;
 
 static char **saved_argv;
 
+/* Startup phases, recorded in STATS_FILE_PATH in milliseconds since boot
+ * (so, since the qube start) */
+enum startup_phase {
+    STARTUP_AGENT_STARTED,
+    STARTUP_XORG_SPAWNED,
+    STARTUP_VCHAN_LISTENING,
+    STARTUP_INPUT_DEVICES_READY,
+    STARTUP_X_CONNECTED,
+    STARTUP_X_READY,
+    STARTUP_GUID_CONNECTED,
+    STARTUP_FIRST_WINDOW_MAPPED,
+    STARTUP_PHASE_COUNT
+};
+
+static const char *const startup_phase_names[STARTUP_PHASE_COUNT] = {
+    [STARTUP_AGENT_STARTED] = "agent_started",
+    [STARTUP_XORG_SPAWNED] = "xorg_spawned",
+    [STARTUP_VCHAN_LISTENING] = "vchan_listening",
+    [STARTUP_INPUT_DEVICES_READY] = "input_devices_ready",
+    [STARTUP_X_CONNECTED] = "x_connected",
+    [STARTUP_X_READY] = "x_ready",
+    [STARTUP_GUID_CONNECTED] = "guid_connected",
+    [STARTUP_FIRST_WINDOW_MAPPED] = "first_window_mapped",
+};
+
+/* 0 - not reached yet */
+static long startup_phase_ms[STARTUP_PHASE_COUNT];
+
+/* damage ring of dummyqbs, for its counters; NULL if not used */
+static const struct damage_ring *stats_damage_ring;
+
+/* Delay in milliseconds of STATS_FILE_PATH updates after some activity;
+ * nothing is refreshed while idle, except on SIGUSR1 */
+#define STATS_UPDATE_INTERVAL 10000
+static struct event_timer *stats_update_timer;
+static int stats_update_pending;
+static volatile sig_atomic_t stats_refresh_requested;
+
+/* motions replaced by a later one in the input queue */
+static uint64_t stats_coalesced_motions;
+static struct resync_stats stats_resync;
+
+/* last value of the GRANT_STATS_PROP root window property set by dummyqbs */
+static uint32_t grant_stats[GRANT_STATS_COUNT];
+static int grant_stats_valid;
+
+static void write_stats_file(void)
+{
+    FILE *f;
+    int fd;
+    int i;
+
+    fd = open(STATS_FILE_PATH, O_CREAT | O_WRONLY | O_NOFOLLOW | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open stats file");
+        return;
+    }
+    f = fdopen(fd, "w");
+    if (!f) {
+        perror("fdopen stats file");
+        close(fd);
+        return;
+    }
+    for (i = 0; i < STARTUP_PHASE_COUNT; i++)
+        if (startup_phase_ms[i])
+            fprintf(f, "startup.%s %ld\n", startup_phase_names[i],
+                    startup_phase_ms[i]);
+    if (stats_damage_ring) {
+        const struct damage_ring_stats *st = &stats_damage_ring->stats;
+
+        fprintf(f, "damage.published_rects %" PRIu64 "\n",
+                __atomic_load_n(&st->published_rects, __ATOMIC_RELAXED));
+        fprintf(f, "damage.published_pixels %" PRIu64 "\n",
+                __atomic_load_n(&st->published_pixels, __ATOMIC_RELAXED));
+    }
+    if (stats_damage_ring &&
+            (stats_damage_ring->flags & DAMAGE_RING_TILE_HASH)) {
+        const struct damage_ring_stats *st = &stats_damage_ring->stats;
+
+        fprintf(f, "damage.tile_hash.hashed_tiles %" PRIu64 "\n",
+                __atomic_load_n(&st->hashed_tiles, __ATOMIC_RELAXED));
+        fprintf(f, "damage.tile_hash.time_us %" PRIu64 "\n",
+                __atomic_load_n(&st->hash_time_us, __ATOMIC_RELAXED));
+        fprintf(f, "damage.tile_hash.suppressed_rects %" PRIu64 "\n",
+                __atomic_load_n(&st->suppressed_rects, __ATOMIC_RELAXED));
+        fprintf(f, "damage.tile_hash.suppressed_pixels %" PRIu64 "\n",
+                __atomic_load_n(&st->suppressed_pixels, __ATOMIC_RELAXED));
+    }
+    fprintf(f, "input.coalesced_motions %" PRIu64 "\n",
+            stats_coalesced_motions);
+    resync_stats_write(f, &stats_resync);
+    if (grant_stats_valid)
+        grant_stats_write(f, grant_stats);
+    if (fclose(f) == EOF)
+        perror("write stats file");
+}
+
+/* only the first occurrence is recorded, e.g. not gui-daemon reconnections */
+static void mark_startup_phase(enum startup_phase phase)
+{
+    struct timespec ts;
+
+    if (startup_phase_ms[phase])
+        return;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    startup_phase_ms[phase] = ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+    write_stats_file();
+}
+
+/* Input message passed from the vchan reader to the input thread */
+struct input_request {
+    uint32_t type;   /* MSG_KEYPRESS, MSG_BUTTON, MSG_MOTION or MSG_KEYMAP_NOTIFY */
+    XID window;      /* already translated to the embeder for docked icons */
+    int root_width;  /* screen size at the time of MSG_MOTION */
+    int root_height;
+    union {
+        struct msg_keypress key;
+        struct msg_button button;
+        struct msg_motion motion;
+        unsigned char keys[32];
+    } u;
+};
+
+#define INPUT_QUEUE_SIZE 256
+
+/* Range of the uinput pointer device axes, independent of the screen size, so
+ * the device does not need to be re-created on RandR changes */
+#define UINPUT_POINTER_ABS_MAX 32767
+
+struct clipboard_target {
+    Atom target;
+    const unsigned char *data; /* g->clipboard_data or an empty string */
+    size_t len;
+};
+
 typedef struct {
     Display *display;
     int screen;            /* shortcut to the default screen */
@@ -126,14 +282,30 @@ typedef struct {
     Atom qprop;            /* Atom: QUBES_SELECTION */
     Atom compound_text;    /* Atom: COMPOUND_TEXT */
     Atom xembed;           /* Atom: _XEMBED */
+    Atom incr;             /* Atom: INCR */
+    Atom motion_every_sample; /* Atom: _QUBES_MOTION_EVERY_SAMPLE */
     int xserver_fd;
     int xserver_listen_fd;
     libvchan_t *vchan;
     Window stub_win;    /* window for clipboard operations and to simulate LeaveNotify events */
     unsigned char *clipboard_data;
     unsigned int clipboard_data_len;
-    Time clipboard_last_access;
+    /* STRING, COMPOUND_TEXT and UTF8_STRING, see prepare_clipboard_data() */
+    struct clipboard_target clipboard_targets[3];
     bool clipboard_wipe;
+    /* fires CLIPBOARD_WIPE_TIME after last clipboard access, if enabled */
+    struct event_timer *clipboard_wipe_timer;
+    /* INCR selection transfer from a VM application in progress */
+    bool clipboard_incr_active;
+    unsigned char *clipboard_incr_data;
+    size_t clipboard_incr_len;     /* bytes received so far */
+    size_t clipboard_incr_size;    /* allocated size of clipboard_incr_data */
+    size_t clipboard_incr_limit;   /* bytes over this are discarded */
+    size_t clipboard_incr_chunk;   /* max size of a single selection property */
+    /* fires CLIPBOARD_INCR_TIMEOUT after the last chunk received */
+    struct event_timer *clipboard_incr_timer;
+    /* checks incr_transfer_list for stalled transfers while not empty */
+    struct event_timer *incr_transfer_timer;
     int log_level;
     int sync_all_modifiers;
     int composite_redirect_automatic;
@@ -144,6 +316,38 @@ typedef struct {
     int uinput_fd;
     int created_input_device;
     uint8_t last_known_modifier_states;
+    /* handshake with the current gui-daemon done; until then messages are
+     * dropped by real_write_message(), and the daemon gets the full state
+     * from handle_guid_connect() */
+    int guid_connected;
+    int uinput_pointer_fd;
+    int created_pointer_device;  /* pointer events go through uinput */
+    int root_width;  /* current root window size, follows RandR changes */
+    int root_height;
+    /* Input injection runs in a separate thread, so it does not wait behind
+     * output processing. It has its own X connection, and uses
+     * created_input_device, uinput_fd and last_known_modifier_states
+     * exclusively. */
+    Display *input_display;
+    pthread_t input_thread;
+    pthread_mutex_t input_queue_lock;
+    pthread_cond_t input_queue_cond; /* signaled on every queue change */
+    struct input_request input_queue[INPUT_QUEUE_SIZE];
+    unsigned int input_queue_head;
+    unsigned int input_queue_len; /* including the requests being injected */
+    unsigned int input_queue_busy; /* requests being injected, at the head */
+    /* serializes commands on xserver_fd between threads */
+    pthread_mutex_t xdriver_lock;
+    /* damage export ring of dummyqbs, see damage-ring.h; NULL if not
+     * available, XDamage events are used then */
+    struct damage_ring *damage_ring;
+    size_t damage_ring_size;
+    int damage_ring_event_fd;
+    /* current cursor published by dummyqbs, see cursor-export.h; NULL if
+     * not available */
+    const struct cursor_export *cursor_export;
+    /* protocol version of qubes_drv, see XDRIVER_VERSION */
+    int xdriver_version;
 } Ghandles;
 
 struct window_data {
@@ -154,14 +358,28 @@ struct window_data {
     int support_take_focus;
     int window_dump_pending; /* send MSG_WINDOW_DUMP at next damage notification */
     int mapped;
+    int motion_every_sample; /* do not coalesce motion, see queue_input() */
 };
 
 struct embeder_data {
     XID icon_window;
 };
 
+/* Clipboard data served to an X client using the INCR protocol */
+struct incr_transfer {
+    Window requestor;
+    Atom property;
+    Atom target;
+    const unsigned char *data; /* points into g->clipboard_data */
+    size_t len;
+    size_t offset;
+    long last_activity_ms; /* CLOCK_MONOTONIC */
+    long saved_event_mask; /* our event mask on requestor before the transfer */
+};
+
 static struct genlist *windows_list;
 static struct genlist *embeder_list;
+static struct genlist *incr_transfer_list;
 static Ghandles *ghandles_for_vchan_reinitialize;
 
 static void log_unmanaged_window(Ghandles *g, const char *context, XID window) {
@@ -334,25 +552,52 @@ static int compare_supported_cursors(const void *a, const void *b) {
 }
 
 
-static void send_event(Ghandles * g, const struct input_event *iev) {
-    int status = write(g->uinput_fd, iev, sizeof(struct input_event));
-    if ( status < 0 ) {
-        if (g->log_level > 0) {
-            fprintf(stderr, "write failed, falling back to xdriver. TYPE:%d CODE:%d VALUE: %d WRITE ERROR CODE: %d\n", iev->type, iev->code, iev->value, status);
-        }
-        g->created_input_device = 0;
-    }
+/* Events of a single keystroke, including modifier fix-ups: up to 8
+ * modifiers (at most press, SYN, release, SYN each) and the key + SYN */
+struct input_batch {
+    struct input_event events[4 * 8 + 2];
+    size_t count;
+};
+
+static void input_batch_add(struct input_batch *batch, uint16_t type,
+        uint16_t code, int32_t value)
+{
+    struct input_event *iev;
+
+    assert(batch->count < QUBES_ARRAY_SIZE(batch->events));
+    iev = &batch->events[batch->count++];
+    memset(iev, 0, sizeof(*iev));
+    iev->type = type;
+    iev->code = code;
+    iev->value = value;
+}
+
+/* Terminate the current event frame, if there is anything in it */
+static void input_batch_syn(struct input_batch *batch)
+{
+    if (batch->count && batch->events[batch->count - 1].type != EV_SYN)
+        input_batch_add(batch, EV_SYN, SYN_REPORT, 0);
+}
 
-    // send syn
-    const struct input_event syn = {.type = EV_SYN, .code = 0, .value = 0};
-    status = write(g->uinput_fd, &(syn), sizeof(struct input_event));
+/* Submit all the events with a single write(), return 0 on failure */
+static int send_events(Ghandles * g, int fd, struct input_batch *batch) {
+    ssize_t status;
 
-    if ( status < 0 ) {
+    input_batch_syn(batch);
+    if (!batch->count)
+        return 1;
+    status = write(fd, batch->events,
+                   batch->count * sizeof(struct input_event));
+    if (status < 0) {
         if (g->log_level > 0) {
-            fprintf(stderr, "writing SYN failed, falling back to xdriver. WRITE ERROR CODE: %d\n", status);
+            fprintf(stderr, "write of %zu events failed, falling back to xdriver. WRITE ERROR: %s\n",
+                    batch->count, strerror(errno));
         }
-        g->created_input_device = 0;
+        batch->count = 0;
+        return 0;
     }
+    batch->count = 0;
+    return 1;
 }
 
 
@@ -360,8 +605,11 @@ static void send_wmname(Ghandles * g, XID window);
 static void send_wmnormalhints(Ghandles * g, XID window, int ignore_fail);
 static void send_wmclass(Ghandles * g, XID window, int ignore_fail);
 static void send_pixmap_grant_refs(Ghandles * g, XID window);
+static void send_pixmap_grant_refs_list(Ghandles * g, const XID *windows,
+                                        size_t count);
 static void retrieve_wmhints(Ghandles * g, XID window, int ignore_fail);
 static void retrieve_wmprotocols(Ghandles * g, XID window, int ignore_fail);
+static void retrieve_motion_every_sample(Ghandles * g, XID window);
 
 static void process_xevent_damage(Ghandles * g, XID window,
         int x, int y, int width, int height)
@@ -434,31 +682,6 @@ static uint32_t find_cursor(Ghandles *g, Atom atom)
  * Before falling back to CURSOR_DEFAULT, we'll try to match (quick hashes of) the live cursor's bitmap with each supported cursor's bitmap.
 **/
 
-// Generic Fowler-Noll-Vo quick hash function (FNV-1a), magic mix number from WikiPedia's entry
-static uint64_t fnv1a64(const void *data, size_t len, uint64_t seed) {
-    const uint8_t *p = data;
-    uint64_t hash = seed;
-    for (size_t i = 0; i < len; i++) {
-        hash ^= p[i];
-        hash *= 1099511628211ULL;
-    }
-
-    return hash;
-}
-
-// Specialized FNV-1a hash of a cursor, magic seed number from WikiPedia's entry
-static uint64_t hash_cursor(uint32_t w, uint32_t h,
-                            uint32_t xhot, uint32_t yhot,
-                            const uint32_t *pixels) {
-    uint64_t hash = 14695981039346656037ULL;
-
-    uint32_t hdr[4] = { w, h, xhot, yhot };
-    hash = fnv1a64(hdr, sizeof(hdr), hash);
-    hash = fnv1a64(pixels, (size_t)(w * h * sizeof(uint32_t)), hash);
-
-    return hash;
-}
-
 // Precompute a table of cursor hashes (for a given cursor size) to accelerate matching unnamed cursors
 static void precompute_hashed_cursors(Ghandles *g, uint32_t cursor_size) {
     char *theme = XcursorGetTheme(g->display);
@@ -474,20 +697,65 @@ static void precompute_hashed_cursors(Ghandles *g, uint32_t cursor_size) {
         XcursorImage *img = XcursorLibraryLoadImage(supported_cursors[i].name, theme, (int)cursor_size);
         if (!img) continue;
 
-        hashed_cursors[num_hashed_cursors].hash = hash_cursor(img->width, img->height, img->xhot, img->yhot, img->pixels);
+        hashed_cursors[num_hashed_cursors].hash = cursor_export_hash(img->width, img->height, img->xhot, img->yhot, img->pixels);
         hashed_cursors[num_hashed_cursors].cursor_id = supported_cursors[i].cursor_id;
         num_hashed_cursors++;
         XcursorImageDestroy(img);
     }
 }
 
+/* Read the hash and size of the current cursor from dummyqbs. Returns 0 if it
+ * is not exported, XFixesGetCursorImage() needs to be used then. */
+static int read_exported_cursor(Ghandles *g, uint64_t *hash, uint32_t *size)
+{
+    const struct cursor_export *c = g->cursor_export;
+    uint32_t seq, width, height;
+    int tries;
+
+    if (!c)
+        return 0;
+    for (tries = 0; tries < 100; tries++) {
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        width = __atomic_load_n(&c->width, __ATOMIC_RELAXED);
+        height = __atomic_load_n(&c->height, __ATOMIC_RELAXED);
+        *hash = __atomic_load_n(&c->hash, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (width == 0 || height == 0)
+            return 0;
+        *size = width > height ? width : height;
+        return 1;
+    }
+    return 0;
+}
+
 // Fallback function to lookup an unnamed cursor by its bitmap
+static uint32_t find_cursor_by_hash(uint64_t live_hash) {
+    for (size_t i = 0; i < num_hashed_cursors; i++) {
+        if (hashed_cursors[i].hash == live_hash) {
+            uint32_t found = CURSOR_X11 + hashed_cursors[i].cursor_id;
+            if (found >= CURSOR_X11_MAX) {
+                return CURSOR_DEFAULT;
+            }
+            return found;
+        }
+    }
+
+    return CURSOR_DEFAULT;
+}
+
 static uint32_t find_cursor_by_image(Ghandles *g) {
     XFixesCursorImage *live_img = XFixesGetCursorImage(g->display);
     if (!live_img) return CURSOR_DEFAULT;
 
     // SEC: Abort immediately on suspiciously huge cursors to avoid mallocating too much RAM
     if (live_img->width > 512 || live_img->height > 512) {
+        XFree(live_img);
         return CURSOR_DEFAULT;
     }
 
@@ -500,21 +768,11 @@ static uint32_t find_cursor_by_image(Ghandles *g) {
     }
     for (size_t i = 0; i < npx; i++) live_px[i] = (uint32_t)live_img->pixels[i];
 
-    uint64_t live_hash = hash_cursor(live_img->width, live_img->height, live_img->xhot, live_img->yhot, live_px);
+    uint64_t live_hash = cursor_export_hash(live_img->width, live_img->height, live_img->xhot, live_img->yhot, live_px);
     free(live_px);
     XFree(live_img);
 
-    for (size_t i = 0; i < num_hashed_cursors; i++) {
-        if (hashed_cursors[i].hash == live_hash) {
-            uint32_t found = CURSOR_X11 + hashed_cursors[i].cursor_id;
-            if (found >= CURSOR_X11_MAX) {
-                return CURSOR_DEFAULT;
-            }
-            return found;
-        }
-    }
-
-    return CURSOR_DEFAULT;
+    return find_cursor_by_hash(live_hash);
 }
 
 static void process_xevent_cursor(Ghandles *g, XFixesCursorNotifyEvent *ev)
@@ -541,18 +799,30 @@ static void process_xevent_cursor(Ghandles *g, XFixesCursorNotifyEvent *ev)
         if (ev->cursor_name != None) {
             cursor = find_cursor(g, ev->cursor_name);
         } else {
+            uint64_t live_hash;
+            uint32_t size;
+            int exported = read_exported_cursor(g, &live_hash, &size);
+
             // Precompute the table of hashed cursors based on the actual cursor size
             if (num_hashed_cursors == 0) {
-                XFixesCursorImage *live_img = XFixesGetCursorImage(g->display);
-                if (live_img) {
-                    uint32_t size = (live_img->width > live_img->height) ? live_img->width : live_img->height;
-                    XFree(live_img);
+                if (!exported) {
+                    XFixesCursorImage *live_img = XFixesGetCursorImage(g->display);
+                    size = 0;
+                    if (live_img) {
+                        size = (live_img->width > live_img->height) ? live_img->width : live_img->height;
+                        XFree(live_img);
+                    }
+                }
+                if (size) {
                     fprintf(stderr, "Precomputing hashed cursors to accelerate subsequent lookups");
                     precompute_hashed_cursors(g, size);
                 }
             }
 
-            cursor = find_cursor_by_image(g);
+            if (exported)
+                cursor = find_cursor_by_hash(live_hash);
+            else
+                cursor = find_cursor_by_image(g);
         }
 
         send_cursor(g, window_under_pointer, cursor);
@@ -609,13 +879,15 @@ static void process_xevent_createnotify(Ghandles * g, XCreateWindowEvent * ev)
     wd->support_take_focus = False;
     wd->window_dump_pending = False;
     wd->mapped = False;
+    wd->motion_every_sample = False;
     list_insert(windows_list, ev->window, wd);
 
     if (attr.border_width > 0) {
         XSetWindowBorderWidth(g->display, ev->window, 0);
     }
 
-    if (attr.class != InputOnly)
+    /* with the damage ring, dummyqbs tracks damage of the window itself */
+    if (attr.class != InputOnly && !g->damage_ring)
         XDamageCreate(g->display, ev->window,
                 XDamageReportRawRectangles);
     // the following hopefully avoids missed damage events
@@ -636,18 +908,28 @@ static void process_xevent_createnotify(Ghandles * g, XCreateWindowEvent * ev)
     send_wmclass(g, hdr.window, 1);
     retrieve_wmprotocols(g, hdr.window, 1);
     retrieve_wmhints(g, hdr.window, 1);
+    retrieve_motion_every_sample(g, hdr.window);
 }
 
-static void feed_xdriver(Ghandles * g, int type, int arg1, int arg2)
+/* Send a command followed by payload_len bytes of payload; the caller must
+ * hold g->xdriver_lock */
+static void xdriver_command_payload(Ghandles * g, int type, int arg1, int arg2,
+                                    const void *payload, size_t payload_len)
 {
     char ans;
     ssize_t ret;
     struct xdriver_cmd cmd;
+    struct iovec iov[2] = {
+        { .iov_base = &cmd, .iov_len = sizeof(cmd) },
+        { .iov_base = (void *)payload, .iov_len = payload_len },
+    };
 
     cmd.type = type;
     cmd.arg1 = arg1;
     cmd.arg2 = arg2;
-    if (write(g->xserver_fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+    /* a single write, so qubes_drv never waits for the payload */
+    if (writev(g->xserver_fd, iov, payload_len ? 2 : 1) !=
+            (ssize_t)(sizeof(cmd) + payload_len))
         err(1, "unix write");
     ans = '1';
     ret = read(g->xserver_fd, &ans, 1);
@@ -657,47 +939,409 @@ static void feed_xdriver(Ghandles * g, int type, int arg1, int arg2)
     }
 }
 
-void send_pixmap_grant_refs(Ghandles * g, XID window)
+/* the caller must hold g->xdriver_lock */
+static void xdriver_command(Ghandles * g, int type, int arg1, int arg2)
+{
+    xdriver_command_payload(g, type, arg1, arg2, NULL, 0);
+}
+
+/* Input and pixmap release commands are dropped while qubes_drv is
+ * reconnecting; the device they were meant for is gone. */
+static void feed_xdriver(Ghandles * g, int type, int arg1, int arg2)
+{
+    pthread_mutex_lock(&g->xdriver_lock);
+    if (g->xserver_fd >= 0)
+        xdriver_command(g, type, arg1, arg2);
+    pthread_mutex_unlock(&g->xdriver_lock);
+}
+
+/* Send commands without a reply beyond the ack at once, and only then read
+ * their acks, see XDRIVER_MAX_BATCH; dropped like in feed_xdriver() */
+static void feed_xdriver_batch(Ghandles * g, const struct xdriver_cmd *cmds,
+                               int count)
+{
+    char ans[XDRIVER_MAX_BATCH];
+    int batch, rcvd, i;
+    ssize_t ret;
+
+    pthread_mutex_lock(&g->xdriver_lock);
+    if (g->xserver_fd < 0)
+        count = 0;
+    for (; count > 0; cmds += batch, count -= batch) {
+        batch = count < XDRIVER_MAX_BATCH ? count : XDRIVER_MAX_BATCH;
+        if (write(g->xserver_fd, cmds, batch * sizeof(*cmds)) !=
+                (ssize_t)(batch * sizeof(*cmds)))
+            err(1, "unix write");
+        /* older qubes_drv send each ack separately */
+        for (rcvd = 0; rcvd < batch; rcvd += ret) {
+            ret = read(g->xserver_fd, ans + rcvd, batch - rcvd);
+            if (ret <= 0)
+                err(1, "unix read returned %zd", ret);
+        }
+        for (i = 0; i < batch; i++)
+            if (ans[i] != '0')
+                errx(1, "unexpected ack 0x%hhx", ans[i]);
+    }
+    pthread_mutex_unlock(&g->xdriver_lock);
+}
+
+/* Commands of the input thread, collected over all the queued input
+ * requests, so that they wait for their acks only once */
+struct xdriver_batch {
+    struct xdriver_cmd cmds[XDRIVER_MAX_BATCH];
+    int count;
+};
+
+/* Send the collected commands; needed before anything that must see their
+ * effect, or that must come after them */
+static void flush_xdriver_batch(Ghandles * g, struct xdriver_batch *batch)
+{
+    if (batch->count)
+        feed_xdriver_batch(g, batch->cmds, batch->count);
+    batch->count = 0;
+}
+
+static void xdriver_batch_add(Ghandles * g, struct xdriver_batch *batch,
+                              int type, int arg1, int arg2)
+{
+    if (batch->count == XDRIVER_MAX_BATCH)
+        flush_xdriver_batch(g, batch);
+    batch->cmds[batch->count++] = (struct xdriver_cmd){ type, arg1, arg2 };
+}
+
+/* Send command type, which qubes_drv answers with a status byte and nfds fds.
+ * Returns the number of fds received, 0 if qubes_drv has nothing to pass,
+ * -1 if it does not know the command. */
+static int xdriver_receive_fds(Ghandles * g, int type, int *fds, int nfds)
+{
+    char status = '0';
+    struct iovec iov = { .iov_base = &status, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    assert(nfds > 0 && nfds <= 2);
+    /* older qubes_drv do not answer beyond the ack */
+    if (g->xdriver_version < 1)
+        return -1;
+
+    pthread_mutex_lock(&g->xdriver_lock);
+    xdriver_command(g, type, 0, 0);
+    do {
+        ret = recvmsg(g->xserver_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+    pthread_mutex_unlock(&g->xdriver_lock);
+    if (ret != 1)
+        err(1, "unix recvmsg");
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg)
+        return 0;
+    if (status != '1' || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(nfds * sizeof(int)))
+        errx(1, "unexpected fds from qubes_drv");
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    return nfds;
+}
+
+/* Get the damage export ring from dummyqbs. Leaves g->damage_ring NULL if it
+ * is not available, the XDamage extension is used then. */
+static void setup_damage_ring(Ghandles * g)
+{
+    int fds[2];
+    struct damage_ring *ring;
+    struct stat st;
+
+    if (xdriver_receive_fds(g, 'R', fds, 2) != 2) {
+        fprintf(stderr, "Damage ring not available, using XDamage\n");
+        return;
+    }
+
+    if (fstat(fds[0], &st) < 0)
+        err(1, "fstat damage ring");
+    if ((size_t)st.st_size < sizeof(*ring))
+        goto invalid;
+    ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fds[0], 0);
+    if (ring == MAP_FAILED)
+        err(1, "mmap damage ring");
+    close(fds[0]);
+    if (ring->version != DAMAGE_RING_VERSION || ring->entries == 0 ||
+            (ring->entries & (ring->entries - 1)) ||
+            DAMAGE_RING_SIZE((size_t)ring->entries) != (size_t)st.st_size) {
+        munmap(ring, st.st_size);
+        fds[0] = -1;
+        goto invalid;
+    }
+
+    g->damage_ring = ring;
+    g->damage_ring_size = st.st_size;
+    g->damage_ring_event_fd = fds[1];
+    event_loop_set_fd(EVENT_SOURCE_DAMAGE, fds[1]);
+    stats_damage_ring = ring;
+    if (g->log_level > 0)
+        fprintf(stderr, "Using damage ring with %u entries\n", ring->entries);
+    return;
+
+invalid:
+    fprintf(stderr, "Invalid damage ring, using XDamage\n");
+    if (fds[0] >= 0)
+        close(fds[0]);
+    close(fds[1]);
+}
+
+/* Get the cursor exported by dummyqbs. Leaves g->cursor_export NULL if it is
+ * not available, XFixesGetCursorImage() is used then. */
+static void setup_cursor_export(Ghandles * g)
+{
+    int fd;
+    struct cursor_export *cursor;
+    struct stat st;
+
+    if (xdriver_receive_fds(g, 'C', &fd, 1) != 1) {
+        fprintf(stderr, "Cursor export not available, using XFixes\n");
+        return;
+    }
+    if (fstat(fd, &st) < 0)
+        err(1, "fstat cursor export");
+    if ((size_t)st.st_size != CURSOR_EXPORT_SIZE) {
+        fprintf(stderr, "Invalid cursor export, using XFixes\n");
+        close(fd);
+        return;
+    }
+    cursor = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (cursor == MAP_FAILED)
+        err(1, "mmap cursor export");
+    close(fd);
+    if (cursor->version != CURSOR_EXPORT_VERSION) {
+        fprintf(stderr, "Invalid cursor export, using XFixes\n");
+        munmap(cursor, st.st_size);
+        return;
+    }
+    g->cursor_export = cursor;
+}
+
+/* Read the grant table usage published by dummyqbs, see grant-stats.h */
+static void read_grant_stats(Ghandles * g)
+{
+    static Atom atom = None;
+    Atom act_type;
+    int act_fmt;
+    unsigned long nitems, bytes_after;
+    unsigned char *data;
+
+    if (atom == None)
+        atom = XInternAtom(g->display, GRANT_STATS_PROP, False);
+    grant_stats_valid = 0;
+    if (XGetWindowProperty(g->display, g->root_win, atom, 0, GRANT_STATS_COUNT,
+                False, XA_CARDINAL, &act_type, &act_fmt, &nitems,
+                &bytes_after, &data) != Success)
+        return;
+    /* Xlib returns format 32 items as longs */
+    if (act_type == XA_CARDINAL && act_fmt == 32)
+        grant_stats_valid = grant_stats_parse(grant_stats,
+                                              (const long *) data, nitems);
+    XFree(data);
+}
+
+static void update_stats_file(void *opaque)
+{
+    stats_update_pending = 0;
+    read_grant_stats(opaque);
+    write_stats_file();
+}
+
+/* Refresh the stats file within STATS_UPDATE_INTERVAL, the counters may have
+ * changed */
+static void schedule_stats_update(void)
+{
+    if (stats_update_pending)
+        return;
+    event_timer_arm(stats_update_timer, STATS_UPDATE_INTERVAL);
+    stats_update_pending = 1;
+}
+
+/* Send damage published by dummyqbs since the last call. Returns 1 if there
+ * was any. */
+static int drain_damage_ring(Ghandles * g)
+{
+    struct damage_ring *ring = g->damage_ring;
+    struct damage_ring_rect rect;
+    struct genlist *l;
+    struct window_data *wd;
+    XID dump_windows[XDRIVER_MAX_DUMP_WINDOWS];
+    size_t dump_count = 0;
+    uint32_t head, tail;
+
+    if (!ring)
+        return 0;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+    if (head == tail)
+        return 0;
+    /* windows waiting for the first damage to send their dump (e.g. after
+     * mapping many at once) get it with a single qubes_drv command */
+    for (uint32_t i = tail; i != head && dump_count < QUBES_ARRAY_SIZE(dump_windows); i++) {
+        l = list_lookup(windows_list, ring->rects[i & (ring->entries - 1)].window);
+        if (!l)
+            continue;
+        wd = l->data;
+        if (wd->window_dump_pending) {
+            dump_windows[dump_count++] = l->key;
+            wd->window_dump_pending = False;
+        }
+    }
+    send_pixmap_grant_refs_list(g, dump_windows, dump_count);
+    for (; tail != head; tail++) {
+        rect = ring->rects[tail & (ring->entries - 1)];
+        /* damage may be published before gui-agent has seen the window
+         * creation, or after its destruction */
+        l = list_lookup(windows_list, rect.window);
+        if (!l)
+            continue;
+        if (g->log_level > 1)
+            fprintf(stderr, "Damage ring 0x%x x=%hd y=%hd w=%hu h=%hu\n",
+                    rect.window, rect.x, rect.y, rect.width, rect.height);
+        process_xevent_damage(g, rect.window, rect.x, rect.y,
+                              rect.width, rect.height);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    /* pairs with dummy_damage_publish(), which sets producer_waiting and then
+     * reads tail again: either it sees the new tail, or this sees the flag */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* the producer has more damage, that did not fit */
+    if (__atomic_exchange_n(&ring->producer_waiting, 0, __ATOMIC_ACQ_REL))
+        feed_xdriver(g, 'D', 0, 0);
+    return 1;
+}
+
+/* Reply of qubes_drv to 'W', read by fetch_window_dumps() */
+struct window_dump {
+    XID window;
+    uint8_t *data; /* NULL if qubes_drv could not dump the window */
+    size_t len;
+};
+
+/* the caller must hold g->xdriver_lock */
+static void read_window_dump(Ghandles * g, struct window_dump *dump)
 {
-    struct msg_hdr hdr;
-    uint8_t *wd_msg_buf;
-    size_t wd_msg_len;
     size_t rcvd;
     int ret;
 
-    feed_xdriver(g, 'W', (int) window, 0);
-    if (read(g->xserver_fd, &wd_msg_len, sizeof(wd_msg_len)) != sizeof(wd_msg_len))
+    dump->data = NULL;
+    if (read(g->xserver_fd, &dump->len, sizeof(dump->len)) != sizeof(dump->len))
         err(1, "unix read wd_msg_len");
-    if (wd_msg_len == 0) {
-        fprintf(stderr, "Failed to get window dump for window 0x%lx\n",
-                window);
+    if (dump->len == 0)
         return;
-    }
-    wd_msg_buf = malloc(wd_msg_len);
-    if (!wd_msg_buf) {
+    dump->data = malloc(dump->len);
+    if (!dump->data) {
         fprintf(stderr, "Failed to allocate memory for window dump 0x%lx\n",
-                window);
+                dump->window);
         exit(1);
     }
     rcvd = 0;
-    while (rcvd < wd_msg_len) {
-        ret = read(g->xserver_fd, wd_msg_buf + rcvd, wd_msg_len - rcvd);
+    while (rcvd < dump->len) {
+        ret = read(g->xserver_fd, dump->data + rcvd, dump->len - rcvd);
         if (ret == 0)
             errx(1, "unix read EOF");
         if (ret < 0)
             err(1, "unix read error");
         rcvd += ret;
     }
+}
+
+/* Get the window dumps of several windows, with one 'L' command per
+ * XDRIVER_MAX_DUMP_WINDOWS windows */
+static void fetch_window_dumps(Ghandles * g, struct window_dump *dumps,
+                               size_t count)
+{
+    uint32_t ids[XDRIVER_MAX_DUMP_WINDOWS];
+    size_t i, j, n;
+
+    pthread_mutex_lock(&g->xdriver_lock);
+    for (i = 0; i < count; i += n) {
+        n = count - i;
+        if (n > XDRIVER_MAX_DUMP_WINDOWS)
+            n = XDRIVER_MAX_DUMP_WINDOWS;
+        if (n == 1 || g->xdriver_version < 1) {
+            n = 1;
+            xdriver_command(g, 'W', (int) dumps[i].window, 0);
+        } else {
+            for (j = 0; j < n; j++)
+                ids[j] = dumps[i + j].window;
+            xdriver_command_payload(g, 'L', n, 0, ids, n * sizeof(ids[0]));
+        }
+        for (j = 0; j < n; j++)
+            read_window_dump(g, &dumps[i + j]);
+    }
+    pthread_mutex_unlock(&g->xdriver_lock);
+}
+
+static void send_window_dump(Ghandles * g, struct window_dump *dump)
+{
+    struct msg_hdr hdr;
+
+    if (!dump->data) {
+        fprintf(stderr, "Failed to get window dump for window 0x%lx\n",
+                dump->window);
+        return;
+    }
     hdr.type = MSG_WINDOW_DUMP;
-    hdr.window = window;
-    hdr.untrusted_len = wd_msg_len;
-    write_struct(g->vchan, hdr);
-    write_data(g->vchan, (char *) wd_msg_buf, wd_msg_len);
-    free(wd_msg_buf);
+    hdr.window = dump->window;
+    hdr.untrusted_len = dump->len;
+    real_write_message(g->vchan, (char *) &hdr, sizeof(hdr),
+                       (char *) dump->data, dump->len);
+    free(dump->data);
+    dump->data = NULL;
     if (g->protocol_version < QUBES_GUID_MIN_MSG_WINDOW_DUMP_ACK)
         feed_xdriver(g, 'a', 0, 0);
 }
 
+static void send_pixmap_grant_refs(Ghandles * g, XID window)
+{
+    struct window_dump dump = { .window = window };
+
+    /* it will be sent with the full state on gui-daemon connection */
+    if (!g->guid_connected)
+        return;
+
+    fetch_window_dumps(g, &dump, 1);
+    send_window_dump(g, &dump);
+}
+
+/* Like send_pixmap_grant_refs(), for several windows at once */
+static void send_pixmap_grant_refs_list(Ghandles * g, const XID *windows,
+                                        size_t count)
+{
+    struct window_dump *dumps;
+    size_t i;
+
+    if (!g->guid_connected || count == 0)
+        return;
+
+    dumps = calloc(count, sizeof(*dumps));
+    if (!dumps) {
+        fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+        exit(1);
+    }
+    for (i = 0; i < count; i++)
+        dumps[i].window = windows[i];
+    fetch_window_dumps(g, dumps, count);
+    for (i = 0; i < count; i++)
+        send_window_dump(g, &dumps[i]);
+    free(dumps);
+}
+
 /* return 1 on success, 0 otherwise */
 static int get_net_wmname(Ghandles * g, XID window, char *outbuf, size_t bufsize) {
     Atom type_return;
@@ -897,6 +1541,41 @@ void retrieve_wmhints(Ghandles * g, XID window, int ignore_fail)
     XFree(wm_hints);
 }
 
+/*
+ * Retrieve _QUBES_MOTION_EVERY_SAMPLE
+ *
+ * Pointer motion is coalesced while the input thread lags behind, unless the
+ * window sets this property (CARDINAL, non-zero) because it needs every
+ * sample, like drawing programs do.
+ */
+void retrieve_motion_every_sample(Ghandles * g, XID window)
+{
+    struct genlist *l;
+    struct window_data *wd;
+    Atom act_type;
+    int act_fmt;
+    unsigned long nitems, bytes_after;
+    unsigned char *data;
+
+    l = lookup_window(g, windows_list, window, __func__);
+    if (!l)
+        return;
+    wd = l->data;
+
+    wd->motion_every_sample = False;
+    if (XGetWindowProperty(g->display, window, g->motion_every_sample, 0, 1,
+                False, XA_CARDINAL, &act_type, &act_fmt, &nitems,
+                &bytes_after, &data) != Success)
+        return;
+    if (act_type == XA_CARDINAL && act_fmt == 32 && nitems == 1)
+        wd->motion_every_sample = *(long *) data != 0;
+    XFree(data);
+
+    if (g->log_level > 1)
+        fprintf(stderr, "Motion coalescing %s for Window 0x%lx\n",
+                wd->motion_every_sample ? "disabled" : "enabled", window);
+}
+
 void send_wmnormalhints(Ghandles * g, XID window, int ignore_fail)
 {
     struct msg_hdr hdr;
@@ -1040,6 +1719,8 @@ static void process_xevent_map(Ghandles * g, XID window)
     hdr.type = MSG_MAP;
     hdr.window = window;
     write_message(g->vchan, hdr, map_info);
+    if (g->guid_connected)
+        mark_startup_phase(STARTUP_FIRST_WINDOW_MAPPED);
     send_wmname(g, window);
 
     if (!attr.override_redirect) {
@@ -1069,7 +1750,7 @@ static void process_xevent_unmap(Ghandles * g, XID window)
     hdr.type = MSG_UNMAP;
     hdr.window = window;
     hdr.untrusted_len = 0;
-    write_struct(g->vchan, hdr);
+    write_header(g->vchan, hdr);
     XDeleteProperty(g->display, window, g->wm_state);
     XDeleteProperty(g->display, window, g->net_wm_state);
 }
@@ -1098,7 +1779,7 @@ static void process_xevent_destroy(Ghandles * g, XID window)
     hdr.type = MSG_DESTROY;
     hdr.window = window;
     hdr.untrusted_len = 0;
-    write_struct(g->vchan, hdr);
+    write_header(g->vchan, hdr);
     if (wd->is_docked) {
         XDestroyWindow(g->display, wd->embeder);
     }
@@ -1197,8 +1878,7 @@ static void send_clipboard_data(libvchan_t *vchan, XID window, char *data, uint3
         len = MAX_CLIPBOARD_BUFFER_SIZE + 1;
     }
     hdr.untrusted_len = len;
-    write_struct(vchan, hdr);
-    write_data(vchan, (char *) data, len);
+    real_write_message(vchan, (char *) &hdr, sizeof(hdr), (char *) data, len);
 }
 
 static void handle_targets_list(Ghandles * g, unsigned char *data, int len)
@@ -1221,13 +1901,171 @@ static void handle_targets_list(Ghandles * g, unsigned char *data, int len)
             g->stub_win, g->time);
 }
 
-static void process_xevent_selection(Ghandles * g, XSelectionEvent * ev)
+/* Size of clipboard data (in bytes) the GUI daemon will accept. Anything
+ * longer will be truncated by send_clipboard_data anyway. */
+static size_t clipboard_size_limit(Ghandles * g)
 {
-    int format, result;
-    Atom type;
-    unsigned long len, bytes_left, dummy;
-    unsigned char *data;
-    g->time = ev->time;
+    if (g->protocol_version < QUBES_GUID_MIN_CLIPBOARD_4X)
+        return MAX_CLIPBOARD_SIZE;
+    return MAX_CLIPBOARD_BUFFER_SIZE + 1;
+}
+
+static long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void clipboard_incr_finish(Ghandles * g)
+{
+    event_timer_disarm(g->clipboard_incr_timer);
+    XSelectInput(g->display, g->stub_win, NoEventMask);
+    free(g->clipboard_incr_data);
+    g->clipboard_incr_data = NULL;
+    g->clipboard_incr_active = false;
+}
+
+/* Start receiving selection data using the INCR protocol. The data is
+ * collected chunk by chunk as the selection owner provides it, up to the size
+ * the GUI daemon will accept, and sent at the end of the transfer. */
+static void clipboard_incr_start(Ghandles * g, unsigned char *data,
+        unsigned long len, int format)
+{
+    size_t size_hint = 0;
+
+    if (g->clipboard_incr_active)
+        clipboard_incr_finish(g);
+
+    /* The INCR property holds a lower bound of the data size. Xlib returns
+     * 32-bit properties as an array of longs. */
+    if (format == 32 && len >= 1)
+        size_hint = *(unsigned long *) data;
+    g->clipboard_incr_limit = clipboard_size_limit(g);
+    if (size_hint == 0)
+        size_hint = g->clipboard_incr_chunk;
+    if (size_hint > g->clipboard_incr_limit)
+        size_hint = g->clipboard_incr_limit;
+
+    g->clipboard_incr_data = malloc(size_hint);
+    if (!g->clipboard_incr_data) {
+        fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+        send_clipboard_data(g->vchan, g->stub_win, NULL, 0,
+                            g->protocol_version);
+        return;
+    }
+    g->clipboard_incr_size = size_hint;
+    g->clipboard_incr_len = 0;
+    g->clipboard_incr_active = true;
+    if (g->log_level > 0)
+        fprintf(stderr, "INCR selection transfer started, size hint %zu\n",
+                size_hint);
+
+    XSelectInput(g->display, g->stub_win, PropertyChangeMask);
+    /* deleting the INCR property requests the first chunk */
+    XDeleteProperty(g->display, g->stub_win, g->qprop);
+    event_timer_arm(g->clipboard_incr_timer, CLIPBOARD_INCR_TIMEOUT);
+}
+
+/* The selection owner stopped sending chunks; the partial data is dropped,
+ * as the GUI daemon could not tell it from complete one */
+static void clipboard_incr_timeout(void *opaque)
+{
+    Ghandles *g = opaque;
+
+    if (!g->clipboard_incr_active)
+        return;
+    fprintf(stderr, "INCR selection transfer stalled, aborting\n");
+    send_clipboard_data(g->vchan, g->stub_win, NULL, 0, g->protocol_version);
+    clipboard_incr_finish(g);
+}
+
+static void process_xevent_selection_incr(Ghandles * g, XPropertyEvent * ev)
+{
+    int format, result;
+    Atom type;
+    unsigned long len, bytes_left;
+    unsigned char *data;
+    size_t space;
+
+    if (!g->clipboard_incr_active || ev->atom != g->qprop ||
+            ev->state != PropertyNewValue)
+        return;
+
+    /* delete the property to request the next chunk */
+    result = XGetWindowProperty(g->display, g->stub_win, g->qprop, 0,
+            INT_MAX / 4, True, AnyPropertyType, &type, &format, &len,
+            &bytes_left, &data);
+    if (result != Success) {
+        fprintf(stderr, "Failed to read INCR selection chunk\n");
+        send_clipboard_data(g->vchan, g->stub_win,
+                            (char *) g->clipboard_incr_data,
+                            g->clipboard_incr_len, g->protocol_version);
+        clipboard_incr_finish(g);
+        return;
+    }
+
+    if (len == 0) {
+        /* zero-length chunk marks the end of data */
+        if (g->log_level > 0)
+            fprintf(stderr, "INCR selection transfer done, %zu bytes\n",
+                    g->clipboard_incr_len);
+        send_clipboard_data(g->vchan, g->stub_win,
+                            (char *) g->clipboard_incr_data,
+                            g->clipboard_incr_len, g->protocol_version);
+        clipboard_incr_finish(g);
+        XFree(data);
+        return;
+    }
+    event_timer_arm(g->clipboard_incr_timer, CLIPBOARD_INCR_TIMEOUT);
+
+    if (format != 8) {
+        if (g->log_level > 0)
+            fprintf(stderr, "Ignoring INCR selection chunk of format %d\n",
+                    format);
+        XFree(data);
+        return;
+    }
+
+    /* data over the limit is discarded, but the transfer still needs to run
+     * to the end, otherwise the selection owner would wait for us forever */
+    space = g->clipboard_incr_limit - g->clipboard_incr_len;
+    if (len > space)
+        len = space;
+    if (g->clipboard_incr_len + len > g->clipboard_incr_size) {
+        size_t new_size = g->clipboard_incr_size * 2;
+        unsigned char *new_data;
+
+        if (new_size < g->clipboard_incr_len + len)
+            new_size = g->clipboard_incr_len + len;
+        if (new_size > g->clipboard_incr_limit)
+            new_size = g->clipboard_incr_limit;
+        new_data = realloc(g->clipboard_incr_data, new_size);
+        if (!new_data) {
+            /* later chunks would be appended after a gap, abort instead */
+            fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+            XFree(data);
+            send_clipboard_data(g->vchan, g->stub_win, NULL, 0,
+                                g->protocol_version);
+            clipboard_incr_finish(g);
+            return;
+        }
+        g->clipboard_incr_data = new_data;
+        g->clipboard_incr_size = new_size;
+    }
+    memcpy(g->clipboard_incr_data + g->clipboard_incr_len, data, len);
+    g->clipboard_incr_len += len;
+    XFree(data);
+}
+
+static void process_xevent_selection(Ghandles * g, XSelectionEvent * ev)
+{
+    int format, result;
+    Atom type;
+    unsigned long len, bytes_left, dummy;
+    unsigned char *data;
+    g->time = ev->time;
 
     if (g->log_level > 0)
         fprintf(stderr, "selection event, target=%s\n",
@@ -1259,11 +2097,8 @@ static void process_xevent_selection(Ghandles * g, XSelectionEvent * ev)
                 g->utf8_string_atom, g->qprop,
                 g->stub_win, ev->time);
     else
-        if (type == XInternAtom(g->display, "INCR", False)) {
-            char INCR_WARNING[] =
-                "Qube clipboard size over 256KiB and X11 INCR protocol support is not implemented!";
-            send_clipboard_data(g->vchan, g->stub_win, (char *) &INCR_WARNING,
-                                sizeof(INCR_WARNING)-1, g->protocol_version);
+        if (type == g->incr) {
+            clipboard_incr_start(g, data, len, format);
         } else {
             send_clipboard_data(g->vchan, g->stub_win, (char *) data, len,
                                 g->protocol_version);
@@ -1273,22 +2108,206 @@ static void process_xevent_selection(Ghandles * g, XSelectionEvent * ev)
     XFree(data);
 }
 
+static struct genlist *lookup_incr_transfer(Window requestor, Atom property)
+{
+    struct genlist *l;
+
+    for (l = incr_transfer_list->next; l != incr_transfer_list; l = l->next) {
+        struct incr_transfer *t = l->data;
+        if (t->requestor == requestor && t->property == property)
+            return l;
+    }
+    return NULL;
+}
+
+static void remove_incr_transfer(Ghandles * g, struct genlist *l)
+{
+    struct incr_transfer *t = l->data;
+    Window requestor = t->requestor;
+    long saved_event_mask = t->saved_event_mask;
+
+    free(t);
+    list_remove(l);
+    /* the requestor may be the root or an embeder, with events of its own */
+    if (!list_lookup(incr_transfer_list, requestor))
+        XSelectInput(g->display, requestor, saved_event_mask);
+}
+
+/* Abort all INCR transfers - needs to be done before g->clipboard_data is
+ * modified */
+static void abort_incr_transfers(Ghandles * g)
+{
+    while (incr_transfer_list->next != incr_transfer_list)
+        remove_incr_transfer(g, incr_transfer_list->next);
+}
+
+/* Abort INCR transfers whose requestor stopped deleting the property */
+static void incr_transfer_timeout(void *opaque)
+{
+    Ghandles *g = opaque;
+    struct genlist *l, *next;
+    long now = monotonic_ms();
+
+    for (l = incr_transfer_list->next; l != incr_transfer_list; l = next) {
+        struct incr_transfer *t = l->data;
+
+        next = l->next;
+        if (now - t->last_activity_ms < CLIPBOARD_INCR_TIMEOUT)
+            continue;
+        fprintf(stderr, "INCR transfer to 0x%lx stalled, aborting\n",
+                t->requestor);
+        remove_incr_transfer(g, l);
+    }
+    if (incr_transfer_list->next != incr_transfer_list)
+        event_timer_arm(g->incr_transfer_timer, CLIPBOARD_INCR_TIMEOUT);
+}
+
+/* Announce INCR transfer of the data to the requestor. The data itself is
+ * sent in chunks, each time the requestor deletes the property. */
+static int start_incr_transfer(Ghandles * g, XSelectionRequestEvent * req,
+        const unsigned char *data, size_t len)
+{
+    struct genlist *l;
+    struct incr_transfer *t;
+    XWindowAttributes attr;
+    long size_hint = len;
+
+    l = lookup_incr_transfer(req->requestor, req->property);
+    if (l)
+        remove_incr_transfer(g, l);
+
+    t = malloc(sizeof(*t));
+    if (!t) {
+        fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+        return 0;
+    }
+    /* another transfer to the same requestor already changed the mask */
+    l = list_lookup(incr_transfer_list, req->requestor);
+    if (l) {
+        t->saved_event_mask = ((struct incr_transfer *) l->data)->saved_event_mask;
+    } else if (XGetWindowAttributes(g->display, req->requestor, &attr)) {
+        t->saved_event_mask = attr.your_event_mask;
+    } else {
+        fprintf(stderr, "%s: requestor 0x%lx is gone\n", __func__,
+                req->requestor);
+        free(t);
+        return 0;
+    }
+    t->requestor = req->requestor;
+    t->property = req->property;
+    t->target = req->target;
+    t->data = data;
+    t->len = len;
+    t->offset = 0;
+    t->last_activity_ms = monotonic_ms();
+    if (incr_transfer_list->next == incr_transfer_list)
+        event_timer_arm(g->incr_transfer_timer, CLIPBOARD_INCR_TIMEOUT);
+    if (!list_insert(incr_transfer_list, req->requestor, t)) {
+        fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+        free(t);
+        return 0;
+    }
+
+    if (g->log_level > 0)
+        fprintf(stderr, "INCR transfer of %zu bytes to 0x%lx\n",
+                len, req->requestor);
+    XSelectInput(g->display, req->requestor,
+                 t->saved_event_mask | PropertyChangeMask);
+    XChangeProperty(g->display, req->requestor, req->property, g->incr,
+            32, PropModeReplace, (unsigned char *) &size_hint, 1);
+    return 1;
+}
+
+/* return 1 if the event belongs to an INCR transfer, 0 otherwise */
+static int process_xevent_incr_transfer(Ghandles * g, XPropertyEvent * ev)
+{
+    struct genlist *l;
+    struct incr_transfer *t;
+    size_t chunk;
+
+    l = lookup_incr_transfer(ev->window, ev->atom);
+    if (!l)
+        return 0;
+    /* PropertyNewValue is the result of our own write */
+    if (ev->state != PropertyDelete)
+        return 1;
+
+    t = l->data;
+    t->last_activity_ms = monotonic_ms();
+    chunk = t->len - t->offset;
+    if (chunk > g->clipboard_incr_chunk)
+        chunk = g->clipboard_incr_chunk;
+    XChangeProperty(g->display, t->requestor, t->property, t->target,
+            8, PropModeReplace, (unsigned char *) t->data + t->offset, chunk);
+    t->offset += chunk;
+    /* the zero-length property written last marks the end of data */
+    if (chunk == 0)
+        remove_incr_transfer(g, l);
+    return 1;
+}
+
+/* Prepare the property contents served for each text target, so repeated
+ * selection requests don't need to validate and convert the data again. Needs
+ * to be called whenever g->clipboard_data changes. */
+static void prepare_clipboard_data(Ghandles * g)
+{
+    static const unsigned char empty_string[1] = { '\0' };
+    const unsigned char *text = empty_string;
+    const unsigned char *utf8_text = empty_string;
+    size_t len = 0, utf8_len = 0;
+
+    if (g->clipboard_data) {
+        text = g->clipboard_data;
+        len = strlen((const char *) text);
+    }
+    // Workaround for an Xlib bug: Xutf8TextListToTextProperty mangles
+    // certain characters, so we check for UTF-8 validity ourselves and serve
+    // the data as is.  If we fail a UTF-8 validity check, UTF8_STRING
+    // requests get an empty string, which is safe.
+    //
+    // We don’t refuse the request because users might (reasonably)
+    // assume that any sensitive data previously on the clipboard
+    // (such as passwords) has been overwritten.
+    if (is_valid_clipboard_buffer_from_vm(text, len)) {
+        utf8_text = text;
+        utf8_len = len;
+    } else {
+        fputs("Invalid clipboard data from VM\n", stderr);
+    }
+
+    g->clipboard_targets[0].target = XA_STRING;
+    g->clipboard_targets[0].data = text;
+    g->clipboard_targets[0].len = len;
+    g->clipboard_targets[1].target = g->compound_text;
+    g->clipboard_targets[1].data = text;
+    g->clipboard_targets[1].len = len;
+    g->clipboard_targets[2].target = g->utf8_string_atom;
+    g->clipboard_targets[2].data = utf8_text;
+    g->clipboard_targets[2].len = utf8_len;
+}
+
+static void wipe_clipboard_data(void *opaque)
+{
+    Ghandles *g = opaque;
+
+    if (!g->clipboard_data)
+        return;
+    if (g->log_level > 0)
+        fprintf(stderr, "wiping clipboard data unused for %dms\n",
+                CLIPBOARD_WIPE_TIME);
+    abort_incr_transfers(g);
+    g->clipboard_data[0] = '\x00';
+    g->clipboard_data_len = 1;
+    prepare_clipboard_data(g);
+}
+
 static void process_xevent_selection_req(Ghandles * g,
         XSelectionRequestEvent * req)
 {
     XSelectionEvent resp;
-    int convert_style = XConverterNotFound;
+    struct clipboard_target *target = NULL;
     g->time = req->time;
 
-    if (g->clipboard_wipe &&
-            g->time > g->clipboard_last_access + CLIPBOARD_WIPE_TIME) {
-        if (g->log_level > 0)
-            fprintf(stderr, "wiping %ldms old clipboard data\n",
-                    g->time - g->clipboard_last_access);
-        g->clipboard_data[0] = '\x00';
-        g->clipboard_data_len = 1;
-    }
-
     if (g->log_level > 0)
         fprintf(stderr, "selection req event, target=%s\n",
                 XGetAtomName(g->display, req->target));
@@ -1301,38 +2320,23 @@ static void process_xevent_selection_req(Ghandles * g,
                 tmp, sizeof(tmp) / sizeof(tmp[0]));
         resp.property = req->property;
     }
-    if (req->target == XA_STRING)
-        convert_style = XTextStyle;
-    else if (req->target == g->compound_text)
-        convert_style = XCompoundTextStyle;
-    else if (req->target == g->utf8_string_atom)
-        convert_style = XUTF8StringStyle;
-    if (convert_style != XConverterNotFound) {
-        XTextProperty ct;
-        char empty_string[1] = { '\0' };
-        char *ptr[] = { empty_string };
-        // Workaround for an Xlib bug: Xutf8TextListToTextProperty mangles
-        // certain characters, so we check for UTF-8 validity ourselves and use
-        // XStringListToTextProperty.  If we fail a UTF-8 validity check, ptr[0]
-        // is left pointing to an empty string, which is safe.
-        //
-        // We don’t return immediately because users might (reasonably)
-        // assume that any sensitive data previously on the clipboard
-        // (such as passwords) has been overwritten.
-        if (convert_style == XUTF8StringStyle &&
-            !is_valid_clipboard_string_from_vm((unsigned char *)g->clipboard_data))
-            fputs("Invalid clipboard data from VM\n", stderr);
-        else
-            ptr[0] = (char *) g->clipboard_data;
-        if (!XStringListToTextProperty(ptr, 1, &ct)) {
-            fputs("Out of memory in Xutf8TextListToTextProperty()\n", stderr);
-            return;
+    for (size_t i = 0; i < QUBES_ARRAY_SIZE(g->clipboard_targets); i++) {
+        if (req->target == g->clipboard_targets[i].target) {
+            target = &g->clipboard_targets[i];
+            break;
+        }
+    }
+    if (target) {
+        if (target->len > g->clipboard_incr_chunk) {
+            // Too big for a single request
+            if (start_incr_transfer(g, req, target->data, target->len))
+                resp.property = req->property;
+        } else {
+            XChangeProperty(g->display, req->requestor, req->property,
+                    target->target, 8, PropModeReplace,
+                    target->data, target->len);
+            resp.property = req->property;
         }
-        ct.encoding = req->target;
-        XSetTextProperty(g->display, req->requestor, &ct,
-                req->property);
-        XFree(ct.value);
-        resp.property = req->property;
     }
 
     if (resp.property == None)
@@ -1345,7 +2349,8 @@ static void process_xevent_selection_req(Ghandles * g,
     resp.selection = req->selection;
     resp.target = req->target;
     resp.time = req->time;
-    g->clipboard_last_access = g->time;
+    if (g->clipboard_wipe_timer)
+        event_timer_arm(g->clipboard_wipe_timer, CLIPBOARD_WIPE_TIME);
     XSendEvent(g->display, req->requestor, 0, 0, (XEvent *) & resp);
 }
 
@@ -1356,6 +2361,13 @@ static void process_xevent_property(Ghandles * g, XID window, XPropertyEvent * e
 
     g->time = ev->time;
 
+    if (window == g->stub_win) {
+        process_xevent_selection_incr(g, ev);
+        return;
+    }
+    if (process_xevent_incr_transfer(g, ev))
+        return;
+
     l = lookup_window(g, windows_list, window, __func__);
     if (!l) {
         return;
@@ -1377,6 +2389,8 @@ static void process_xevent_property(Ghandles * g, XID window, XPropertyEvent * e
         retrieve_wmhints(g,window, 0);
     else if (ev->atom == g->wmProtocols)
         retrieve_wmprotocols(g,window, 0);
+    else if (ev->atom == g->motion_every_sample)
+        retrieve_motion_every_sample(g, window);
     else if (ev->atom == g->xembed_info) {
         Atom act_type;
         unsigned long nitems, bytesafter;
@@ -1501,7 +2515,7 @@ static void process_xevent_message(Ghandles * g, XClientMessageEvent * ev)
                 hdr.type = MSG_DOCK;
                 hdr.window = w;
                 hdr.untrusted_len = 0;
-                write_struct(g->vchan, hdr);
+                write_header(g->vchan, hdr);
                 break;
             default:
                 fprintf(stderr, "unhandled tray opcode: %ld\n",
@@ -1557,6 +2571,12 @@ static void process_xevent(Ghandles * g)
             process_xevent_unmap(g, event_buffer.xmap.window);
             break;
         case ConfigureNotify:
+            if (event_buffer.xconfigure.window == g->root_win) {
+                /* screen resized */
+                g->root_width = event_buffer.xconfigure.width;
+                g->root_height = event_buffer.xconfigure.height;
+                break;
+            }
             process_xevent_configure(g,
                     event_buffer.xconfigure.window,
                     (XConfigureEvent *) &
@@ -1609,113 +2629,237 @@ static void process_xevent(Ghandles * g)
     }
 }
 
-/* return 1 if info sent, 0 otherwise */
-static int send_full_window_info(Ghandles *g, XID w, struct window_data *wd)
-{
-    struct msg_hdr hdr;
-    struct msg_create crt;
+/* Pending X queries for send_full_window_info(); issued for all windows
+ * at once, so the resync costs a single round trip instead of four per
+ * window */
+struct window_snapshot {
+    XID window;
+    struct window_data *wd;
+    xcb_get_window_attributes_cookie_t attr_cookie;
+    xcb_get_geometry_cookie_t geometry_cookie;
+    xcb_query_tree_cookie_t tree_cookie;
+    xcb_get_property_cookie_t transient_cookie;
+    /* filled by collect_window_snapshot() */
     struct msg_configure conf;
-    struct msg_map_info map_info;
+    Window parent;
+    Window transient;
+    int mapped;
+    /* fetched for all windows at once too */
+    struct window_dump *dump;
+};
 
-    XWindowAttributes attr;
-    int ret;
-    Window *children_list = NULL;
+static void request_window_snapshot(xcb_connection_t *conn,
+        struct window_snapshot *snap)
+{
+    const Window window_to_query = snap->wd->is_docked ? snap->wd->embeder : snap->window;
+
+    snap->attr_cookie = xcb_get_window_attributes(conn, window_to_query);
+    snap->geometry_cookie = xcb_get_geometry(conn, window_to_query);
+    snap->tree_cookie = xcb_query_tree(conn, window_to_query);
+    snap->transient_cookie = xcb_get_property(conn, 0, snap->window,
+            XA_WM_TRANSIENT_FOR, XA_WINDOW, 0, 1);
+}
+
+/* Collect the replies to request_window_snapshot(); return 1 if the window
+ * can be sent, 0 otherwise */
+static int collect_window_snapshot(Ghandles *g, xcb_connection_t *conn,
+        struct window_snapshot *snap)
+{
+    xcb_get_window_attributes_reply_t *attr;
+    xcb_get_geometry_reply_t *geometry;
+    xcb_query_tree_reply_t *tree;
+    xcb_get_property_reply_t *transient_prop;
+    XID w = snap->window;
+    struct window_data *wd = snap->wd;
     Window root;
     Window parent;
-    Window transient;
-    unsigned int children_count;
+    int ret = 0;
 
     const Window window_to_query = wd->is_docked ? wd->embeder : w;
-    ret = XGetWindowAttributes(g->display, window_to_query, &attr);
-    if (ret != 1) {
+    /* collect all the replies, so none is left behind on failure */
+    attr = xcb_get_window_attributes_reply(conn, snap->attr_cookie, NULL);
+    geometry = xcb_get_geometry_reply(conn, snap->geometry_cookie, NULL);
+    tree = xcb_query_tree_reply(conn, snap->tree_cookie, NULL);
+    transient_prop = xcb_get_property_reply(conn, snap->transient_cookie, NULL);
+    if (!attr || !geometry) {
         fprintf(stderr, "XGetWindowAttributes for 0x%lx failed in "
-                "send_window_state, ret=0x%x\n", w, ret);
-        return 0;
+                "send_window_state\n", w);
+        goto out;
     }
-    ret = XQueryTree(g->display, window_to_query, &root, &parent, &children_list, &children_count);
-    if (ret != 1) {
+    if (!tree) {
         fprintf(stderr, "XQueryTree for 0x%lx failed in "
-                "send_window_state, ret=0x%x\n", w, ret);
-        return 0;
+                "send_window_state\n", w);
+        goto out;
     }
-    if (children_list)
-        XFree(children_list);
+    root = tree->root;
+    parent = tree->parent;
     if (parent != g->root_win) {
         fprintf(stderr, "Window 0x%lx has parent 0x%lx, which isn't root 0x%lx.\n"
                 " Presumably window has been reparented at some point.\n"
                 " Skipping it.\n",
                 window_to_query, parent, g->root_win);
-        return 0;
+        goto out;
     }
     if (root != g->root_win) {
         fprintf(stderr, "Window 0x%lx has root 0x%lx, which isn't expected root 0x%lx.\n"
                 " This is rather strange and probably indicates a bug somewhere.\n"
                 " Skipping it.\n",
                 window_to_query, root, g->root_win);
-        return 0;
+        goto out;
     }
-    if (!XGetTransientForHint(g->display, w, &transient))
-        transient = 0;
+    snap->transient = 0;
+    if (transient_prop && transient_prop->type == XA_WINDOW &&
+            transient_prop->format == 32 &&
+            xcb_get_property_value_length(transient_prop) >= 4)
+        snap->transient = *(uint32_t *)xcb_get_property_value(transient_prop);
+    snap->parent = parent;
+    snap->mapped = attr->map_state != XCB_MAP_STATE_UNMAPPED;
+    snap->conf.x = geometry->x;
+    snap->conf.y = geometry->y;
+    snap->conf.width = geometry->width;
+    snap->conf.height = geometry->height;
+    snap->conf.override_redirect = attr->override_redirect;
+    ret = 1;
+out:
+    free(attr);
+    free(geometry);
+    free(tree);
+    free(transient_prop);
+    return ret;
+}
+
+static void send_full_window_info(Ghandles *g, struct window_snapshot *snap)
+{
+    struct msg_hdr hdr;
+    struct msg_create crt;
+    struct msg_map_info map_info;
+    XID w = snap->window;
 
     hdr.window = w;
     hdr.type = MSG_CREATE;
-    crt.width = attr.width;
-    crt.height = attr.height;
-    crt.parent = parent;
-    crt.x = attr.x;
-    crt.y = attr.y;
-    crt.override_redirect = attr.override_redirect;
+    crt.width = snap->conf.width;
+    crt.height = snap->conf.height;
+    crt.parent = snap->parent;
+    crt.x = snap->conf.x;
+    crt.y = snap->conf.y;
+    crt.override_redirect = snap->conf.override_redirect;
     write_message(g->vchan, hdr, crt);
 
     hdr.type = MSG_CONFIGURE;
-    conf.x = attr.x;
-    conf.y = attr.y;
-    conf.width = attr.width;
-    conf.height = attr.height;
-    conf.override_redirect = attr.override_redirect;
-    write_message(g->vchan, hdr, conf);
-    send_pixmap_grant_refs(g, w);
+    write_message(g->vchan, hdr, snap->conf);
+    send_window_dump(g, snap->dump);
 
     send_wmclass(g, w, 1);
     send_wmnormalhints(g, w, 1);
 
-    if (wd->is_docked) {
+    if (snap->wd->is_docked) {
         hdr.type = MSG_DOCK;
         hdr.untrusted_len = 0;
-        write_struct(g->vchan, hdr);
-    } else if (attr.map_state != IsUnmapped) {
+        write_header(g->vchan, hdr);
+    } else if (snap->mapped) {
         hdr.type = MSG_MAP;
-        map_info.override_redirect = attr.override_redirect;
-        map_info.transient_for = transient;
+        map_info.override_redirect = snap->conf.override_redirect;
+        map_info.transient_for = snap->transient;
         write_message(g->vchan, hdr, map_info);
+        mark_startup_phase(STARTUP_FIRST_WINDOW_MAPPED);
         send_wmname(g, w);
         send_window_state(g, w);
     }
-    return 1;
 }
 
-static void send_all_windows_info(Ghandles *g) {
-    struct genlist *curr = windows_list->next;
-    int ret;
+static long elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000L +
+        (end->tv_nsec - start->tv_nsec) / 1000000L;
+}
 
+static void send_all_windows_info(Ghandles *g) {
+    xcb_connection_t *conn = XGetXCBConnection(g->display);
+    struct window_snapshot *snaps;
+    struct window_dump *dumps;
+    struct genlist *curr;
+    struct timespec start, queried, done;
+    size_t count = 0, skipped = 0, sent, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
     feed_xdriver(g, 'A', 0, 0);
-    while (curr != windows_list) {
-        ret = send_full_window_info(g, curr->key, (struct window_data *)curr->data);
-        curr = curr->next;
-        if (!ret) {
-            /* gui-daemon did not received this window, so prevent further
+    for (curr = windows_list->next; curr != windows_list; curr = curr->next)
+        count++;
+    snaps = calloc(count ? count : 1, sizeof(*snaps));
+    dumps = calloc(count ? count : 1, sizeof(*dumps));
+    if (!snaps || !dumps) {
+        fprintf(stderr, "%s: OUT OF MEMORY\n", __func__);
+        exit(1);
+    }
+    /* Xlib may have requests buffered, keep them ordered before ours */
+    XFlush(g->display);
+    for (curr = windows_list->next, i = 0; curr != windows_list; curr = curr->next, i++) {
+        snaps[i].window = curr->key;
+        snaps[i].wd = curr->data;
+        request_window_snapshot(conn, &snaps[i]);
+    }
+    xcb_flush(conn);
+    clock_gettime(CLOCK_MONOTONIC, &queried);
+
+    /* Keep only the windows that will be sent, as the dumps stay queued in
+     * qubes_drv until gui-daemon acks them */
+    for (i = 0, sent = 0; i < count; i++) {
+        if (!collect_window_snapshot(g, conn, &snaps[i])) {
+            /* gui-daemon will not receive this window, so prevent further
              * updates on it */
-            if (curr->prev->data)
-                free(curr->prev->data);
-            list_remove(curr->prev);
+            curr = list_lookup(windows_list, snaps[i].window);
+            if (curr) {
+                if (curr->data)
+                    free(curr->data);
+                list_remove(curr);
+            }
+            skipped++;
+            continue;
         }
+        snaps[sent] = snaps[i];
+        snaps[sent].dump = &dumps[sent];
+        dumps[sent].window = snaps[i].window;
+        sent++;
     }
+    fetch_window_dumps(g, dumps, sent);
+
+    for (i = 0; i < sent; i++)
+        send_full_window_info(g, &snaps[i]);
+    free(dumps);
+    free(snaps);
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    fprintf(stderr, "Sent state of %zu windows (%zu skipped) in %ldms "
+            "(%ldms issuing X queries)\n",
+            count - skipped, skipped, elapsed_ms(&start, &done),
+            elapsed_ms(&start, &queried));
+    resync_stats_add(&stats_resync, count - skipped, skipped,
+                     elapsed_ms(&start, &done), elapsed_ms(&start, &queried));
+    schedule_stats_update();
+}
+
+/* Ask qubes_drv for its protocol version, see XDRIVER_VERSION. Called on
+ * each connection, before any other command. */
+static void query_xdriver_version(Ghandles * g)
+{
+    struct xdriver_cmd cmd = { .type = 'V' };
+    char ans;
+
+    if (write(g->xserver_fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+        err(1, "unix write");
+    if (read(g->xserver_fd, &ans, 1) != 1)
+        err(1, "unix read");
+    if (ans < '0')
+        errx(1, "unexpected version 0x%hhx from qubes_drv", ans);
+    g->xdriver_version = ans - '0';
+    if (g->log_level > 0)
+        fprintf(stderr, "qubes_drv protocol version %d\n", g->xdriver_version);
 }
 
 static void wait_for_unix_socket(Ghandles *g)
 {
     struct sockaddr_un sockname, peer;
     socklen_t addrlen;
+    int fd;
     int prev_umask;
     struct group *qubes_group;
 
@@ -1763,8 +2907,8 @@ static void wait_for_unix_socket(Ghandles *g)
         fprintf(stderr, "Xorg exited in the meantime, aborting\n");
         exit(1);
     }
-    g->xserver_fd = accept(g->xserver_listen_fd, (struct sockaddr *) &peer, &addrlen);
-    if (g->xserver_fd == -1) {
+    fd = accept(g->xserver_listen_fd, (struct sockaddr *) &peer, &addrlen);
+    if (fd == -1) {
         if (errno == EINTR && g->x_pid == (pid_t)-1)
             fprintf(stderr, "Xorg exited in the meantime, aborting\n");
         else
@@ -1772,6 +2916,11 @@ static void wait_for_unix_socket(Ghandles *g)
         exit(1);
     }
     fprintf (stderr, "Ok, somebody connected.\n");
+    /* the input thread may be waiting to send commands */
+    pthread_mutex_lock(&g->xdriver_lock);
+    g->xserver_fd = fd;
+    query_xdriver_version(g);
+    pthread_mutex_unlock(&g->xdriver_lock);
 }
 
 static void mkghandles(Ghandles * g)
@@ -1793,6 +2942,8 @@ static void mkghandles(Ghandles * g)
                 "Connection to local X server established.\n");
     g->screen = DefaultScreen(g->display); /* get CRT id number */
     g->root_win = RootWindow(g->display, g->screen); /* get default attributes */
+    g->root_width = DisplayWidth(g->display, g->screen);
+    g->root_height = DisplayHeight(g->display, g->screen);
     g->context = XCreateGC(g->display, g->root_win, 0, NULL);
     g->stub_win = XCreateSimpleWindow(g->display, g->root_win,
             0, 0, 1, 1,
@@ -1830,6 +2981,8 @@ static void mkghandles(Ghandles * g)
         { &g->qprop,            "QUBES_SELECTION" },
         { &g->compound_text,    "COMPOUND_TEXT" },
         { &g->xembed,           "_XEMBED" },
+        { &g->incr,             "INCR" },
+        { &g->motion_every_sample, "_QUBES_MOTION_EVERY_SAMPLE" },
     };
     Atom supported[SUPPORTED_ATOMS + QUBES_ARRAY_SIZE(atoms_to_intern)];
     /* pretend that GUI agent is window manager */
@@ -1864,32 +3017,37 @@ static void mkghandles(Ghandles * g)
 
     g->clipboard_data = NULL;
     g->clipboard_data_len = 0;
+    g->clipboard_incr_active = false;
+    g->clipboard_incr_data = NULL;
+    /* Keep some space for the ChangeProperty request header */
+    g->clipboard_incr_chunk = XMaxRequestSize(g->display) * 4 - 100;
+    prepare_clipboard_data(g);
 }
 
-static void handle_keypress(Ghandles * g, XID UNUSED(winid))
+static void inject_keypress(Ghandles * g, struct xdriver_batch *xbatch,
+                            struct msg_keypress *key)
 {
-    struct msg_keypress key;
     XkbStateRec state;
-    read_data(g->vchan, (char *) &key, sizeof(key));
 
     if(!g->created_input_device) {
-        // sync modifiers state
-        if (XkbGetState(g->display, XkbUseCoreKbd, &state) != Success) {
+        // sync modifiers state, including the keys still in xbatch
+        flush_xdriver_batch(g, xbatch);
+        if (XkbGetState(g->input_display, XkbUseCoreKbd, &state) != Success) {
             if (g->log_level > 0)
                 fprintf(stderr, "failed to get modifier state\n");
-            state.mods = key.state;
+            state.mods = key->state;
         }
         if (!g->sync_all_modifiers) {
             // ignore all but CapsLock
             state.mods &= LockMask;
-            key.state &= LockMask;
+            key->state &= LockMask;
         }
-        if (state.mods != key.state) {
+        if (state.mods != key->state) {
             XModifierKeymap *modmap;
             int mod_index;
             int mod_mask;
 
-            modmap = XGetModifierMapping(g->display);
+            modmap = XGetModifierMapping(g->input_display);
             if (!modmap) {
                 if (g->log_level > 0)
                     fprintf(stderr, "failed to get modifier mapping\n");
@@ -1913,29 +3071,30 @@ static void handle_keypress(Ghandles * g, XID UNUSED(winid))
                     mod_mask = (1<<mod_index);
                     // special case for caps lock switch by press+release
                     if (mod_index == LockMapIndex) {
-                        if ((state.mods & mod_mask) ^ (key.state & mod_mask)) {
-                            feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 1);
-                            feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 0);
+                        if ((state.mods & mod_mask) ^ (key->state & mod_mask)) {
+                            xdriver_batch_add(g, xbatch, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 1);
+                            xdriver_batch_add(g, xbatch, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 0);
                         }
                     } else {
-                        if ((state.mods & mod_mask) && !(key.state & mod_mask))
-                            feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 0);
-                        else if (!(state.mods & mod_mask) && (key.state & mod_mask))
-                            feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 1);
+                        if ((state.mods & mod_mask) && !(key->state & mod_mask))
+                            xdriver_batch_add(g, xbatch, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 0);
+                        else if (!(state.mods & mod_mask) && (key->state & mod_mask))
+                            xdriver_batch_add(g, xbatch, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 1);
                     }
                 }
                 XFreeModifiermap(modmap);
             }
         }
 
-        feed_xdriver(g, 'K', key.keycode, key.type == KeyPress ? 1 : 0);
+        xdriver_batch_add(g, xbatch, 'K', key->keycode,
+                          key->type == KeyPress ? 1 : 0);
     } else {
         int mod_mask;
         int mod_index;
-        struct input_event iev;
-        iev.type = EV_KEY;
+        int code;
+        struct input_batch batch = { .count = 0 };
         XModifierKeymap *modmap;
-        modmap = XGetModifierMapping(g->display);
+        modmap = XGetModifierMapping(g->input_display);
 
         if (!modmap) {
                 if (g->log_level > 0)
@@ -1951,32 +3110,32 @@ static void handle_keypress(Ghandles * g, XID UNUSED(winid))
                 mod_mask = (1<<mod_index);
                 // special case for caps lock switch by press+release
                 if (mod_index == LockMapIndex) {
-                    if ((g->last_known_modifier_states & mod_mask) ^ (key.state & mod_mask)) {
-                        iev.code = modmap->modifiermap[mod_index*modmap->max_keypermod] - 8;
-                        iev.value = 1;
-                        send_event(g, &iev);
-                        iev.value = 0;
-                        send_event(g, &iev);
+                    if ((g->last_known_modifier_states & mod_mask) ^ (key->state & mod_mask)) {
+                        code = modmap->modifiermap[mod_index*modmap->max_keypermod] - 8;
+                        // press and release of the same key can't be in a
+                        // single frame
+                        input_batch_add(&batch, EV_KEY, code, 1);
+                        input_batch_syn(&batch);
+                        input_batch_add(&batch, EV_KEY, code, 0);
+                        input_batch_syn(&batch);
                         // update state for caps_lock
                         g->last_known_modifier_states ^= mod_mask;
                     }
                 } else {
                     // last modifier state was pressed down, modifier has since been released
-                    if ((g->last_known_modifier_states & mod_mask) && !(key.state & mod_mask)) {
-                        iev.code = modmap->modifiermap[mod_index*modmap->max_keypermod] - 8;
-                        iev.value = 0;
+                    if ((g->last_known_modifier_states & mod_mask) && !(key->state & mod_mask)) {
+                        code = modmap->modifiermap[mod_index*modmap->max_keypermod] - 8;
                         // send modifier release
-                        send_event(g, &iev);
+                        input_batch_add(&batch, EV_KEY, code, 0);
                         // update state for this modifier
                         g->last_known_modifier_states ^= mod_mask;
                     }
 
                     // last modifier state was up, modifier has since been pressed down
-                    else if (!(g->last_known_modifier_states & mod_mask) && (key.state & mod_mask)) {
-                        iev.code = modmap->modifiermap[mod_index*modmap->max_keypermod] - 8;
-                        iev.value = 1;
+                    else if (!(g->last_known_modifier_states & mod_mask) && (key->state & mod_mask)) {
+                        code = modmap->modifiermap[mod_index*modmap->max_keypermod] - 8;
                         // send modifier press
-                        send_event(g, &iev);
+                        input_batch_add(&batch, EV_KEY, code, 1);
                         // update state for this modifier
                         g->last_known_modifier_states ^= mod_mask;
                     }
@@ -1987,18 +3146,267 @@ static void handle_keypress(Ghandles * g, XID UNUSED(winid))
         XFreeModifiermap(modmap);
 
         // caps lock needs to be excluded to not send down, up, down or down, up, up on a caps lock sync instead of down, up
-        if(key.keycode-8 != KEY_CAPSLOCK) {
-            iev.code = key.keycode-8;
-            iev.value = (key.type == KeyPress ? 1 : 0);
-            send_event(g, &iev);
+        if(key->keycode-8 != KEY_CAPSLOCK) {
+            // modifier changes need to be seen before the key
+            input_batch_syn(&batch);
+            input_batch_add(&batch, EV_KEY, key->keycode-8,
+                            key->type == KeyPress ? 1 : 0);
         }
+        // after the pointer events still in xbatch
+        flush_xdriver_batch(g, xbatch);
+        if (!send_events(g, g->uinput_fd, &batch))
+            g->created_input_device = 0;
+
+    }
+}
+
+/* Translate core button to uinput events; return 0 if not supported */
+static int uinput_button(struct input_batch *batch, unsigned int button,
+        int pressed)
+{
+    static const uint16_t buttons[] = {
+        [1] = BTN_LEFT, [2] = BTN_MIDDLE, [3] = BTN_RIGHT,
+        [8] = BTN_SIDE, [9] = BTN_EXTRA,
+    };
+
+    switch (button) {
+        case 4: case 5: case 6: case 7:
+            /* wheel "buttons", scroll on press only */
+            if (pressed) {
+                int32_t dir = (button == 4 || button == 7) ? 1 : -1;
+                uint16_t axis = button <= 5 ? REL_WHEEL : REL_HWHEEL;
+                uint16_t axis_hi_res = button <= 5 ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES;
+
+                input_batch_add(batch, EV_REL, axis, dir);
+                input_batch_add(batch, EV_REL, axis_hi_res, dir * 120);
+            }
+            return 1;
+        default:
+            if (button >= QUBES_ARRAY_SIZE(buttons) || !buttons[button])
+                return 0;
+            input_batch_add(batch, EV_KEY, buttons[button], pressed);
+            return 1;
+    }
+}
+
+static void inject_button(Ghandles * g, struct xdriver_batch *xbatch,
+                          XID winid, struct msg_button *key)
+{
+    int pressed = key->type == ButtonPress ? 1 : 0;
+
+    if (g->log_level > 1)
+        fprintf(stderr,
+                "send buttonevent, win 0x%lx type=%d button=%d\n",
+                winid, key->type, key->button);
+    if (g->created_pointer_device) {
+        struct input_batch batch = { .count = 0 };
 
+        if (uinput_button(&batch, key->button, pressed)) {
+            flush_xdriver_batch(g, xbatch);
+            if (send_events(g, g->uinput_pointer_fd, &batch))
+                return;
+            g->created_pointer_device = 0;
+        }
     }
+    xdriver_batch_add(g, xbatch, 'B', key->button, pressed);
+}
+
+/* Scale screen coordinate to the pointer device range, so that it maps back
+ * to the same pixel (at its center) */
+static int32_t uinput_abs_coord(int coord, int size)
+{
+    if (size <= 0)
+        return 0;
+    if (coord < 0)
+        coord = 0;
+    else if (coord >= size)
+        coord = size - 1;
+    return (int32_t)(((2 * (int64_t)coord + 1) * (UINPUT_POINTER_ABS_MAX + 1)) /
+                     (2 * (int64_t)size));
+}
+
+static void inject_motion(Ghandles * g, struct xdriver_batch *xbatch,
+        XID winid, struct msg_motion *key, int root_width, int root_height)
+{
+    XWindowAttributes attr;
+    int ret;
+
+    ret = XGetWindowAttributes(g->input_display, winid, &attr);
+    if (ret != 1) {
+        fprintf(stderr,
+                "XGetWindowAttributes for 0x%lx failed in "
+                "do_button, ret=0x%x\n", winid, ret);
+        return;
+    }
+
+    if (g->created_pointer_device) {
+        struct input_batch batch = { .count = 0 };
+
+        input_batch_add(&batch, EV_ABS, ABS_X,
+                        uinput_abs_coord(attr.x + key->x, root_width));
+        input_batch_add(&batch, EV_ABS, ABS_Y,
+                        uinput_abs_coord(attr.y + key->y, root_height));
+        flush_xdriver_batch(g, xbatch);
+        if (send_events(g, g->uinput_pointer_fd, &batch))
+            return;
+        g->created_pointer_device = 0;
+    }
+    xdriver_batch_add(g, xbatch, 'M', attr.x + key->x, attr.y + key->y);
+}
+
+static int bitset(unsigned char *keys, int num)
+{
+    return (keys[num / 8] >> (num % 8)) & 1;
+}
+
+static void inject_keymap_notify(Ghandles * g, struct xdriver_batch *xbatch,
+                                 unsigned char *remote_keys)
+{
+    int i;
+    unsigned char local_keys[32];
+    /* the local state must include the keys still in xbatch */
+    flush_xdriver_batch(g, xbatch);
+    XQueryKeymap(g->input_display, (char *) local_keys);
+    for (i = 0; i < 256; i++) {
+        if (!bitset(remote_keys, i) && bitset(local_keys, i)) {
+            xdriver_batch_add(g, xbatch, 'K', i, 0);
+            if (g->log_level > 1)
+                fprintf(stderr,
+                        "handle_keymap_notify: unsetting key %d\n",
+                        i);
+        }
+    }
+}
+
+static void *input_thread_main(void *arg)
+{
+    Ghandles *g = arg;
+    struct xdriver_batch xbatch = { .count = 0 };
+    struct input_request *req;
+    unsigned int i, count;
+
+    for (;;) {
+        pthread_mutex_lock(&g->input_queue_lock);
+        while (g->input_queue_len == 0)
+            pthread_cond_wait(&g->input_queue_cond, &g->input_queue_lock);
+        /* inject all the queued requests at once; queue_input() leaves them
+         * alone until they are dequeued */
+        count = g->input_queue_busy = g->input_queue_len;
+        pthread_mutex_unlock(&g->input_queue_lock);
+
+        for (i = 0; i < count; i++) {
+            req = &g->input_queue[(g->input_queue_head + i) % INPUT_QUEUE_SIZE];
+            switch (req->type) {
+                case MSG_KEYPRESS:
+                    inject_keypress(g, &xbatch, &req->u.key);
+                    break;
+                case MSG_BUTTON:
+                    inject_button(g, &xbatch, req->window, &req->u.button);
+                    break;
+                case MSG_MOTION:
+                    inject_motion(g, &xbatch, req->window, &req->u.motion,
+                                  req->root_width, req->root_height);
+                    break;
+                case MSG_KEYMAP_NOTIFY:
+                    inject_keymap_notify(g, &xbatch, req->u.keys);
+                    break;
+            }
+        }
+        flush_xdriver_batch(g, &xbatch);
+
+        /* dequeue only now, so drain_input_queue() waits for the injection
+         * to complete */
+        pthread_mutex_lock(&g->input_queue_lock);
+        g->input_queue_head = (g->input_queue_head + count) % INPUT_QUEUE_SIZE;
+        g->input_queue_len -= count;
+        g->input_queue_busy = 0;
+        pthread_cond_broadcast(&g->input_queue_cond);
+        pthread_mutex_unlock(&g->input_queue_lock);
+    }
+    return NULL;
+}
+
+static void start_input_thread(Ghandles * g)
+{
+    sigset_t set, old_set;
+    int ret;
+
+    do {
+        g->input_display = XOpenDisplay(NULL);
+        if (!g->input_display && errno != EAGAIN) {
+            perror("XOpenDisplay");
+            exit(1);
+        }
+    } while (!g->input_display);
+
+    /* signals are handled by the main thread */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    ret = pthread_create(&g->input_thread, NULL, input_thread_main, g);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (ret) {
+        errno = ret;
+        err(1, "pthread_create");
+    }
+}
+
+/* Pass input message to the input thread. Requests issued so far on the main
+ * X connection (focus, raise) are flushed first, so they reach the X server
+ * before the injected event. Blocks if the queue is full.
+ *
+ * With coalesce set, a motion replaces the last queued request if it is a
+ * motion over the same window that is not being injected yet, so that a
+ * lagging input thread injects only the latest position. */
+static void queue_input(Ghandles * g, const struct input_request *req,
+                        int coalesce)
+{
+    struct input_request *last;
+
+    XFlush(g->display);
+    pthread_mutex_lock(&g->input_queue_lock);
+    /* requests being injected are not replaced */
+    if (coalesce && req->type == MSG_MOTION &&
+            g->input_queue_len > g->input_queue_busy) {
+        last = &g->input_queue[(g->input_queue_head + g->input_queue_len - 1) %
+                               INPUT_QUEUE_SIZE];
+        if (last->type == MSG_MOTION && last->window == req->window) {
+            *last = *req;
+            stats_coalesced_motions++;
+            pthread_mutex_unlock(&g->input_queue_lock);
+            return;
+        }
+    }
+    while (g->input_queue_len == INPUT_QUEUE_SIZE)
+        pthread_cond_wait(&g->input_queue_cond, &g->input_queue_lock);
+    g->input_queue[(g->input_queue_head + g->input_queue_len) % INPUT_QUEUE_SIZE] = *req;
+    g->input_queue_len++;
+    pthread_cond_broadcast(&g->input_queue_cond);
+    pthread_mutex_unlock(&g->input_queue_lock);
+}
+
+/* Wait for all queued input to be injected; needed before the main thread
+ * feeds qubes_drv events itself, to keep them in order. */
+static void drain_input_queue(Ghandles * g)
+{
+    pthread_mutex_lock(&g->input_queue_lock);
+    while (g->input_queue_len > 0)
+        pthread_cond_wait(&g->input_queue_cond, &g->input_queue_lock);
+    pthread_mutex_unlock(&g->input_queue_lock);
+}
+
+static void handle_keypress(Ghandles * g, XID winid)
+{
+    struct input_request req = { .type = MSG_KEYPRESS, .window = winid };
+
+    read_data(g->vchan, (char *) &req.u.key, sizeof(req.u.key));
+    queue_input(g, &req, 0);
 }
 
 static void handle_button(Ghandles * g, XID winid)
 {
-    struct msg_button key;
+    struct input_request req = { .type = MSG_BUTTON };
     struct genlist *l;
     struct window_data *wd = NULL;
 
@@ -2007,26 +3415,20 @@ static void handle_button(Ghandles * g, XID winid)
         wd = l->data;
     }
 
-    read_data(g->vchan, (char *) &key, sizeof(key));
+    read_data(g->vchan, (char *) &req.u.button, sizeof(req.u.button));
     if (wd && wd->is_docked) {
         /* get position of embeder, not icon itself*/
         winid = wd->embeder;
         XRaiseWindow(g->display, winid);
     }
 
-    if (g->log_level > 1)
-        fprintf(stderr,
-                "send buttonevent, win 0x%lx type=%d button=%d\n",
-                winid, key.type, key.button);
-    feed_xdriver(g, 'B', key.button, key.type == ButtonPress ? 1 : 0);
+    req.window = winid;
+    queue_input(g, &req, 0);
 }
 
 static void handle_motion(Ghandles * g, XID winid)
 {
-    struct msg_motion key;
-    //      XMotionEvent event;
-    XWindowAttributes attr;
-    int ret;
+    struct input_request req = { .type = MSG_MOTION };
     struct genlist *l;
     struct window_data *wd = NULL;
 
@@ -2035,20 +3437,16 @@ static void handle_motion(Ghandles * g, XID winid)
         wd = l->data;
     }
 
-    read_data(g->vchan, (char *) &key, sizeof(key));
+    read_data(g->vchan, (char *) &req.u.motion, sizeof(req.u.motion));
     if (wd && wd->is_docked) {
         /* get position of embeder, not icon itself*/
         winid = wd->embeder;
     }
-    ret = XGetWindowAttributes(g->display, winid, &attr);
-    if (ret != 1) {
-        fprintf(stderr,
-                "XGetWindowAttributes for 0x%lx failed in "
-                "do_button, ret=0x%x\n", winid, ret);
-        return;
-    }
 
-    feed_xdriver(g, 'M', attr.x + key.x, attr.y + key.y);
+    req.window = winid;
+    req.root_width = g->root_width;
+    req.root_height = g->root_height;
+    queue_input(g, &req, !(wd && wd->motion_every_sample));
 }
 
 // ensure that LeaveNotify is delivered to the window - if pointer is still
@@ -2078,6 +3476,9 @@ static void handle_crossing(Ghandles * g, XID winid)
     if (key.mode != NotifyNormal)
         return;
 
+    /* pointer position needs to be up to date */
+    drain_input_queue(g);
+
     if (key.type == EnterNotify) {
         ret = XGetWindowAttributes(g->display, winid, &attr);
         if (ret != 1) {
@@ -2149,6 +3550,8 @@ static void handle_focus(Ghandles * g, XID winid)
     if (key.type == FocusIn
             && (key.mode == NotifyNormal || key.mode == NotifyUngrab)) {
 
+        /* keys queued before the focus change go to the old window */
+        drain_input_queue(g);
         XRaiseWindow(g->display, winid);
 
         l = lookup_window(g, windows_list, winid, "FocusIn");
@@ -2176,6 +3579,7 @@ static void handle_focus(Ghandles * g, XID winid)
     } else if (key.type == FocusOut
             && (key.mode == NotifyNormal
                 || key.mode == NotifyUngrab)) {
+        drain_input_queue(g);
         l = lookup_window(g, windows_list, winid, "FocusOut");
         if (l) {
             wd = l->data;
@@ -2192,26 +3596,12 @@ static void handle_focus(Ghandles * g, XID winid)
 
 }
 
-static int bitset(unsigned char *keys, int num)
-{
-    return (keys[num / 8] >> (num % 8)) & 1;
-}
-
 static void handle_keymap_notify(Ghandles * g)
 {
-    int i;
-    unsigned char remote_keys[32], local_keys[32];
-    read_struct(g->vchan, remote_keys);
-    XQueryKeymap(g->display, (char *) local_keys);
-    for (i = 0; i < 256; i++) {
-        if (!bitset(remote_keys, i) && bitset(local_keys, i)) {
-            feed_xdriver(g, 'K', i, 0);
-            if (g->log_level > 1)
-                fprintf(stderr,
-                        "handle_keymap_notify: unsetting key %d\n",
-                        i);
-        }
-    }
+    struct input_request req = { .type = MSG_KEYMAP_NOTIFY };
+
+    read_struct(g->vchan, req.u.keys);
+    queue_input(g, &req, 0);
 }
 
 
@@ -2343,12 +3733,16 @@ static void handle_clipboard_req(Ghandles * g, XID winid)
         send_clipboard_data(g->vchan, winid, NULL, 0, g->protocol_version);
         return;
     }
+    /* a new request supersedes unfinished INCR transfer */
+    if (g->clipboard_incr_active)
+        clipboard_incr_finish(g);
     XConvertSelection(g->display, Clp, g->targets, g->qprop, g->stub_win, g->time);
 }
 
 static void handle_clipboard_data(Ghandles * g, XID UNUSED(winid),
         unsigned int len)
 {
+    abort_incr_transfers(g);
     if (g->clipboard_data)
         free(g->clipboard_data);
     // qubes_guid will not bother to send len==-1, really
@@ -2360,13 +3754,16 @@ static void handle_clipboard_data(Ghandles * g, XID UNUSED(winid),
     g->clipboard_data_len = len;
     read_data(g->vchan, (char *) g->clipboard_data, len);
     g->clipboard_data[len] = 0;
-    g->clipboard_last_access = g->time;
+    prepare_clipboard_data(g);
+    if (g->clipboard_wipe_timer)
+        event_timer_arm(g->clipboard_wipe_timer, CLIPBOARD_WIPE_TIME);
     XSetSelectionOwner(g->display, XA_PRIMARY, g->stub_win, g->time);
     XSetSelectionOwner(g->display, g->clipboard, g->stub_win, g->time);
 #ifndef CLIPBOARD_4WAY
     XSync(g->display, False);
-    feed_xdriver(g, 'B', 2, 1);
-    feed_xdriver(g, 'B', 2, 0);
+    drain_input_queue(g);
+    feed_xdriver_batch(g, (struct xdriver_cmd[]){
+                { 'B', 2, 1 }, { 'B', 2, 0 } }, 2);
 #endif
 }
 
@@ -2530,6 +3927,7 @@ static void write_status_file(const char *status)
 static void cleanup_status_file(void)
 {
     unlink(STATUS_FILE_PATH);
+    unlink(STATS_FILE_PATH);
 }
 
 static void handle_guid_disconnect(void)
@@ -2542,12 +3940,26 @@ static void handle_guid_disconnect(void)
         exit(1);
     }
     write_status_file("started\n");
+    g->guid_connected = 0;
+    vchan_set_handshake_done(false);
     libvchan_close(g->vchan);
+    /* the main loop keeps processing X events, and calls
+     * handle_guid_connect() when the new gui-daemon connects */
     g->vchan = libvchan_server_init(g->domid, 6000, 4096, 4096);
-    /* wait for gui daemon */
-    while (libvchan_is_open(g->vchan) == VCHAN_WAITING)
-        libvchan_wait(g->vchan);
+    if (!g->vchan) {
+        fprintf(stderr, "vchan initialization failed\n");
+        exit(1);
+    }
+}
+
+static void handle_guid_connect(Ghandles * g)
+{
     handshake(g);
+    vchan_set_handshake_done(true);
+    /* gui-daemon did not get anything since the last connection, send a
+     * snapshot of the current state of all windows */
+    g->guid_connected = 1;
+    mark_startup_phase(STARTUP_GUID_CONNECTED);
     send_all_windows_info(g);
     write_status_file("connected\n");
 }
@@ -2573,6 +3985,157 @@ static void handle_sigchld(int UNUSED(sig),
              * logging purposes */
             g->x_pid = -1;
     }
+    /* let the main loop notice */
+    event_loop_wakeup();
+}
+
+static void handle_sigusr1(int UNUSED(sig),
+        siginfo_t *UNUSED(info), void *UNUSED(context))
+{
+    stats_refresh_requested = 1;
+    event_loop_wakeup();
+}
+
+/* Absolute pointer device (like a VM tablet), so pointer events avoid the
+ * qubes_drv round trips; return 0 on failure */
+static int create_pointer_device(Ghandles * g)
+{
+    static const uint16_t buttons[] = {
+        BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, BTN_SIDE, BTN_EXTRA,
+    };
+    static const uint16_t rel_axes[] = {
+        REL_WHEEL, REL_HWHEEL, REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES,
+    };
+    struct uinput_abs_setup abs_setup;
+    struct uinput_setup usetup;
+    size_t i;
+    int fd;
+
+    fd = open("/dev/uinput", O_WRONLY | O_NDELAY);
+    if (fd < 0)
+        fd = open("/dev/input/uinput", O_WRONLY | O_NDELAY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open uinput for pointer device\n");
+        return 0;
+    }
+
+    if (ioctl(fd, UI_SET_EVBIT, EV_SYN) < 0 ||
+            ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+            ioctl(fd, UI_SET_EVBIT, EV_ABS) < 0 ||
+            ioctl(fd, UI_SET_EVBIT, EV_REL) < 0) {
+        fprintf(stderr, "error setting EVBITs for pointer device\n");
+        goto fail;
+    }
+    for (i = 0; i < QUBES_ARRAY_SIZE(buttons); i++) {
+        if (ioctl(fd, UI_SET_KEYBIT, buttons[i]) < 0) {
+            fprintf(stderr, "Not able to set KEYBIT %d\n", buttons[i]);
+            goto fail;
+        }
+    }
+    for (i = 0; i < QUBES_ARRAY_SIZE(rel_axes); i++) {
+        /* hi-res axes are not supported by older kernels, ignore */
+        if (ioctl(fd, UI_SET_RELBIT, rel_axes[i]) < 0 && g->log_level > 0)
+            fprintf(stderr, "Not able to set RELBIT %d\n", rel_axes[i]);
+    }
+
+    memset(&abs_setup, 0, sizeof(abs_setup));
+    abs_setup.absinfo.minimum = 0;
+    abs_setup.absinfo.maximum = UINPUT_POINTER_ABS_MAX;
+    abs_setup.code = ABS_X;
+    if (ioctl(fd, UI_SET_ABSBIT, ABS_X) < 0 ||
+            ioctl(fd, UI_ABS_SETUP, &abs_setup) < 0) {
+        fprintf(stderr, "error setting up ABS_X for pointer device\n");
+        goto fail;
+    }
+    abs_setup.code = ABS_Y;
+    if (ioctl(fd, UI_SET_ABSBIT, ABS_Y) < 0 ||
+            ioctl(fd, UI_ABS_SETUP, &abs_setup) < 0) {
+        fprintf(stderr, "error setting up ABS_Y for pointer device\n");
+        goto fail;
+    }
+
+    memset(&usetup, 0, sizeof(usetup));
+    strcpy(usetup.name, "Qubes Virtual Pointer Device");
+    if (ioctl(fd, UI_DEV_SETUP, &usetup) < 0) {
+        fprintf(stderr, "Pointer device setup failed\n");
+        goto fail;
+    }
+    if (ioctl(fd, UI_DEV_CREATE) < 0) {
+        fprintf(stderr, "Pointer device creation failed\n");
+        goto fail;
+    }
+    g->uinput_pointer_fd = fd;
+    return 1;
+
+fail:
+    close(fd);
+    return 0;
+}
+
+static void setup_input_devices(Ghandles * g)
+{
+    g->created_input_device = access("/run/qubes-service/gui-agent-virtual-input-device", F_OK) == 0;
+
+    if(g->created_input_device) {
+        // open uinput, if it fails, falls back to xdriver to not break input to the qube
+        g->uinput_fd = open("/dev/uinput", O_WRONLY | O_NDELAY);
+        if(g->uinput_fd < 0) {
+            g->uinput_fd = open("/dev/input/uinput", O_WRONLY | O_NDELAY);
+
+            if(g->uinput_fd < 0) {
+                fprintf(stderr, "Couldn't open uinput, falling back to xdriver\n");
+                g->created_input_device = 0;
+            }
+        }
+    }
+
+    // input device creation
+    if(g->created_input_device) {
+
+        if (ioctl(g->uinput_fd, UI_SET_EVBIT, EV_SYN) < 0) {
+            fprintf(stderr, "error setting EVBIT for EV_SYN, falling back to xdriver\n");
+            g->created_input_device = 0;
+        }
+
+        if (ioctl(g->uinput_fd, UI_SET_EVBIT, EV_KEY) < 0) {
+            fprintf(stderr, "error setting EVBIT for EV_KEY, falling back to xdriver\n");
+            g->created_input_device = 0;
+        }
+
+        // set all keys
+        for(int i = 1; i < KEY_MAX; i++) {
+            if((i < BTN_MISC || i > BTN_GEAR_UP) && i != KEY_RESERVED && ioctl(g->uinput_fd, UI_SET_KEYBIT, i) < 0) {
+                fprintf(stderr, "Not able to set KEYBIT %d\n", i);
+            }
+        }
+
+        struct uinput_setup usetup;
+        memset(&usetup, 0, sizeof(usetup));
+        strcpy(usetup.name, "Qubes Virtual Input Device");
+
+        if(ioctl(g->uinput_fd, UI_DEV_SETUP, &usetup) < 0) {
+            fprintf(stderr, "Input device setup failed, falling back to xdriver\n");
+            g->created_input_device = 0;
+        } else {
+
+            if(ioctl(g->uinput_fd, UI_DEV_CREATE) < 0) {
+                fprintf(stderr, "Input device creation failed, falling back to xdriver\n");
+                g->created_input_device = 0;
+            }
+        }
+
+        g->last_known_modifier_states = 0;
+    }
+
+    /* Pointer events through uinput are controlled by the
+     * gui-agent-virtual-pointer-device service, xdriver is used otherwise
+     */
+    g->uinput_pointer_fd = -1;
+    if (access("/run/qubes-service/gui-agent-virtual-pointer-device", F_OK) == 0) {
+        g->created_pointer_device = create_pointer_device(g);
+        if (!g->created_pointer_device)
+            fprintf(stderr, "Pointer device not available, falling back to xdriver\n");
+    }
 }
 
 static void usage(void)
@@ -2638,63 +4201,20 @@ int main(int argc, char **argv)
 {
     int i;
     int xfd;
-    Ghandles g = { .x_pid = -1 };
+    Ghandles g = {
+        .x_pid = -1,
+        .input_queue_lock = PTHREAD_MUTEX_INITIALIZER,
+        .input_queue_cond = PTHREAD_COND_INITIALIZER,
+        .xdriver_lock = PTHREAD_MUTEX_INITIALIZER,
+    };
 
     write_status_file("starting\n");
     atexit(cleanup_status_file);
 
-    g.created_input_device = access("/run/qubes-service/gui-agent-virtual-input-device", F_OK) == 0;
-
-    if(g.created_input_device) {
-        // open uinput, if it fails, falls back to xdriver to not break input to the qube
-        g.uinput_fd = open("/dev/uinput", O_WRONLY | O_NDELAY);
-        if(g.uinput_fd < 0) {
-            g.uinput_fd = open("/dev/input/uinput", O_WRONLY | O_NDELAY);
-
-            if(g.uinput_fd < 0) {
-                fprintf(stderr, "Couldn't open uinput, falling back to xdriver\n");
-                g.created_input_device = 0;
-            }
-        }
-    }
-
-    // input device creation
-    if(g.created_input_device) {
-
-        if (ioctl(g.uinput_fd, UI_SET_EVBIT, EV_SYN) < 0) {
-            fprintf(stderr, "error setting EVBIT for EV_SYN, falling back to xdriver\n");
-            g.created_input_device = 0;
-        }
-
-        if (ioctl(g.uinput_fd, UI_SET_EVBIT, EV_KEY) < 0) {
-            fprintf(stderr, "error setting EVBIT for EV_KEY, falling back to xdriver\n");
-            g.created_input_device = 0;
-        }
-
-        // set all keys
-        for(int i = 1; i < KEY_MAX; i++) {
-            if((i < BTN_MISC || i > BTN_GEAR_UP) && i != KEY_RESERVED && ioctl(g.uinput_fd, UI_SET_KEYBIT, i) < 0) {
-                fprintf(stderr, "Not able to set KEYBIT %d\n", i);
-            }
-        }
-
-        struct uinput_setup usetup;
-        memset(&usetup, 0, sizeof(usetup));
-        strcpy(usetup.name, "Qubes Virtual Input Device");
-
-        if(ioctl(g.uinput_fd, UI_DEV_SETUP, &usetup) < 0) {
-            fprintf(stderr, "Input device setup failed, falling back to xdriver\n");
-            g.created_input_device = 0;
-        } else {
-
-            if(ioctl(g.uinput_fd, UI_DEV_CREATE) < 0) {
-                fprintf(stderr, "Input device creation failed, falling back to xdriver\n");
-                g.created_input_device = 0;
-            }
-        }
-
-        g.last_known_modifier_states = 0;
-    }
+    /* input thread uses its own X connection, but Xlib global state is
+     * shared */
+    if (!XInitThreads())
+        errx(1, "XInitThreads failed");
 
     parse_args(&g, argc, argv);
 
@@ -2706,6 +4226,12 @@ int main(int argc, char **argv)
 
     ghandles_for_vchan_reinitialize = &g;
 
+    event_loop_init();
+    if (g.clipboard_wipe)
+        g.clipboard_wipe_timer = event_timer_new(wipe_clipboard_data, &g);
+    g.clipboard_incr_timer = event_timer_new(clipboard_incr_timeout, &g);
+    g.incr_transfer_timer = event_timer_new(incr_transfer_timeout, &g);
+
     struct sigaction sigchld_handler = {
         .sa_sigaction = handle_sigchld,
         .sa_flags = SA_SIGINFO,
@@ -2720,13 +4246,40 @@ int main(int argc, char **argv)
     sigemptyset(&sigterm_handler.sa_mask);
     if (sigaction(SIGTERM, &sigterm_handler, NULL))
         err(1, "sigaction");
+    struct sigaction sigusr1_handler = {
+        .sa_sigaction = handle_sigusr1,
+        .sa_flags = SA_SIGINFO,
+    };
+    sigemptyset(&sigusr1_handler.sa_mask);
+    if (sigaction(SIGUSR1, &sigusr1_handler, NULL))
+        err(1, "sigaction");
+
+    mark_startup_phase(STARTUP_AGENT_STARTED);
 
     g.x_pid = do_execute_xorg(&g);
     if (g.x_pid == (pid_t)-1) {
         errx(1, "X server startup failed");
     }
+    mark_startup_phase(STARTUP_XORG_SPAWNED);
+
+    /* While Xorg starts, do the setup that does not depend on it. The
+     * vchan server is created after spawning Xorg, so it does not inherit
+     * its file descriptors. gui-daemon may connect at any time now, the
+     * handshake is done from the main loop. */
+    g.vchan = libvchan_server_init(g.domid, 6000, 4096, 4096);
+    if (!g.vchan) {
+        fprintf(stderr, "vchan initialization failed\n");
+        exit(1);
+    }
+    saved_argv = argv;
+    vchan_register_at_eof(handle_guid_disconnect);
+    mark_startup_phase(STARTUP_VCHAN_LISTENING);
+
+    setup_input_devices(&g);
+    mark_startup_phase(STARTUP_INPUT_DEVICES_READY);
 
     mkghandles(&g);
+    mark_startup_phase(STARTUP_X_CONNECTED);
     /* Turn on Composite for all children of root window. This way X server
      * keeps separate buffers for each (root child) window.
      * There are two modes:
@@ -2742,7 +4295,7 @@ int main(int argc, char **argv)
               CompositeRedirectManual));
     for (i = 0; i < ScreenCount(g.display); i++)
         XSelectInput(g.display, RootWindow(g.display, i),
-                SubstructureNotifyMask);
+                SubstructureNotifyMask | StructureNotifyMask);
 
 
     if (!XDamageQueryExtension(g.display, &damage_event,
@@ -2768,6 +4321,7 @@ int main(int argc, char **argv)
     XAutoRepeatOff(g.display);
     windows_list = list_new();
     embeder_list = list_new();
+    incr_transfer_list = list_new();
     XSetErrorHandler(dummy_handler);
     XSetSelectionOwner(g.display, g.tray_selection,
             g.stub_win, CurrentTime);
@@ -2794,48 +4348,58 @@ int main(int argc, char **argv)
                     "Acquired MANAGER selection for tray\n");
     }
 
-    write_status_file("started\n");
-
-    g.vchan = libvchan_server_init(g.domid, 6000, 4096, 4096);
-    if (!g.vchan) {
-        fprintf(stderr, "vchan initialization failed\n");
-        exit(1);
-    }
-    /* wait for gui daemon */
-    while (libvchan_is_open(g.vchan) == VCHAN_WAITING)
-        libvchan_wait(g.vchan);
-    saved_argv = argv;
-    vchan_register_at_eof(handle_guid_disconnect);
-
-    handshake(&g);
+    setup_damage_ring(&g);
+    setup_cursor_export(&g);
+    /* keep the counters in the stats file fresh */
+    stats_update_timer = event_timer_new(update_stats_file, &g);
+    start_input_thread(&g);
 
-    write_status_file("connected\n");
+    write_status_file("started\n");
+    mark_startup_phase(STARTUP_X_READY);
 
     xfd = ConnectionNumber(g.display);
-    struct pollfd fds[] = {
-        { .fd = -1, .events = POLLIN | POLLHUP, .revents = 0 },
-        { .fd = xfd, .events = POLLIN | POLLHUP, .revents = 0 },
-        { .fd = g.xserver_fd, .events = POLLIN | POLLHUP, .revents = 0 },
-    };
+    event_loop_set_fd(EVENT_SOURCE_X, xfd);
+    event_loop_set_fd(EVENT_SOURCE_XDRIVER, g.xserver_fd);
     for (;;) {
-        int busy;
+        uint32_t ready;
+        int busy, active = 0;
 
         if (g.x_pid == -1) {
             fprintf(stderr, "Xorg exited prematurely\n");
             exit(1);
         }
 
-        fds[0].fd = libvchan_fd_for_select(g.vchan);
-        wait_for_vchan_or_argfd(g.vchan, fds, QUBES_ARRAY_SIZE(fds));
+        if (!g.guid_connected &&
+                libvchan_is_open(g.vchan) == VCHAN_CONNECTED)
+            handle_guid_connect(&g);
+
+        /* vchan is re-created on gui-daemon reconnection */
+        event_loop_set_fd(EVENT_SOURCE_VCHAN, libvchan_fd_for_select(g.vchan));
+        ready = wait_for_vchan_or_events(g.vchan, EVENT_SOURCE_VCHAN);
+        /* gui-daemon may have connected during the wait, the handshake must
+         * precede any message sent while processing X events or damage */
+        if (!g.guid_connected &&
+                libvchan_is_open(g.vchan) == VCHAN_CONNECTED)
+            handle_guid_connect(&g);
         /* first process possible qubes_drv reconnection, otherwise we may be
          * using stale g.xserver_fd */
-        if (fds[2].revents) {
+        if (ready & (1U << EVENT_SOURCE_XDRIVER)) {
             char discard[64];
-            int ret;
-
-            /* unexpected data from qubes_drv, check for possible EOF */
-            ret = read(g.xserver_fd, discard, sizeof(discard));
-            if (ret > 0) {
+            int ret, recv_errno;
+
+            /* unexpected data from qubes_drv, check for possible EOF; the
+             * input thread may have just consumed an ack that woke us up */
+            pthread_mutex_lock(&g.xdriver_lock);
+            ret = recv(g.xserver_fd, discard, sizeof(discard), MSG_DONTWAIT);
+            recv_errno = errno;
+            if (ret == 0) {
+                close(g.xserver_fd);
+                g.xserver_fd = -1;
+            }
+            pthread_mutex_unlock(&g.xdriver_lock);
+            if (ret < 0 && (recv_errno == EAGAIN || recv_errno == EWOULDBLOCK)) {
+                /* nothing */
+            } else if (ret > 0) {
                 fprintf(stderr,
                         "Got unexpected %d bytes from qubes_drv, something is wrong\n",
                         ret);
@@ -2843,27 +4407,51 @@ int main(int argc, char **argv)
             } else if (ret == 0) {
                 fprintf(stderr,
                         "qubes_drv disconnected, waiting for possible reconnection\n");
-                close(g.xserver_fd);
+                event_loop_set_fd(EVENT_SOURCE_XDRIVER, -1);
+                /* without the lock, so the input thread drops its commands
+                 * instead of blocking until qubes_drv is back */
                 wait_for_unix_socket(&g);
-                fds[2].fd = g.xserver_fd;
+                event_loop_set_fd(EVENT_SOURCE_XDRIVER, g.xserver_fd);
             } else {
+                errno = recv_errno;
                 perror("reading from qubes_drv");
                 exit(1);
             }
         }
+        if (ready & (1U << EVENT_SOURCE_DAMAGE)) {
+            uint64_t count;
+
+            /* just clear the notification, the ring is drained below */
+            if (read(g.damage_ring_event_fd, &count, sizeof(count)) < 0 &&
+                    errno != EAGAIN)
+                err(1, "read damage ring eventfd");
+        }
 
         do {
             busy = 0;
+            /* X events first, so the windows are known (and mapped) before
+             * their damage is processed */
             if (XPending(g.display)) {
                 process_xevent(&g);
                 busy = 1;
+            } else if (drain_damage_ring(&g)) {
+                busy = 1;
             }
-            while (libvchan_data_ready(g.vchan)) {
+            while (g.guid_connected && libvchan_data_ready(g.vchan)) {
                 handle_message(&g);
                 busy = 1;
             }
+            active |= busy;
         } while (busy);
 
+        if (stats_refresh_requested) {
+            stats_refresh_requested = 0;
+            event_timer_disarm(stats_update_timer);
+            update_stats_file(&g);
+        } else if (active) {
+            schedule_stats_update();
+        }
+
     }
     return 0;
 }
@@ -0,0 +1,59 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_GUI_AGENT_STATS_H
+#define QUBES_GUI_AGENT_STATS_H QUBES_GUI_AGENT_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "grant-stats.h"
+
+/* Counters of the full state resync sent to each new gui-daemon connection,
+ * written to the stats file as "resync.*" */
+struct resync_stats {
+    uint64_t count;
+    /* totals over all resyncs */
+    uint64_t windows;
+    uint64_t skipped;
+    /* of the last one, and the longest one */
+    uint64_t last_windows;
+    uint64_t last_skipped;
+    long last_ms;
+    long last_query_ms;
+    long max_ms;
+};
+
+/* Record one resync: windows sent, windows that were gone or unmanaged by the
+ * time their state arrived, total duration and time spent issuing the X
+ * queries */
+void resync_stats_add(struct resync_stats *st, size_t windows, size_t skipped,
+                      long ms, long query_ms);
+/* Write the counters as "name value" lines; nothing before the first resync */
+void resync_stats_write(FILE *f, const struct resync_stats *st);
+
+/* Copy the GRANT_STATS_PROP property values (nitems longs, as returned by
+ * Xlib) to stats; false if it is not of the known GRANT_STATS_VERSION */
+bool grant_stats_parse(uint32_t stats[GRANT_STATS_COUNT], const long *values,
+                       unsigned long nitems);
+/* Write the counters as grant.* and window_dump.* lines */
+void grant_stats_write(FILE *f, const uint32_t stats[GRANT_STATS_COUNT]);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_CURSOR_EXPORT_H
+#define QUBES_CURSOR_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The current hardware cursor of dummyqbs, published in shared memory, so
+ * gui-agent can identify it without asking the X server for its image.
+ *
+ * The gui-agent gets the memfd with the 'C' xdriver command. The ack is
+ * followed by a single byte message, with the fd attached (SCM_RIGHTS) if
+ * the cursor is exported.
+ *
+ * The X server is the only writer. seq is odd while the cursor is being
+ * updated; a reader copies what it needs and retries if seq changed in the
+ * meantime. */
+
+#define CURSOR_EXPORT_VERSION 1
+/* larger cursors are drawn in software, and not exported */
+#define CURSOR_EXPORT_MAX_SIZE 256
+
+struct cursor_export {
+    uint32_t version;
+    uint32_t seq;
+    /* 0x0 if the current cursor is not exported (not an ARGB cursor, hidden,
+     * or drawn in software) */
+    uint32_t width;
+    uint32_t height;
+    uint32_t xhot;
+    uint32_t yhot;
+    /* cursor_export_hash() of the above and pixels */
+    uint64_t hash;
+    /* width * height premultiplied ARGB pixels, row after row */
+    uint32_t pixels[];
+};
+
+#define CURSOR_EXPORT_SIZE \
+    (sizeof(struct cursor_export) + \
+     CURSOR_EXPORT_MAX_SIZE * CURSOR_EXPORT_MAX_SIZE * sizeof(uint32_t))
+
+/* FNV-1a */
+static inline uint64_t cursor_export_fnv1a64(const void *data, size_t len,
+                                             uint64_t hash)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Hash identifying a cursor image, also used by gui-agent for cursors
+ * loaded from the theme */
+static inline uint64_t cursor_export_hash(uint32_t width, uint32_t height,
+                                          uint32_t xhot, uint32_t yhot,
+                                          const uint32_t *pixels)
+{
+    uint32_t hdr[4] = { width, height, xhot, yhot };
+    uint64_t hash = 14695981039346656037ULL;
+
+    hash = cursor_export_fnv1a64(hdr, sizeof(hdr), hash);
+    return cursor_export_fnv1a64(pixels,
+                                 (size_t)width * height * sizeof(uint32_t),
+                                 hash);
+}
+
+#endif /* QUBES_CURSOR_EXPORT_H */
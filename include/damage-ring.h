@@ -0,0 +1,97 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_DAMAGE_RING_H
+#define QUBES_DAMAGE_RING_H
+
+#include <stdint.h>
+
+/* Damage of top-level windows, published by dummyqbs into shared memory and
+ * drained by gui-agent, bypassing XDamage events.
+ *
+ * The gui-agent gets the memfd of the ring and an eventfd with the
+ * 'R' xdriver command. The ack is followed by a single byte message, with
+ * both fds attached (SCM_RIGHTS) if the ring is available.
+ *
+ * The X server is the only producer, gui-agent the only consumer. head and
+ * tail are free running counters, entry i is at rects[i % entries]. The
+ * producer writes the eventfd after publishing a batch. When the ring is
+ * full, the producer keeps the damage and sets producer_waiting; the consumer
+ * then sends the 'D' xdriver command after draining, to have the rest
+ * published. The producer reads tail again after setting producer_waiting,
+ * and the consumer reads producer_waiting after storing tail, both with
+ * sequential consistency, so that the wakeup cannot be lost. No damage is
+ * ever lost.
+ *
+ * With DAMAGE_RING_TILE_HASH, the producer keeps a hash of every 64x64 tile
+ * of the window pixmaps, and drops (or trims) rectangles whose tiles did not
+ * change since they were last published. */
+
+#define DAMAGE_RING_VERSION 1
+/* power of two */
+#define DAMAGE_RING_ENTRIES 4096
+/* windows with more rectangles are reported as their bounding box */
+#define DAMAGE_RING_MAX_RECTS_PER_WINDOW 16
+
+/* damage_ring.flags */
+#define DAMAGE_RING_TILE_HASH (1 << 0)
+
+struct damage_ring_rect {
+    uint32_t window;
+    int16_t x;
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+};
+
+/* Counters maintained by the producer, for tuning */
+struct damage_ring_stats {
+    uint64_t published_rects;
+    uint64_t published_pixels;
+    /* DAMAGE_RING_TILE_HASH cost and savings */
+    uint64_t hashed_tiles;
+    uint64_t hash_time_us;
+    uint64_t suppressed_rects;   /* dropped entirely */
+    uint64_t suppressed_pixels;  /* including trimmed parts */
+    uint64_t pad[2];
+};
+
+struct damage_ring {
+    uint32_t version;
+    uint32_t entries;
+    uint32_t flags;
+    uint32_t pad0[13];
+    /* written by the producer only */
+    uint32_t head;
+    uint32_t pad1[15];
+    /* written by the consumer only */
+    uint32_t tail;
+    uint32_t pad2[15];
+    /* set by the producer, cleared by the consumer */
+    uint32_t producer_waiting;
+    uint32_t pad3[15];
+    /* written by the producer only */
+    struct damage_ring_stats stats;
+    struct damage_ring_rect rects[];
+};
+
+#define DAMAGE_RING_SIZE(entries) \
+    (sizeof(struct damage_ring) + (entries) * sizeof(struct damage_ring_rect))
+
+#endif /* QUBES_DAMAGE_RING_H */
@@ -21,7 +21,10 @@
 #define QUBES_GUI_AGENT_ENCODING_H QUBES_GUI_AGENT_ENCODING_H
 
 #include <stdbool.h>
+#include <stddef.h>
 void sanitize_string_from_vm(unsigned char *untrusted_s, int allow_utf8);
 bool is_valid_clipboard_string_from_vm(unsigned char *untrusted_s);
+bool is_valid_clipboard_buffer_from_vm(const unsigned char *untrusted_s,
+                                       size_t len);
 
 #endif
@@ -0,0 +1,48 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_EVENT_LOOP_H
+#define QUBES_EVENT_LOOP_H
+
+#include <stdint.h>
+
+/* Maximum number of fd sources, each one is identified by a bit in the mask
+ * returned by event_loop_wait() */
+#define EVENT_LOOP_MAX_SOURCES 32
+
+struct event_timer;
+typedef void event_timer_cb(void *opaque);
+
+void event_loop_init(void);
+/* Register fd as source number id, replacing fd previously registered with
+ * that id (if any). fd == -1 only unregisters. */
+void event_loop_set_fd(unsigned int id, int fd);
+/* Block until a registered fd is readable, a timer expires or
+ * event_loop_wakeup() is called. Expired timers have their callbacks run.
+ * Returns the mask of readable sources. */
+uint32_t event_loop_wait(void);
+/* Interrupt event_loop_wait(); safe to call from a signal handler */
+void event_loop_wakeup(void);
+
+struct event_timer *event_timer_new(event_timer_cb *cb, void *opaque);
+/* (Re)start one-shot timer, to expire after timeout_ms */
+void event_timer_arm(struct event_timer *timer, unsigned int timeout_ms);
+void event_timer_disarm(struct event_timer *timer);
+
+#endif /* QUBES_EVENT_LOOP_H */
@@ -0,0 +1,74 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_GRANT_STATS_H
+#define QUBES_GRANT_STATS_H
+
+#include <stddef.h>
+
+/* Grant table usage of dummyqbs, published as the GRANT_STATS_PROP root
+ * window property: an array of GRANT_STATS_COUNT CARD32 values, indexed by
+ * enum grant_stats. Updated at most once per GRANT_STATS_UPDATE_INTERVAL
+ * milliseconds, without PropertyNotify events.
+ *
+ * All pixmaps are backed by pages shared with the GUI domain, which stay
+ * locked in memory until unshared; so the shared pages are also the memory
+ * locked by the X server. */
+
+#define GRANT_STATS_PROP "_QUBES_GRANT_STATS"
+#define GRANT_STATS_VERSION 1
+#define GRANT_STATS_UPDATE_INTERVAL 1000
+
+enum grant_stats {
+    GRANT_STATS_VERSION_IDX,
+    GRANT_STATS_SHARED_PAGES,        /* currently shared */
+    GRANT_STATS_PEAK_SHARED_PAGES,
+    GRANT_STATS_ALLOC_FAILURES,      /* "Failed to allocate grant pages" */
+    GRANT_STATS_ACK_QUEUE_DEPTH,     /* window dumps not acked by gui-daemon */
+    GRANT_STATS_ACK_QUEUE_MAX_DEPTH,
+    /* live pixmaps by size: up to 4KiB, 64KiB, 1MiB, 8MiB, 32MiB, larger */
+    GRANT_STATS_PIXMAPS_4K,
+    GRANT_STATS_PIXMAPS_64K,
+    GRANT_STATS_PIXMAPS_1M,
+    GRANT_STATS_PIXMAPS_8M,
+    GRANT_STATS_PIXMAPS_32M,
+    GRANT_STATS_PIXMAPS_LARGER,
+    GRANT_STATS_COUNT
+};
+
+#define GRANT_STATS_SIZE_CLASSES \
+    (GRANT_STATS_PIXMAPS_LARGER - GRANT_STATS_PIXMAPS_4K + 1)
+
+/* Counter of the size class of a pixmap of that many pages */
+static inline enum grant_stats
+grant_stats_size_class(size_t pages)
+{
+    /* upper bounds, in pages; the last class is unbounded */
+    static const size_t bounds[GRANT_STATS_SIZE_CLASSES - 1] = {
+        1, 16, 256, 2048, 8192,
+    };
+    int i;
+
+    for (i = 0; i < GRANT_STATS_SIZE_CLASSES - 1; i++)
+        if (pages <= bounds[i])
+            break;
+    return GRANT_STATS_PIXMAPS_4K + i;
+}
+
+#endif /* QUBES_GRANT_STATS_H */
@@ -22,19 +22,31 @@
 #ifndef QUBES_TXRX_H
 #define QUBES_TXRX_H
 
-#include <poll.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <libvchan.h>
 
 int write_data(libvchan_t *vchan, char *buf, int size);
+/* Send a message (struct msg_hdr + data); it is queued if vchan ring is
+ * full, see flush_queued_messages() */
 int real_write_message(libvchan_t *vchan, char *hdr, int size, char *data, int datasize);
+void flush_queued_messages(libvchan_t *vchan, bool block);
 int read_data(libvchan_t *vchan, char *buf, int size);
 #define read_struct(vchan, x) (read_data(vchan, (char*)&(x), sizeof(x)))
 #define write_struct(vchan, x) (write_data(vchan, (char*)&(x), sizeof(x)))
+/* message without payload, x.untrusted_len must be already set */
+#define write_header(vchan,x) \
+	real_write_message(vchan, (char*)&(x), sizeof(x), NULL, 0)
 #define write_message(vchan,x,y) do {\
 	x.untrusted_len = sizeof(y); \
 	real_write_message(vchan, (char*)&x, sizeof(x), (char*)&y, sizeof(y)); \
     } while(0)
-int wait_for_vchan_or_argfd(libvchan_t *vchan, struct pollfd *fds, size_t nfds);
+/* Wait in the event loop (see event-loop.h), handling vchan EOF. vchan fd is
+ * expected to be registered as vchan_source. Returns mask of ready sources. */
+uint32_t wait_for_vchan_or_events(libvchan_t *vchan, unsigned int vchan_source);
 void vchan_register_at_eof(void (*new_vchan_at_eof)(void));
+/* Messages are dropped until the protocol handshake with the connected
+ * gui-daemon is done; reset on vchan EOF */
+void vchan_set_handshake_done(bool done);
 
 #endif /* QUBES_TXRX_H */
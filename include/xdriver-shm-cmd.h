@@ -33,4 +33,21 @@ struct xdriver_cmd {
 	uint32_t arg1;
 	uint32_t arg2;
 };
+
+/* The 'L' command dumps the windows listed after it: arg1 uint32_t window
+ * IDs follow the command, and the ack is followed by a 'W' reply for each of
+ * them, in order. */
+#define XDRIVER_MAX_DUMP_WINDOWS 256
+
+/* Each command is acked with a single '0' byte. gui-agent may send several
+ * commands before reading their acks, qubes_drv then reads up to
+ * XDRIVER_MAX_BATCH of them at once and acks them with a single write. This
+ * does not apply to the commands answered beyond the ack ('W', 'L', 'R' and
+ * 'C'): gui-agent must read their reply before sending anything else. */
+#define XDRIVER_MAX_BATCH 64
+
+/* The 'V' command is answered, in place of its ack, with '0' plus the
+ * protocol version of qubes_drv. Version 1 added the 'L', 'R', 'C' and 'D'
+ * commands; earlier versions ack 'V' like any unknown command, with '0'. */
+#define XDRIVER_VERSION 1
 #endif
@@ -63,6 +63,8 @@
 
 
 #include <windowstr.h>
+#include <inputstr.h>
+#include <mipointer.h>
 
 
 #if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 23
@@ -73,6 +75,7 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/socket.h>
@@ -413,11 +416,18 @@ int connect_unix_socket(QubesDevicePtr pQubes)
 }
 
 static void close_device_fd(InputInfoPtr pInfo) {
+    QubesDevicePtr pQubes = pInfo->private;
+
     if (pInfo->fd >= 0) {
         xf86RemoveEnabledDevice(pInfo);
         close(pInfo->fd);
         pInfo->fd = -1;
     }
+    pQubes->cmd_buf_len = 0;
+    pQubes->cmd_buf_pos = 0;
+    pQubes->pending_acks = 0;
+    pQubes->have_last_motion = FALSE;
+    pQubes->relative_motion = FALSE;
 }
 
 static void
@@ -580,6 +590,24 @@ static int write_exact(int fd, const void *data, size_t size)
     return 0;
 }
 
+static int read_exact(int fd, void *data, size_t size)
+{
+    size_t offset = 0;
+    ssize_t len;
+
+    while ( offset < size )
+    {
+        len = read(fd, (char *)data + offset, size - offset);
+        if ( (len == -1) && (errno == EINTR) )
+            continue;
+        if ( len <= 0 )
+            return -1;
+        offset += len;
+    }
+
+    return 0;
+}
+
 static WindowPtr id2winptr(unsigned int xid)
 {
     int ret;
@@ -626,7 +654,8 @@ static void dump_window_grant_refs(int window_id, int fd)
         goto send_response;
     }
 
-    xf86_qubes_pixmap_add_to_list(priv);
+    if (!xf86_qubes_pixmap_add_to_list(priv))
+        goto send_response;
 
     wd_hdr.type = WINDOW_DUMP_TYPE_GRANT_REFS;
     wd_hdr.width = pixmap->drawable.width;
@@ -680,13 +709,72 @@ send_response:
     }
 }
 
+/* Pass shared memory to gui-agent: a single status byte, with nfds fds
+ * attached if available (nfds > 0) */
+static void send_fds(int fd, const int *fds, int nfds)
+{
+    char status = nfds > 0 ? '1' : '0';
+    struct iovec iov = { .iov_base = &status, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+
+    if (nfds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    while (sendmsg(fd, &msg, 0) == -1) {
+        if (errno != EINTR) {
+            xf86Msg(X_ERROR, "failed to send fds to gui-agent: %s\n",
+                    strerror(errno));
+            return;
+        }
+    }
+}
+
+/* The damage export ring, see damage-ring.h */
+static void send_damage_ring(int fd)
+{
+    int fds[2];
+
+    if (xf86_qubes_damage_ring_get_fds(&fds[0], &fds[1]))
+        send_fds(fd, fds, 2);
+    else
+        send_fds(fd, NULL, 0);
+}
+
+/* The exported cursor, see cursor-export.h */
+static void send_cursor_export(int fd)
+{
+    int shm_fd;
+
+    if (xf86_qubes_cursor_get_fd(&shm_fd))
+        send_fds(fd, &shm_fd, 1);
+    else
+        send_fds(fd, NULL, 0);
+}
+
 static void process_window_dump_request(InputInfoPtr pInfo) {
     QubesDevicePtr pQubes = pInfo->private;
 
-    if (pQubes->window_id != 0) {
-        dump_window_grant_refs(pQubes->window_id, pInfo->fd);
-        pQubes->window_id = 0;
-    }
+    unsigned int i;
+
+    for (i = 0; i < pQubes->num_dump_windows; i++)
+        dump_window_grant_refs(pQubes->dump_windows[i], pInfo->fd);
+    pQubes->num_dump_windows = 0;
 }
 
 #if HAVE_THREADED_INPUT
@@ -703,30 +791,123 @@ static void QubesWakeupHandler(void *arg, int result) {
 }
 #endif
 
-static void process_request(int fd, InputInfoPtr pInfo)
+/* Post pointer motion to x, y, the position sent by gui-agent.
+ *
+ * Applications locking the pointer (games, 3D modelers, remote desktop
+ * clients) grab it and warp it back after each motion. Absolute positions
+ * would undo the warp every time, and the application would see bogus deltas
+ * and warp again. When the pointer is not where the previous motion left it
+ * and is grabbed, motion is posted relative to the previous position sent by
+ * gui-agent, until the grab ends. */
+static void post_motion(InputInfoPtr pInfo, int x, int y)
+{
+    QubesDevicePtr pQubes = pInfo->private;
+#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 12
+    DeviceIntPtr master = GetMaster(pInfo->dev, MASTER_POINTER);
+    ValuatorMask mask;
+    int sprite_x, sprite_y;
+
+    if (!master || !master->deviceGrab.grab)
+        pQubes->relative_motion = FALSE;
+    else if (pQubes->have_last_motion) {
+        /* the sprite of the master pointer, moved by our motion events
+         * and by warps alike */
+        miPointerGetPosition(pInfo->dev, &sprite_x, &sprite_y);
+        if (sprite_x != pQubes->sprite_x || sprite_y != pQubes->sprite_y)
+            pQubes->relative_motion = TRUE;
+    }
+
+    if (pQubes->relative_motion) {
+        // not accelerated, the deltas are already what the user did in dom0
+        valuator_mask_zero(&mask);
+        valuator_mask_set(&mask, 0, x - pQubes->last_motion_x);
+        valuator_mask_set(&mask, 1, y - pQubes->last_motion_y);
+        QueuePointerEvents(pInfo->dev, MotionNotify, 0, POINTER_RELATIVE,
+                           &mask);
+    } else
+        xf86PostMotionEvent(pInfo->dev, 1, 0, 2, x, y);
+    /* the sprite is moved when the event is generated, not processed */
+    miPointerGetPosition(pInfo->dev, &pQubes->sprite_x, &pQubes->sprite_y);
+#else
+    xf86PostMotionEvent(pInfo->dev, 1, 0, 2, x, y);
+#endif
+    pQubes->last_motion_x = x;
+    pQubes->last_motion_y = y;
+    pQubes->have_last_motion = TRUE;
+}
+
+/* Acknowledge the commands processed so far, with a single write */
+static void flush_acks(InputInfoPtr pInfo)
 {
     QubesDevicePtr pQubes = pInfo->private;
-    int ret;
+    char acks[XDRIVER_MAX_BATCH];
+
+    if (!pQubes->pending_acks || pInfo->fd < 0)
+        return;
+    memset(acks, '0', pQubes->pending_acks);
+    write_exact(pInfo->fd, acks, pQubes->pending_acks);
+    pQubes->pending_acks = 0;
+}
+
+/* Read the payload following the current command: what was already read
+ * with it first, then the rest from the socket */
+static int read_payload(InputInfoPtr pInfo, void *data, size_t size)
+{
+    QubesDevicePtr pQubes = pInfo->private;
+    size_t buffered = pQubes->cmd_buf_len - pQubes->cmd_buf_pos;
+
+    if (buffered > size)
+        buffered = size;
+    memcpy(data, pQubes->cmd_buf + pQubes->cmd_buf_pos, buffered);
+    pQubes->cmd_buf_pos += buffered;
+    if (buffered == size)
+        return 0;
+    return read_exact(pInfo->fd, (char *)data + buffered, size - buffered);
+}
+
+static void process_request(InputInfoPtr pInfo, const char *src)
+{
+    QubesDevicePtr pQubes = pInfo->private;
+    int fd = pInfo->fd;
     struct xdriver_cmd cmd;
 
+    memcpy(&cmd, src, sizeof(cmd));
+    if (cmd.type == 'V') {
+        // answered with the version instead of the ack, in order
+        char version = '0' + XDRIVER_VERSION;
 
-    ret = read(fd, &cmd, sizeof(cmd));
-    if (ret == 0) {
-        xf86Msg(X_INFO, "randdev: unix closed\n");
-        close_device_fd(pInfo);
+        flush_acks(pInfo);
+        write_exact(fd, &version, 1);
         return;
     }
-    if (ret == -1) {
-        xf86Msg(X_INFO, "randdev: unix error\n");
-        close_device_fd(pInfo);
-        return;
+    pQubes->pending_acks++; // acknowledge the request has been received
+    // The ack must precede any other answer
+    switch (cmd.type) {
+    case 'W':
+    case 'L':
+    case 'R':
+    case 'C':
+        flush_acks(pInfo);
+        break;
     }
 
-    write_exact(fd, "0", 1); // acknowledge the request has been received
-
     switch (cmd.type) {
     case 'W':
-        pQubes->window_id = cmd.arg1;
+    case 'L':
+        if (cmd.type == 'W') {
+            pQubes->dump_windows[0] = cmd.arg1;
+            pQubes->num_dump_windows = 1;
+        } else {
+            // The window list follows the command, gui-agent sends it at once
+            if (cmd.arg1 > XDRIVER_MAX_DUMP_WINDOWS ||
+                read_payload(pInfo, pQubes->dump_windows,
+                             cmd.arg1 * sizeof(uint32_t)) == -1) {
+                xf86Msg(X_ERROR, "randdev: invalid window list\n");
+                close_device_fd(pInfo);
+                return;
+            }
+            pQubes->num_dump_windows = cmd.arg1;
+        }
 #if HAVE_THREADED_INPUT
         // We need to handle the window in the main thread, see
         // QubesBlockHandler(). The mutex is already locked when QubesReadInput
@@ -743,7 +924,7 @@ static void process_request(int fd, InputInfoPtr pInfo)
         xf86PostButtonEvent(pInfo->dev, 0, cmd.arg1, cmd.arg2, 0,0);
         break;
     case 'M':
-        xf86PostMotionEvent(pInfo->dev, 1, 0, 2, cmd.arg1, cmd.arg2);
+        post_motion(pInfo, cmd.arg1, cmd.arg2);
         break;
     case 'K':
         xf86PostKeyboardEvent(pInfo->dev, cmd.arg1, cmd.arg2);
@@ -754,14 +935,62 @@ static void process_request(int fd, InputInfoPtr pInfo)
     case 'A':
         xf86_qubes_pixmap_remove_list_all();
         break;
+    case 'R':
+        send_damage_ring(fd);
+        break;
+    case 'C':
+        send_cursor_export(fd);
+        break;
+    case 'D':
+        // gui-agent made room in the damage ring. Nothing to do here, handling
+        // any request wakes up the main thread, which publishes the pending
+        // damage from its block handler.
+        break;
     default:
         xf86Msg(X_INFO, "randdev: unknown command %u\n", cmd.type);
     }
 }
 
+/* Read all the commands available at once, and ack them together; a burst of
+ * input events costs a few syscalls instead of three per event */
 static void QubesReadInput(InputInfoPtr pInfo)
 {
-    while (xf86WaitForInput(pInfo->fd, 0) > 0) {
-        process_request(pInfo->fd, pInfo);
+    QubesDevicePtr pQubes = pInfo->private;
+    const size_t cmd_size = sizeof(struct xdriver_cmd);
+    size_t left;
+    ssize_t ret;
+
+    while (pInfo->fd >= 0 && xf86WaitForInput(pInfo->fd, 0) > 0) {
+        // keep a partially received command from the previous read
+        left = pQubes->cmd_buf_len - pQubes->cmd_buf_pos;
+        memmove(pQubes->cmd_buf, pQubes->cmd_buf + pQubes->cmd_buf_pos, left);
+        pQubes->cmd_buf_len = left;
+        pQubes->cmd_buf_pos = 0;
+
+        SYSCALL(ret = read(pInfo->fd, pQubes->cmd_buf + left,
+                           sizeof(pQubes->cmd_buf) - left));
+        if (ret == 0) {
+            xf86Msg(X_INFO, "randdev: unix closed\n");
+            close_device_fd(pInfo);
+            return;
+        }
+        if (ret == -1) {
+            xf86Msg(X_INFO, "randdev: unix error\n");
+            close_device_fd(pInfo);
+            return;
+        }
+        pQubes->cmd_buf_len += ret;
+
+        while (pInfo->fd >= 0 &&
+               pQubes->cmd_buf_len - pQubes->cmd_buf_pos >= cmd_size) {
+            pQubes->cmd_buf_pos += cmd_size;
+            process_request(pInfo,
+                            pQubes->cmd_buf + pQubes->cmd_buf_pos - cmd_size);
+        }
+        flush_acks(pInfo);
+
+        // a short read means there is nothing more to read for now
+        if ((size_t)ret < sizeof(pQubes->cmd_buf) - left)
+            break;
     }
 }
@@ -31,5 +31,21 @@ typedef struct _QubesDeviceRec
     Atom* labels;
     int num_vals;
     int axes;
-    unsigned int window_id; /* X Window ID for send_mfns callback */
+    /* X Window IDs for send_mfns callback ('W' or 'L' command) */
+    uint32_t dump_windows[XDRIVER_MAX_DUMP_WINDOWS];
+    unsigned int num_dump_windows;
+    /* Commands read from gui-agent in a single read(), see QubesReadInput() */
+    char cmd_buf[XDRIVER_MAX_BATCH * sizeof(struct xdriver_cmd)];
+    size_t cmd_buf_len;
+    size_t cmd_buf_pos;
+    /* acks of the processed commands, not sent yet */
+    unsigned int pending_acks;
+    /* last pointer position sent by gui-agent, see post_motion() */
+    int last_motion_x;
+    int last_motion_y;
+    /* pointer position right after that motion was posted */
+    int sprite_x;
+    int sprite_y;
+    Bool have_last_motion;
+    Bool relative_motion;
 } QubesDeviceRec, *QubesDevicePtr ;
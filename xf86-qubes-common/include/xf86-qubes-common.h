@@ -27,9 +27,14 @@ extern _X_EXPORT struct xf86_qubes_pixmap *xf86_qubes_pixmap_get_private(
 
 _X_EXPORT void xf86_qubes_pixmap_incref(struct xf86_qubes_pixmap *);
 _X_EXPORT void xf86_qubes_free_pixmap_private(struct xf86_qubes_pixmap *);
-_X_EXPORT void xf86_qubes_pixmap_add_to_list(struct xf86_qubes_pixmap *);
+// FALSE if out of memory, the pixmap is not referenced then
+_X_EXPORT Bool xf86_qubes_pixmap_add_to_list(struct xf86_qubes_pixmap *);
 _X_EXPORT void xf86_qubes_pixmap_remove_list_head(void);
 _X_EXPORT void xf86_qubes_pixmap_remove_list_all(void);
+// Damage export ring (see damage-ring.h), FALSE if not available
+_X_EXPORT Bool xf86_qubes_damage_ring_get_fds(int *shm_fd, int *event_fd);
+// Cursor export (see cursor-export.h), FALSE if not available
+_X_EXPORT Bool xf86_qubes_cursor_get_fd(int *shm_fd);
 
 // xenctrl and xorg headeres are not compatible, so define the required
 // constants here.
@@ -18,6 +18,8 @@
 #include "../../xf86-qubes-common/include/xf86-qubes-common.h"
 
 #define DUMMY_MAX_SCREENS 16
+/* power of two */
+#define DUMMY_DUMP_QUEUE_INITIAL_SIZE 256
 
 /* Supported chipsets */
 typedef enum {
@@ -33,6 +35,24 @@ extern void DUMMYAdjustFrame(ADJUST_FRAME_ARGS_DECL);
 extern Bool DUMMYCursorInit(ScreenPtr pScrn);
 extern void DUMMYShowCursor(ScrnInfoPtr pScrn);
 extern void DUMMYHideCursor(ScrnInfoPtr pScrn);
+extern void DUMMYCursorFini(ScreenPtr pScreen);
+
+/* in dummy_damage.c */
+extern Bool DUMMYDamageInit(ScreenPtr pScreen);
+extern void DUMMYDamageFini(ScreenPtr pScreen);
+extern void DUMMYDamageTrackWindow(WindowPtr pWin);
+
+/* in dummy_grant_stats.c */
+extern void DUMMYGrantStatsInit(ScreenPtr pScreen);
+extern void DUMMYGrantStatsFini(ScreenPtr pScreen);
+extern void DUMMYGrantStatsAlloc(size_t pages);
+extern void DUMMYGrantStatsFree(size_t pages);
+extern void DUMMYGrantStatsAllocFailed(void);
+extern void DUMMYGrantStatsDumpQueue(size_t depth);
+
+/* in dummy_present.c */
+extern Bool DUMMYPresentInit(ScreenPtr pScreen);
+extern void DUMMYPresentFini(ScreenPtr pScreen);
 
 /* in dummy_video.c */
 extern void DUMMYInitVideo(ScreenPtr pScreen);
@@ -48,11 +68,30 @@ typedef struct _color
 struct gbm_device;
 struct gbm_bo;
 
+struct dummy_vblank_event {
+    uint64_t event_id;
+    uint64_t msc;
+};
+
+/* emulated vblank of a CRTC, see dummy_present.c */
+struct dummy_vblank {
+    struct _xf86Crtc *crtc;
+    OsTimerPtr timer;
+    /* time (us) of the vblank number msc_base */
+    uint64_t ust_base;
+    uint64_t msc_base;
+    /* refresh period used for msc_base, 0 if not started yet */
+    uint64_t frame_us;
+    /* pending struct dummy_vblank_event, keyed by event_id */
+    struct genlist events;
+};
+
 typedef struct dummyRec 
 {
     /* options */
     OptionInfoPtr Options;
     Bool swCursor;
+    Bool tileHash;
     /* proc pointer */
     CloseScreenProcPtr CloseScreen;
     xf86CursorInfoPtr CursorInfo;
@@ -77,6 +116,7 @@ typedef struct dummyRec
     struct _xf86Crtc *paCrtcs[DUMMY_MAX_SCREENS];
     struct _xf86Output *paOutputs[DUMMY_MAX_SCREENS];
     int connected_outputs;
+    struct dummy_vblank vblank[DUMMY_MAX_SCREENS];
     /* XRANDR support end */
     int overlay;
     int overlay_offset;
@@ -88,7 +128,13 @@ typedef struct dummyRec
     CreateWindowProcPtr CreateWindow;     /* wrapped CreateWindow */
     Bool prop;
 
-    struct genlist queue;
+    /* Pixmaps sent in MSG_WINDOW_DUMP, waiting for MSG_WINDOW_DUMP_ACK;
+     * a ring of dump_queue_size (power of two) entries, oldest at
+     * dump_queue_head */
+    struct xf86_qubes_pixmap **dump_queue;
+    size_t dump_queue_size;
+    size_t dump_queue_head;
+    size_t dump_queue_len;
     xengntshr_handle *xgs;
     uint32_t gui_domid;
 } DUMMYRec, *DUMMYPtr;
@@ -2,6 +2,10 @@
 #include "config.h"
 #endif
 
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
 /* All drivers should typically include these */
 #include "xf86.h"
 #include "xf86_OSproc.h"
@@ -10,6 +14,16 @@
 #include "cursorstr.h"
 /* Driver specific headers */
 #include "dummy.h"
+#include "cursor-export.h"
+
+/* Current cursor, exported to gui-agent, see cursor-export.h */
+static struct cursor_export *cursor_export;
+static int cursor_export_fd = -1;
+/* size of the last cursor loaded with dummyLoadCursorARGB, 0x0 if the last
+ * one was a core cursor; published only while the cursor is shown */
+static uint32_t loaded_width, loaded_height;
+
+static void dummy_cursor_export_set_size(uint32_t width, uint32_t height);
 
 static void
 dummyShowCursor(ScrnInfoPtr pScrn)
@@ -18,6 +32,7 @@ dummyShowCursor(ScrnInfoPtr pScrn)
 
     /* turn cursor on */
     dPtr->DummyHWCursorShown = TRUE;    
+    dummy_cursor_export_set_size(loaded_width, loaded_height);
 }
 
 static void
@@ -30,6 +45,8 @@ dummyHideCursor(ScrnInfoPtr pScrn)
      *
      */
     dPtr->DummyHWCursorShown = FALSE;
+    /* hidden, or replaced by a software cursor - let gui-agent use XFixes */
+    dummy_cursor_export_set_size(0, 0);
 }
 
 #define MAX_CURS 64
@@ -54,9 +71,62 @@ dummySetCursorColors(ScrnInfoPtr pScrn, int bg, int fg)
     dPtr->cursorBG = bg;
 }
 
+static void
+dummy_cursor_export_begin(void)
+{
+    __atomic_store_n(&cursor_export->seq, cursor_export->seq + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+dummy_cursor_export_end(void)
+{
+    __atomic_store_n(&cursor_export->seq, cursor_export->seq + 1,
+                     __ATOMIC_RELEASE);
+}
+
+static void
+dummy_cursor_export_set_size(uint32_t width, uint32_t height)
+{
+    if (!cursor_export)
+        return;
+    if (cursor_export->width == width && cursor_export->height == height)
+        return;
+    dummy_cursor_export_begin();
+    cursor_export->width = width;
+    cursor_export->height = height;
+    dummy_cursor_export_end();
+}
+
 static void
 dummyLoadCursorImage(ScrnInfoPtr pScrn, unsigned char *src)
 {
+    /* core (two color) cursor, gui-agent falls back to XFixes for it */
+    loaded_width = loaded_height = 0;
+    dummy_cursor_export_set_size(0, 0);
+}
+
+static void
+dummyLoadCursorARGB(ScrnInfoPtr pScrn, CursorPtr pCurs)
+{
+    CursorBitsPtr bits = pCurs->bits;
+
+    loaded_width = bits->width;
+    loaded_height = bits->height;
+    if (!cursor_export)
+        return;
+    dummy_cursor_export_begin();
+    cursor_export->width = bits->width;
+    cursor_export->height = bits->height;
+    cursor_export->xhot = bits->xhot;
+    cursor_export->yhot = bits->yhot;
+    memcpy(cursor_export->pixels, bits->argb,
+           (size_t)bits->width * bits->height * sizeof(CARD32));
+    cursor_export->hash = cursor_export_hash(bits->width, bits->height,
+                                             bits->xhot, bits->yhot,
+                                             bits->argb);
+    dummy_cursor_export_end();
 }
 
 static Bool
@@ -66,6 +136,70 @@ dummyUseHWCursor(ScreenPtr pScr, CursorPtr pCurs)
     return(!dPtr->swCursor);
 }
 
+static Bool
+dummyUseHWCursorARGB(ScreenPtr pScr, CursorPtr pCurs)
+{
+    DUMMYPtr dPtr = DUMMYPTR(xf86ScreenToScrn(pScr));
+
+    if (dPtr->swCursor ||
+            pCurs->bits->width > CURSOR_EXPORT_MAX_SIZE ||
+            pCurs->bits->height > CURSOR_EXPORT_MAX_SIZE) {
+        /* drawn in software, the exported image would be stale */
+        loaded_width = loaded_height = 0;
+        dummy_cursor_export_set_size(0, 0);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+dummy_cursor_export_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+
+    cursor_export_fd = memfd_create("qubes-cursor", MFD_CLOEXEC);
+    if (cursor_export_fd < 0)
+        goto fail;
+    if (ftruncate(cursor_export_fd, CURSOR_EXPORT_SIZE) < 0)
+        goto fail;
+    cursor_export = mmap(NULL, CURSOR_EXPORT_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, cursor_export_fd, 0);
+    if (cursor_export == MAP_FAILED) {
+        cursor_export = NULL;
+        goto fail;
+    }
+    cursor_export->version = CURSOR_EXPORT_VERSION;
+    return;
+
+fail:
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+               "Failed to set up cursor export: %s\n", strerror(errno));
+    DUMMYCursorFini(pScreen);
+}
+
+void
+DUMMYCursorFini(ScreenPtr pScreen)
+{
+    if (cursor_export) {
+        munmap(cursor_export, CURSOR_EXPORT_SIZE);
+        cursor_export = NULL;
+    }
+    if (cursor_export_fd >= 0) {
+        close(cursor_export_fd);
+        cursor_export_fd = -1;
+    }
+}
+
+/* Called by qubes_drv to pass the cursor to gui-agent */
+_X_EXPORT Bool
+xf86_qubes_cursor_get_fd(int *fd)
+{
+    if (!cursor_export)
+        return FALSE;
+    *fd = cursor_export_fd;
+    return TRUE;
+}
+
 #if 0
 static unsigned char*
 dummyRealizeCursor(xf86CursorInfoPtr infoPtr, CursorPtr pCurs)
@@ -85,9 +219,9 @@ DUMMYCursorInit(ScreenPtr pScreen)
 
     dPtr->CursorInfo = infoPtr;
 
-    infoPtr->MaxHeight = 64;
-    infoPtr->MaxWidth = 64;
-    infoPtr->Flags = HARDWARE_CURSOR_TRUECOLOR_AT_8BPP;
+    infoPtr->MaxHeight = CURSOR_EXPORT_MAX_SIZE;
+    infoPtr->MaxWidth = CURSOR_EXPORT_MAX_SIZE;
+    infoPtr->Flags = HARDWARE_CURSOR_TRUECOLOR_AT_8BPP | HARDWARE_CURSOR_ARGB;
 
     infoPtr->SetCursorColors = dummySetCursorColors;
     infoPtr->SetCursorPosition = dummySetCursorPosition;
@@ -95,8 +229,12 @@ DUMMYCursorInit(ScreenPtr pScreen)
     infoPtr->HideCursor = dummyHideCursor;
     infoPtr->ShowCursor = dummyShowCursor;
     infoPtr->UseHWCursor = dummyUseHWCursor;
+    infoPtr->LoadCursorARGB = dummyLoadCursorARGB;
+    infoPtr->UseHWCursorARGB = dummyUseHWCursorARGB;
 /*     infoPtr->RealizeCursor = dummyRealizeCursor; */
-    
+
+    dummy_cursor_export_init(pScreen);
+
     return(xf86InitCursor(pScreen, infoPtr));
 }
 
@@ -0,0 +1,431 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "xf86.h"
+#include "windowstr.h"
+#include "damage.h"
+
+#include "dummy.h"
+#include "damage-ring.h"
+#include "dummy_hash.h"
+
+/*
+ * Damage export to gui-agent through a shared memory ring, see damage-ring.h.
+ *
+ * Every top-level InputOutput window (the ones gui-agent manages) gets a
+ * damage object when created. Damage accumulates in it, and the windows that
+ * got damaged are published in one batch from the block handler, i.e. once
+ * per dispatch cycle, after the events generated by the same requests have
+ * been flushed to the clients. A window is emptied only after all its
+ * rectangles fit in the ring, otherwise it stays pending until gui-agent
+ * makes room.
+ *
+ * With the TileHash option, rectangles are also checked against a hash of
+ * the DUMMY_TILE_SIZE square tiles of the window pixmap they cover: a
+ * rectangle is trimmed to the tiles that changed since the last publish, and
+ * dropped when none did. This catches applications repainting identical
+ * pixels (blinking cursors, spinners, redraws on focus change), at the cost of
+ * reading the damaged tiles once more.
+ *
+ * gui-daemon reads the pixmap asynchronously, and does not acknowledge
+ * the reads, so a published tile may be read while it is changed again:
+ * after A -> B -> A, gui-daemon can be left showing B while the hash says A,
+ * however many cycles it lags behind. A tile is therefore suppressed only
+ * once DUMMY_TILE_IN_FLIGHT_MS have passed since it was last published;
+ * until then every damage to it is published again, identical or not.
+ */
+
+#define DUMMY_TILE_SIZE 64
+/* time gui-daemon is given to read a published tile */
+#define DUMMY_TILE_IN_FLIGHT_MS 250
+
+struct dummy_damage_window {
+    WindowPtr window;
+    DamagePtr damage;
+    /* tile hash cache, valid for the pixmap with serial number
+     * pixmap_serial; a hash of 0 means unknown */
+    unsigned long pixmap_serial;
+    int tiles_x, tiles_y;
+    uint64_t *tile_hash;
+    /* tile_generation[i] == generation if tile i is already hashed in the
+     * current publish, with the result in tile_changed[i] */
+    uint32_t *tile_generation;
+    uint8_t *tile_changed;
+    /* GetTimeInMillis() of the last publish that included tile i */
+    uint32_t *tile_published_ms;
+};
+
+static struct damage_ring *ring;
+static Bool tile_hash_enabled;
+/* publish cycle counter, never 0 - the value of fresh tile caches */
+static uint32_t generation;
+/* GetTimeInMillis() of the current publish */
+static uint32_t publish_ms;
+static int ring_fd = -1;
+static int ring_event_fd = -1;
+/* windows with unpublished damage, keyed by window XID */
+static struct genlist dirty_windows = {
+    .next = &dirty_windows,
+    .prev = &dirty_windows,
+};
+
+static void
+dummy_damage_report(DamagePtr damage, RegionPtr region, void *closure)
+{
+    struct dummy_damage_window *dw = closure;
+    XID id = dw->window->drawable.id;
+
+    if (!list_lookup(&dirty_windows, id) &&
+            !list_insert(&dirty_windows, id, dw))
+        xf86Msg(X_ERROR, "dummy_damage_report: malloc failed!\n");
+}
+
+static void
+dummy_damage_destroy(DamagePtr damage, void *closure)
+{
+    struct dummy_damage_window *dw = closure;
+    struct genlist *l = list_lookup(&dirty_windows, dw->window->drawable.id);
+
+    if (l)
+        list_remove(l);
+    free(dw->tile_hash);
+    free(dw->tile_generation);
+    free(dw->tile_changed);
+    free(dw->tile_published_ms);
+    free(dw);
+}
+
+void
+DUMMYDamageTrackWindow(WindowPtr pWin)
+{
+    struct dummy_damage_window *dw;
+
+    if (!ring)
+        return;
+
+    dw = calloc(1, sizeof(*dw));
+    if (!dw)
+        return;
+    dw->window = pWin;
+    dw->damage = DamageCreate(dummy_damage_report, dummy_damage_destroy,
+                              DamageReportNonEmpty, TRUE,
+                              pWin->drawable.pScreen, dw);
+    if (!dw->damage) {
+        free(dw);
+        return;
+    }
+    /* unregistered and destroyed by the damage layer with the window */
+    DamageRegister(&pWin->drawable, dw->damage);
+}
+
+/* Drop the cache if the window got a new pixmap (e.g. after resize) */
+static Bool
+dummy_tile_cache_validate(struct dummy_damage_window *dw, PixmapPtr pixmap)
+{
+    int tiles_x, tiles_y;
+    size_t n;
+
+    if (dw->tile_hash && dw->pixmap_serial == pixmap->drawable.serialNumber)
+        return TRUE;
+
+    free(dw->tile_hash);
+    free(dw->tile_generation);
+    free(dw->tile_changed);
+    free(dw->tile_published_ms);
+    tiles_x = (pixmap->drawable.width + DUMMY_TILE_SIZE - 1) / DUMMY_TILE_SIZE;
+    tiles_y = (pixmap->drawable.height + DUMMY_TILE_SIZE - 1) / DUMMY_TILE_SIZE;
+    n = (size_t)tiles_x * tiles_y;
+    dw->tile_hash = calloc(n, sizeof(*dw->tile_hash));
+    dw->tile_generation = calloc(n, sizeof(*dw->tile_generation));
+    dw->tile_changed = calloc(n, sizeof(*dw->tile_changed));
+    dw->tile_published_ms = calloc(n, sizeof(*dw->tile_published_ms));
+    if (!dw->tile_hash || !dw->tile_generation || !dw->tile_changed ||
+            !dw->tile_published_ms) {
+        free(dw->tile_hash);
+        free(dw->tile_generation);
+        free(dw->tile_changed);
+        free(dw->tile_published_ms);
+        dw->tile_hash = NULL;
+        dw->tile_generation = NULL;
+        dw->tile_changed = NULL;
+        dw->tile_published_ms = NULL;
+        return FALSE;
+    }
+    dw->pixmap_serial = pixmap->drawable.serialNumber;
+    dw->tiles_x = tiles_x;
+    dw->tiles_y = tiles_y;
+    return TRUE;
+}
+
+/* Whether tile (tx, ty) changed since the last publish, or its last publish
+ * may still be in flight. Each tile is hashed at most once per publish, so several
+ * rectangles touching the same tile all see the same answer. */
+static Bool
+dummy_tile_changed(struct dummy_damage_window *dw, PixmapPtr pixmap,
+                   const uint8_t *data, int tx, int ty)
+{
+    int i = ty * dw->tiles_x + tx;
+    int Bpp = pixmap->drawable.bitsPerPixel / 8;
+    int x = tx * DUMMY_TILE_SIZE, y = ty * DUMMY_TILE_SIZE;
+    int w = min(DUMMY_TILE_SIZE, pixmap->drawable.width - x);
+    int h = min(DUMMY_TILE_SIZE, pixmap->drawable.height - y);
+    uint64_t hash;
+
+    if (dw->tile_generation[i] == generation)
+        return dw->tile_changed[i];
+
+    hash = dummy_hash_block(data + (size_t)y * pixmap->devKind + x * Bpp,
+                            pixmap->devKind, w * Bpp, h);
+    ring->stats.hashed_tiles++;
+    dw->tile_generation[i] = generation;
+    dw->tile_changed[i] = hash != dw->tile_hash[i] ||
+        publish_ms - dw->tile_published_ms[i] < DUMMY_TILE_IN_FLIGHT_MS;
+    dw->tile_hash[i] = hash;
+    return dw->tile_changed[i];
+}
+
+/* Trim box (window relative) to the tiles that changed. Returns FALSE if none
+ * did. */
+static Bool
+dummy_tile_filter(struct dummy_damage_window *dw, BoxPtr box)
+{
+    WindowPtr pWin = dw->window;
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    PixmapPtr pixmap = pScreen->GetWindowPixmap(pWin);
+    struct xf86_qubes_pixmap *priv;
+    BoxRec changed = { MAXSHORT, MAXSHORT, MINSHORT, MINSHORT };
+    int dx, dy, tx, ty, tx1, ty1, tx2, ty2;
+
+    /* not redirected, or not grant-backed: nothing to compare with */
+    if (pixmap == pScreen->GetScreenPixmap(pScreen))
+        return TRUE;
+    priv = xf86_qubes_pixmap_get_private(pixmap);
+    if (!priv || !priv->data || pixmap->drawable.bitsPerPixel < 8)
+        return TRUE;
+    if (!dummy_tile_cache_validate(dw, pixmap))
+        return TRUE;
+
+    /* window to pixmap coordinates */
+    dx = pWin->drawable.x - pixmap->screen_x;
+    dy = pWin->drawable.y - pixmap->screen_y;
+    tx1 = max(box->x1 + dx, 0) / DUMMY_TILE_SIZE;
+    ty1 = max(box->y1 + dy, 0) / DUMMY_TILE_SIZE;
+    tx2 = min((box->x2 + dx - 1) / DUMMY_TILE_SIZE, dw->tiles_x - 1);
+    ty2 = min((box->y2 + dy - 1) / DUMMY_TILE_SIZE, dw->tiles_y - 1);
+
+    for (ty = ty1; ty <= ty2; ty++) {
+        for (tx = tx1; tx <= tx2; tx++) {
+            if (!dummy_tile_changed(dw, pixmap, priv->data, tx, ty))
+                continue;
+            changed.x1 = min(changed.x1, tx * DUMMY_TILE_SIZE - dx);
+            changed.y1 = min(changed.y1, ty * DUMMY_TILE_SIZE - dy);
+            changed.x2 = max(changed.x2, (tx + 1) * DUMMY_TILE_SIZE - dx);
+            changed.y2 = max(changed.y2, (ty + 1) * DUMMY_TILE_SIZE - dy);
+        }
+    }
+    if (changed.x1 >= changed.x2)
+        return FALSE;
+    box->x1 = max(box->x1, changed.x1);
+    box->y1 = max(box->y1, changed.y1);
+    box->x2 = min(box->x2, changed.x2);
+    box->y2 = min(box->y2, changed.y2);
+
+    /* unchanged tiles inside the trimmed box are published too */
+    tx1 = max(box->x1 + dx, 0) / DUMMY_TILE_SIZE;
+    ty1 = max(box->y1 + dy, 0) / DUMMY_TILE_SIZE;
+    tx2 = min((box->x2 + dx - 1) / DUMMY_TILE_SIZE, dw->tiles_x - 1);
+    ty2 = min((box->y2 + dy - 1) / DUMMY_TILE_SIZE, dw->tiles_y - 1);
+    for (ty = ty1; ty <= ty2; ty++)
+        for (tx = tx1; tx <= tx2; tx++)
+            dw->tile_published_ms[ty * dw->tiles_x + tx] = publish_ms;
+    return TRUE;
+}
+
+static uint64_t
+dummy_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void
+dummy_damage_put(uint32_t head, XID window, const BoxRec *box)
+{
+    struct damage_ring_rect *rect = &ring->rects[head & (ring->entries - 1)];
+
+    ring->stats.published_rects++;
+    ring->stats.published_pixels +=
+        (uint64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+
+    rect->window = window;
+    rect->x = box->x1;
+    rect->y = box->y1;
+    rect->width = box->x2 - box->x1;
+    rect->height = box->y2 - box->y1;
+}
+
+/* Publish damage of all dirty windows that fit into the ring */
+static void
+dummy_damage_publish(void)
+{
+    uint32_t head, tail, start;
+    struct genlist *l;
+    struct dummy_damage_window *dw;
+    RegionPtr region;
+    BoxPtr box;
+    BoxRec boxes[DAMAGE_RING_MAX_RECTS_PER_WINDOW];
+    int nbox, nsend, i;
+    uint64_t one = 1, start_us = 0, area;
+
+    head = start = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (tile_hash_enabled) {
+        if (++generation == 0)
+            generation = 1;
+        publish_ms = GetTimeInMillis();
+        start_us = dummy_time_us();
+    }
+
+    while ((l = dirty_windows.next) != &dirty_windows) {
+        dw = l->data;
+        region = DamageRegion(dw->damage);
+        nbox = RegionNumRects(region);
+        if (nbox > DAMAGE_RING_MAX_RECTS_PER_WINDOW)
+            nbox = 1;
+        if (ring->entries - (head - tail) < (uint32_t)nbox) {
+            /* gui-agent may have drained the ring since tail was read, and
+             * found producer_waiting still clear; check again once it is
+             * set, or the 'D' wakeup is lost (see drain_damage_ring()) */
+            __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+            if (ring->entries - (head - tail) < (uint32_t)nbox)
+                break;
+            /* at worst gui-agent sends a needless 'D' */
+            __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+        }
+        box = nbox == 1 ? RegionExtents(region) : RegionRects(region);
+        nsend = 0;
+        for (i = 0; i < nbox; i++) {
+            boxes[nsend] = box[i];
+            if (tile_hash_enabled) {
+                area = (uint64_t)(box[i].x2 - box[i].x1) *
+                    (box[i].y2 - box[i].y1);
+                if (!dummy_tile_filter(dw, &boxes[nsend])) {
+                    ring->stats.suppressed_rects++;
+                    ring->stats.suppressed_pixels += area;
+                    continue;
+                }
+                ring->stats.suppressed_pixels += area -
+                    (uint64_t)(boxes[nsend].x2 - boxes[nsend].x1) *
+                    (boxes[nsend].y2 - boxes[nsend].y1);
+            }
+            nsend++;
+        }
+        for (i = 0; i < nsend; i++)
+            dummy_damage_put(head++, dw->window->drawable.id, &boxes[i]);
+        /* the report callback puts it back on the next damage */
+        DamageEmpty(dw->damage);
+        list_remove(l);
+    }
+
+    if (tile_hash_enabled)
+        ring->stats.hash_time_us += dummy_time_us() - start_us;
+
+    if (head == start)
+        return;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    if (write(ring_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        xf86Msg(X_ERROR, "Failed to signal damage ring: %s\n",
+                strerror(errno));
+}
+
+static void
+dummy_damage_block_handler(void *data, void *timeout)
+{
+    if (dirty_windows.next != &dirty_windows)
+        dummy_damage_publish();
+}
+
+static void
+dummy_damage_wakeup_handler(void *data, int result)
+{
+}
+
+Bool
+DUMMYDamageInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    size_t size = DAMAGE_RING_SIZE(DAMAGE_RING_ENTRIES);
+
+    ring_fd = memfd_create("qubes-damage-ring", MFD_CLOEXEC);
+    if (ring_fd < 0)
+        goto fail;
+    if (ftruncate(ring_fd, size) < 0)
+        goto fail;
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        goto fail;
+    }
+    ring_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring_event_fd < 0)
+        goto fail;
+
+    ring->version = DAMAGE_RING_VERSION;
+    ring->entries = DAMAGE_RING_ENTRIES;
+    tile_hash_enabled = DUMMYPTR(pScrn)->tileHash;
+    if (tile_hash_enabled)
+        ring->flags |= DAMAGE_RING_TILE_HASH;
+
+    RegisterBlockAndWakeupHandlers(dummy_damage_block_handler,
+                                   dummy_damage_wakeup_handler, pScreen);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Damage export ring enabled%s.\n",
+               tile_hash_enabled ? ", with tile hashing" : "");
+    return TRUE;
+
+fail:
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+               "Failed to set up damage export ring: %s\n", strerror(errno));
+    DUMMYDamageFini(pScreen);
+    return FALSE;
+}
+
+void
+DUMMYDamageFini(ScreenPtr pScreen)
+{
+    if (ring) {
+        RemoveBlockAndWakeupHandlers(dummy_damage_block_handler,
+                                     dummy_damage_wakeup_handler, pScreen);
+        munmap(ring, DAMAGE_RING_SIZE(DAMAGE_RING_ENTRIES));
+        ring = NULL;
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    if (ring_event_fd >= 0) {
+        close(ring_event_fd);
+        ring_event_fd = -1;
+    }
+}
+
+/* Called by qubes_drv to pass the ring to gui-agent */
+_X_EXPORT Bool
+xf86_qubes_damage_ring_get_fds(int *shm_fd, int *event_fd)
+{
+    if (!ring)
+        return FALSE;
+    *shm_fd = ring_fd;
+    *event_fd = ring_event_fd;
+    return TRUE;
+}
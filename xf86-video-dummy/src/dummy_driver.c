@@ -144,13 +144,15 @@ static SymTabRec DUMMYChipsets[] = {
 typedef enum {
     OPTION_SW_CURSOR,
     OPTION_RENDER,
-    OPTION_GUI_DOMID
+    OPTION_GUI_DOMID,
+    OPTION_TILE_HASH
 } DUMMYOpts;
 
 static const OptionInfoRec DUMMYOptions[] = {
     { OPTION_SW_CURSOR, "SWcursor",     OPTV_BOOLEAN,   {0}, FALSE },
     { OPTION_RENDER,    "Render",       OPTV_STRING,    {0}, FALSE },
     { OPTION_GUI_DOMID, "GUIDomID",     OPTV_INTEGER,   {0}, FALSE },
+    { OPTION_TILE_HASH, "TileHash",     OPTV_BOOLEAN,   {0}, FALSE },
     { -1,                  NULL,           OPTV_NONE,   {0}, FALSE }
 };
 
@@ -423,13 +425,16 @@ Bool DUMMYAdjustScreenPixmap(ScrnInfoPtr pScrn, int width, int height)
                 width, height);
         return FALSE;
     }
-    if (cbLine * height > pScrn->videoRam * 1024) {
-        if (!dPtr->FBBasePriv) {
-            /* If there is no backing grant entries, it's easy enough to extend
-             */
-            pointer *newFBBase;
-            size_t new_size = (cbLine * height + 1023) & ~1023;
-
+    if (!dPtr->FBBasePriv) {
+        /* Without backing grant entries the framebuffer is sized to what the
+         * current layout needs, both when growing and shrinking. All windows
+         * are redirected, so the root pixmap content is not worth keeping
+         * spare memory for. */
+        pointer *newFBBase;
+        size_t old_size = (size_t)pScrn->videoRam * 1024;
+        size_t new_size = (cbLine * height + 1023) & ~1023;
+
+        if (new_size != old_size) {
             newFBBase = realloc(dPtr->FBBase, new_size);
             if (!newFBBase) {
                 xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
@@ -438,17 +443,16 @@ Bool DUMMYAdjustScreenPixmap(ScrnInfoPtr pScrn, int width, int height)
                         width, height, new_size);
                 return FALSE;
             }
-            memset((char*)newFBBase + pScrn->videoRam * 1024,
-                   0,
-                   new_size - pScrn->videoRam * 1024);
+            if (new_size > old_size)
+                memset((char*)newFBBase + old_size, 0, new_size - old_size);
             dPtr->FBBase = newFBBase;
             pScrn->videoRam = new_size / 1024;
-        } else {
-            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                    "Unable to set up a virtual screen size of %dx%d with %d Kb of video memory available.  Please increase the video memory size.\n",
-                    width, height, pScrn->videoRam);
-            return FALSE;
         }
+    } else if (cbLine * height > pScrn->videoRam * 1024) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                "Unable to set up a virtual screen size of %dx%d with %d Kb of video memory available.  Please increase the video memory size.\n",
+                width, height, pScrn->videoRam);
+        return FALSE;
     }
 
     pScreen->ModifyPixmapHeader(pPixmap, width, height,
@@ -514,8 +518,11 @@ DUMMYGetRec(ScrnInfoPtr pScrn)
     if (pScrn->driverPrivate == NULL)
         return FALSE;
 
-    p->queue.next = &p->queue;
-    p->queue.prev = &p->queue;
+    /* preallocated, so it does not need to grow unless the GUI daemon lags
+     * behind on acks */
+    p->dump_queue = calloc(DUMMY_DUMP_QUEUE_INITIAL_SIZE, sizeof(*p->dump_queue));
+    if (p->dump_queue != NULL)
+        p->dump_queue_size = DUMMY_DUMP_QUEUE_INITIAL_SIZE;
     return TRUE;
 }
 
@@ -524,6 +531,7 @@ DUMMYFreeRec(ScrnInfoPtr pScrn)
 {
     if (pScrn->driverPrivate == NULL)
         return;
+    free(DUMMYPTR(pScrn)->dump_queue);
     free(pScrn->driverPrivate);
     pScrn->driverPrivate = NULL;
 }
@@ -688,6 +696,7 @@ DUMMYPreInit(ScrnInfoPtr pScrn, int flags)
 
     xf86GetOptValBool(dPtr->Options, OPTION_SW_CURSOR,&dPtr->swCursor);
     xf86GetOptValInteger(dPtr->Options, OPTION_GUI_DOMID, (int*)&dPtr->gui_domid);
+    xf86GetOptValBool(dPtr->Options, OPTION_TILE_HASH, &dPtr->tileHash);
 
     if (device->videoRam != 0) {
         pScrn->videoRam = device->videoRam;
@@ -885,13 +894,26 @@ qubes_alloc_pixmap_private(size_t size) {
     if (priv->data == NULL) {
         xf86DrvMsg(DUMMYScrn->scrnIndex, X_ERROR,
                    "Failed to allocate %zu grant pages!\n", pages);
+        DUMMYGrantStatsAllocFailed();
         free(priv);
         return NULL;
     }
+    DUMMYGrantStatsAlloc(pages);
 
     return priv;
 }
 
+/*
+ * All pixmaps with content are backed by grant-shared memory, glamor included:
+ * this replaces the CreatePixmap of glamor, so window pixmaps are never GL
+ * textures. Only the screen pixmap (front_bo) and DRI3 client buffers, created
+ * empty here, get a texture. GPU rendered content reaches window pixmaps when
+ * Present or the client copies it there, and glamor then reads back only the
+ * copied boxes (glamor_prepare_access() of the source), synchronously, before
+ * the damage is reported. MSG_SHMIMAGE thus always follows the readback, and
+ * no separate readback stage is needed. gui-agent/tests/grant-pixmap-test
+ * checks that client pixmaps are grant-backed.
+ */
 static PixmapPtr
 qubes_create_pixmap(ScreenPtr pScreen, int width, int height, int depth,
                     unsigned hint)
@@ -931,6 +953,7 @@ qubes_create_pixmap(ScreenPtr pScreen, int width, int height, int depth,
 
 err_unshare:
     xengntshr_unshare(dPtr->xgs, priv->data, priv->pages);
+    DUMMYGrantStatsFree(priv->pages);
     // Also frees refs
     free(priv);
 err_destroy_pixmap:
@@ -965,6 +988,7 @@ void xf86_qubes_free_pixmap_private(struct xf86_qubes_pixmap *priv) {
     if (refcount == 0) {
         DUMMYPtr dPtr = DUMMYPTR(DUMMYScrn);
         xengntshr_unshare(dPtr->xgs, priv->data, priv->pages);
+        DUMMYGrantStatsFree(priv->pages);
         // Also frees refs
         free(priv);
     } else {
@@ -972,44 +996,80 @@ void xf86_qubes_free_pixmap_private(struct xf86_qubes_pixmap *priv) {
     }
 }
 
-void
+/* Make room for at least one more entry in the window dump ack queue */
+static Bool
+dummy_dump_queue_reserve(DUMMYPtr dPtr)
+{
+    struct xf86_qubes_pixmap **queue;
+    size_t size, i;
+
+    if (dPtr->dump_queue_len < dPtr->dump_queue_size)
+        return TRUE;
+
+    size = dPtr->dump_queue_size ? dPtr->dump_queue_size * 2 :
+        DUMMY_DUMP_QUEUE_INITIAL_SIZE;
+    queue = calloc(size, sizeof(*queue));
+    if (queue == NULL)
+        return FALSE;
+    /* unwrap, so the oldest entry is first again */
+    for (i = 0; i < dPtr->dump_queue_len; i++)
+        queue[i] = dPtr->dump_queue[(dPtr->dump_queue_head + i) &
+                                    (dPtr->dump_queue_size - 1)];
+    free(dPtr->dump_queue);
+    dPtr->dump_queue = queue;
+    dPtr->dump_queue_size = size;
+    dPtr->dump_queue_head = 0;
+    if (size > DUMMY_DUMP_QUEUE_INITIAL_SIZE)
+        xf86DrvMsg(DUMMYScrn->scrnIndex, X_INFO,
+                   "Window dump ack queue grown to %zu entries, "
+                   "GUI daemon is lagging behind\n", size);
+    return TRUE;
+}
+
+Bool
 xf86_qubes_pixmap_add_to_list(struct xf86_qubes_pixmap *priv) {
-    assert(priv->refcount < INT32_MAX && "refcount overflow");
-    priv->refcount++;
     DUMMYPtr dPtr = DUMMYPTR(DUMMYScrn);
-    struct genlist *q = list_insert(&dPtr->queue, 0, priv);
-    if (q == NULL) {
+
+    assert(priv->refcount < INT32_MAX && "refcount overflow");
+    if (!dummy_dump_queue_reserve(dPtr)) {
         xf86DrvMsg(DUMMYScrn->scrnIndex, X_ERROR,
-                   "malloc failed!\n");
-        abort(); /* FIXME handle error */
+                   "Failed to grow window dump ack queue!\n");
+        return FALSE;
     }
+    priv->refcount++;
+    dPtr->dump_queue[(dPtr->dump_queue_head + dPtr->dump_queue_len) &
+                     (dPtr->dump_queue_size - 1)] = priv;
+    dPtr->dump_queue_len++;
+    DUMMYGrantStatsDumpQueue(dPtr->dump_queue_len);
+    return TRUE;
 }
 
 void
 xf86_qubes_pixmap_remove_list_head(void) {
-    struct genlist *l = &DUMMYPTR(DUMMYScrn)->queue;
-    struct genlist *prev = l->prev;
-    if (l == prev) {
-        /* empty list */
+    DUMMYPtr dPtr = DUMMYPTR(DUMMYScrn);
+    struct xf86_qubes_pixmap *priv;
+
+    if (dPtr->dump_queue_len == 0) {
         xf86DrvMsg(DUMMYScrn->scrnIndex, X_ERROR,
                    "GUI daemon sent too many MSG_WINDOW_DUMP_ACK messages\n");
         return;
     }
-    assert(l->next != l);
-    assert(prev->next == l);
-    assert(l->next->prev == l);
-    xf86_qubes_free_pixmap_private(prev->data);
-    list_remove(prev);
+    priv = dPtr->dump_queue[dPtr->dump_queue_head];
+    dPtr->dump_queue_head = (dPtr->dump_queue_head + 1) &
+        (dPtr->dump_queue_size - 1);
+    dPtr->dump_queue_len--;
+    DUMMYGrantStatsDumpQueue(dPtr->dump_queue_len);
+    xf86_qubes_free_pixmap_private(priv);
 }
 
 void
 xf86_qubes_pixmap_remove_list_all(void) {
-    struct genlist *l = &DUMMYPTR(DUMMYScrn)->queue;
-    while (l != l->prev)
+    DUMMYPtr dPtr = DUMMYPTR(DUMMYScrn);
+
+    while (dPtr->dump_queue_len > 0)
         xf86_qubes_pixmap_remove_list_head();
 }
 
-
 Bool
 qubes_destroy_pixmap(PixmapPtr pixmap) {
     DUMMYPtr dPtr = DUMMYPTR(DUMMYScrn);
@@ -1056,9 +1116,19 @@ DUMMYScreenInit(SCREEN_INIT_ARGS_DECL)
             return FALSE;
         dPtr->FBBase = (void *) dPtr->FBBasePriv->data;
     } else {
-        dPtr->FBBase = calloc(1, pScrn->videoRam * 1024);
+        /* VideoRam is only the limit used for validating the initial mode,
+         * allocate just the initial screen, DUMMYAdjustScreenPixmap()
+         * resizes it later as needed */
+        size_t size = ((size_t)pScrn->displayWidth * pScrn->virtualY *
+                (pScrn->bitsPerPixel >> 3) + 1023) & ~1023;
+
+        dPtr->FBBase = calloc(1, size);
         if (dPtr->FBBase == NULL)
             return FALSE;
+        pScrn->videoRam = size / 1024;
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                "Allocated %d kByte for the initial %dx%d screen\n",
+                pScrn->videoRam, pScrn->virtualX, pScrn->virtualY);
     }
 
 
@@ -1210,6 +1280,13 @@ DUMMYScreenInit(SCREEN_INIT_ARGS_DECL)
         return FALSE;
     }
 
+    if (!DUMMYPresentInit(pScreen))
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                "Present extension support not available.\n");
+
+    DUMMYDamageInit(pScreen);
+    DUMMYGrantStatsInit(pScreen);
+
     /* XRANDR initialization end */
 
     if (dPtr->swCursor)
@@ -1258,7 +1335,9 @@ DUMMYScreenInit(SCREEN_INIT_ARGS_DECL)
                 | CMAP_RELOAD_ON_MODE_SWITCH))
         return FALSE;
 
-    /*     DUMMYInitVideo(pScreen); */
+    /* glamor has its own XV adaptor */
+    if (!dPtr->glamor)
+        DUMMYInitVideo(pScreen);
 
     pScreen->SaveScreen = DUMMYSaveScreen;
 
@@ -1319,6 +1398,10 @@ DUMMYCloseScreen(CLOSE_SCREEN_ARGS_DECL)
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     DUMMYPtr dPtr = DUMMYPTR(pScrn);
 
+    DUMMYPresentFini(pScreen);
+    DUMMYDamageFini(pScreen);
+    DUMMYGrantStatsFini(pScreen);
+
     if (dPtr->front_bo) {
         gbm_bo_destroy(dPtr->front_bo);
         dPtr->front_bo = NULL;
@@ -1336,8 +1419,10 @@ DUMMYCloseScreen(CLOSE_SCREEN_ARGS_DECL)
         dPtr->FBBase = NULL;
     }
 
-    if (dPtr->CursorInfo)
+    if (dPtr->CursorInfo) {
         xf86DestroyCursorInfoRec(dPtr->CursorInfo);
+        DUMMYCursorFini(pScreen);
+    }
 
     pScrn->vtSema = FALSE;
     pScreen->CloseScreen = dPtr->CloseScreen;
@@ -1411,6 +1496,11 @@ DUMMYCreateWindow(WindowPtr pWin)
     if(ret != TRUE)
         return(ret);
 
+    /* top-level windows are the ones managed by gui-agent */
+    if (pWin->parent && !pWin->parent->parent &&
+            pWin->drawable.class == InputOutput)
+        DUMMYDamageTrackWindow(pWin);
+
     if(dPtr->prop == FALSE) {
 #if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 8
         pWinRoot = WindowTable[DUMMYScrn->pScreen->myNum];
@@ -0,0 +1,157 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "windowstr.h"
+#include <X11/Xatom.h>
+
+#include "dummy.h"
+#include "grant-stats.h"
+
+/*
+ * Grant table accounting, see grant-stats.h.
+ *
+ * The counters change on every pixmap allocation, partly from the input
+ * thread (MSG_WINDOW_DUMP_ACK frees pixmaps), so they are only updated
+ * atomically there. The root window property is rewritten from the main
+ * thread, in the block handler, and at most once per interval.
+ */
+
+static uint32_t stats[GRANT_STATS_COUNT] = {
+    [GRANT_STATS_VERSION_IDX] = GRANT_STATS_VERSION,
+};
+static Bool stats_dirty = TRUE;
+static Atom stats_atom = None;
+static CARD32 last_update_ms;
+static OsTimerPtr update_timer;
+
+static void
+dummy_grant_stats_changed(void)
+{
+    __atomic_store_n(&stats_dirty, TRUE, __ATOMIC_RELAXED);
+}
+
+static void
+dummy_grant_stats_max(enum grant_stats max_idx, uint32_t value)
+{
+    uint32_t max = __atomic_load_n(&stats[max_idx], __ATOMIC_RELAXED);
+
+    while (value > max &&
+           !__atomic_compare_exchange_n(&stats[max_idx], &max, value, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void
+DUMMYGrantStatsAlloc(size_t pages)
+{
+    uint32_t shared;
+
+    shared = __atomic_add_fetch(&stats[GRANT_STATS_SHARED_PAGES], pages,
+                                __ATOMIC_RELAXED);
+    dummy_grant_stats_max(GRANT_STATS_PEAK_SHARED_PAGES, shared);
+    __atomic_add_fetch(&stats[grant_stats_size_class(pages)], 1,
+                       __ATOMIC_RELAXED);
+    dummy_grant_stats_changed();
+}
+
+void
+DUMMYGrantStatsFree(size_t pages)
+{
+    __atomic_sub_fetch(&stats[GRANT_STATS_SHARED_PAGES], pages,
+                       __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats[grant_stats_size_class(pages)], 1,
+                       __ATOMIC_RELAXED);
+    dummy_grant_stats_changed();
+}
+
+void
+DUMMYGrantStatsAllocFailed(void)
+{
+    __atomic_add_fetch(&stats[GRANT_STATS_ALLOC_FAILURES], 1,
+                       __ATOMIC_RELAXED);
+    dummy_grant_stats_changed();
+}
+
+void
+DUMMYGrantStatsDumpQueue(size_t depth)
+{
+    __atomic_store_n(&stats[GRANT_STATS_ACK_QUEUE_DEPTH], depth,
+                     __ATOMIC_RELAXED);
+    dummy_grant_stats_max(GRANT_STATS_ACK_QUEUE_MAX_DEPTH, depth);
+    dummy_grant_stats_changed();
+}
+
+static void
+dummy_grant_stats_update(ScreenPtr pScreen)
+{
+    uint32_t value[GRANT_STATS_COUNT];
+    int i, ret;
+
+    __atomic_store_n(&stats_dirty, FALSE, __ATOMIC_RELAXED);
+    for (i = 0; i < GRANT_STATS_COUNT; i++)
+        value[i] = __atomic_load_n(&stats[i], __ATOMIC_RELAXED);
+    last_update_ms = GetTimeInMillis();
+
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 21
+    ret = ChangeWindowProperty(pScreen->root, stats_atom, XA_CARDINAL,
+            32, PropModeReplace, GRANT_STATS_COUNT, value, FALSE);
+#else
+    ret = dixChangeWindowProperty(serverClient, pScreen->root,
+            stats_atom, XA_CARDINAL,
+            32, PropModeReplace, GRANT_STATS_COUNT, value, FALSE);
+#endif
+    if (ret != Success)
+        xf86Msg(X_ERROR, "Could not set %s root window property\n",
+                GRANT_STATS_PROP);
+}
+
+static CARD32
+dummy_grant_stats_timer(OsTimerPtr timer, CARD32 time, void *arg)
+{
+    if (__atomic_load_n(&stats_dirty, __ATOMIC_RELAXED))
+        dummy_grant_stats_update(arg);
+    return 0;
+}
+
+static void
+dummy_grant_stats_block_handler(void *data, void *timeout)
+{
+    ScreenPtr pScreen = data;
+    CARD32 since;
+
+    if (!__atomic_load_n(&stats_dirty, __ATOMIC_RELAXED) || !pScreen->root)
+        return;
+    since = GetTimeInMillis() - last_update_ms;
+    if (since >= GRANT_STATS_UPDATE_INTERVAL)
+        dummy_grant_stats_update(pScreen);
+    else
+        update_timer = TimerSet(update_timer, 0,
+                                GRANT_STATS_UPDATE_INTERVAL - since,
+                                dummy_grant_stats_timer, pScreen);
+}
+
+static void
+dummy_grant_stats_wakeup_handler(void *data, int result)
+{
+}
+
+void
+DUMMYGrantStatsInit(ScreenPtr pScreen)
+{
+    stats_atom = MakeAtom(GRANT_STATS_PROP, strlen(GRANT_STATS_PROP), TRUE);
+    /* the first update is done once the root window exists */
+    last_update_ms = GetTimeInMillis() - GRANT_STATS_UPDATE_INTERVAL;
+    RegisterBlockAndWakeupHandlers(dummy_grant_stats_block_handler,
+                                   dummy_grant_stats_wakeup_handler, pScreen);
+}
+
+void
+DUMMYGrantStatsFini(ScreenPtr pScreen)
+{
+    RemoveBlockAndWakeupHandlers(dummy_grant_stats_block_handler,
+                                 dummy_grant_stats_wakeup_handler, pScreen);
+    TimerFree(update_timer);
+    update_timer = NULL;
+}
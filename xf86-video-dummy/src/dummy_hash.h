@@ -0,0 +1,227 @@
+#ifndef DUMMY_HASH_H
+#define DUMMY_HASH_H
+
+/* Tile hash of the TileHash option (see dummy_damage.c). It does not depend
+ * on the X server headers, so gui-agent/tests can build it too. Hashes are
+ * only compared within one process, so the scalar, SSE2 and AVX2 variants
+ * do not need to agree. */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define DUMMY_HASH_MUL 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t
+dummy_load64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+dummy_hash_round(uint64_t h, uint64_t v)
+{
+    h = (h ^ v) * DUMMY_HASH_MUL;
+    return h ^ (h >> 32);
+}
+
+/* murmur3 finalizer; never returns 0, which means "unknown" to callers */
+static inline uint64_t
+dummy_hash_final(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+/* Hash of a width_bytes x height block. Four independent lanes, so the
+ * multiplications of consecutive words do not wait for each other. */
+static inline uint64_t
+dummy_hash_block_scalar(const uint8_t *data, int stride, int width_bytes,
+                        int height)
+{
+    uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = 4;
+    uint64_t tail;
+    int x, y;
+
+    for (y = 0; y < height; y++, data += stride) {
+        for (x = 0; x + 32 <= width_bytes; x += 32) {
+            h0 = dummy_hash_round(h0, dummy_load64(data + x));
+            h1 = dummy_hash_round(h1, dummy_load64(data + x + 8));
+            h2 = dummy_hash_round(h2, dummy_load64(data + x + 16));
+            h3 = dummy_hash_round(h3, dummy_load64(data + x + 24));
+        }
+        for (; x + 8 <= width_bytes; x += 8)
+            h0 = dummy_hash_round(h0, dummy_load64(data + x));
+        if (x < width_bytes) {
+            tail = 0;
+            memcpy(&tail, data + x, width_bytes - x);
+            h1 = dummy_hash_round(h1, tail);
+        }
+    }
+    h0 ^= (h1 << 16 | h1 >> 48) ^ (h2 << 32 | h2 >> 32) ^ (h3 << 48 | h3 >> 16);
+    return dummy_hash_final(h0);
+}
+
+#ifdef __SSE2__
+/* One 16 byte stripe, as in the xxh3 accumulate step: the 32x32->64 bit
+ * product of the keyed halves, plus the data itself with its halves
+ * swapped, so that the data still counts when a product is 0. */
+static inline __m128i
+dummy_hash_accumulate(__m128i acc, __m128i data, __m128i key)
+{
+    __m128i keyed = _mm_xor_si128(data, key);
+    __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+
+    return _mm_add_epi64(acc, _mm_add_epi64(product,
+        _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+
+/* Same as dummy_hash_block_scalar(), 64 bytes at a time. The key changes
+ * with every stripe, so that swapped rows or stripes, which the sum alone
+ * would not see, give a different hash. */
+static inline uint64_t
+dummy_hash_block_sse2(const uint8_t *data, int stride, int width_bytes,
+                      int height)
+{
+    const __m128i key_step = _mm_set_epi32(0x85ebca77, 0xc2b2ae3d,
+                                           0x27d4eb2f, 0x165667b1);
+    const __m128i lane1 = _mm_set_epi32(0x2545f491, 0x4f6cdd1d,
+                                        0x9e3779b9, 0x7f4a7c15);
+    const __m128i lane2 = _mm_set_epi32(0xbf58476d, 0x1ce4e5b9,
+                                        0x94d049bb, 0x133111eb);
+    const __m128i lane3 = _mm_set_epi32(0xd6e8feb8, 0x6659fd93,
+                                        0xff51afd7, 0xed558ccd);
+    __m128i acc0 = _mm_setzero_si128(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    __m128i key = _mm_set_epi32(0x3c6ef372, 0xa54ff53a, 0x510e527f,
+                                0x9b05688c);
+    uint64_t lanes[8], h = 1, tail;
+    int x, y, i;
+
+    for (y = 0; y < height; y++, data += stride) {
+        for (x = 0; x + 64 <= width_bytes; x += 64) {
+            const __m128i *p = (const __m128i *)(data + x);
+
+            acc0 = dummy_hash_accumulate(acc0, _mm_loadu_si128(p), key);
+            acc1 = dummy_hash_accumulate(acc1, _mm_loadu_si128(p + 1),
+                                         _mm_xor_si128(key, lane1));
+            acc2 = dummy_hash_accumulate(acc2, _mm_loadu_si128(p + 2),
+                                         _mm_xor_si128(key, lane2));
+            acc3 = dummy_hash_accumulate(acc3, _mm_loadu_si128(p + 3),
+                                         _mm_xor_si128(key, lane3));
+            key = _mm_add_epi32(key, key_step);
+        }
+        for (; x + 16 <= width_bytes; x += 16) {
+            acc0 = dummy_hash_accumulate(acc0,
+                _mm_loadu_si128((const __m128i *)(data + x)), key);
+            key = _mm_add_epi32(key, key_step);
+        }
+        for (; x + 8 <= width_bytes; x += 8)
+            h = dummy_hash_round(h, dummy_load64(data + x));
+        if (x < width_bytes) {
+            tail = 0;
+            memcpy(&tail, data + x, width_bytes - x);
+            h = dummy_hash_round(h, tail);
+        }
+        /* keep rows of different widths apart in the scalar lane */
+        h = dummy_hash_round(h, y);
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc0);
+    _mm_storeu_si128((__m128i *)lanes + 1, acc1);
+    _mm_storeu_si128((__m128i *)lanes + 2, acc2);
+    _mm_storeu_si128((__m128i *)lanes + 3, acc3);
+    for (i = 0; i < 8; i++)
+        h = dummy_hash_round(h, lanes[i]);
+    return dummy_hash_final(h);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static inline __m256i
+dummy_hash_accumulate_avx2(__m256i acc, __m256i data, __m256i key)
+{
+    __m256i keyed = _mm256_xor_si256(data, key);
+    __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+
+    return _mm256_add_epi64(acc, _mm256_add_epi64(product,
+        _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+
+/* Same as dummy_hash_block_sse2(), with 32 byte stripes */
+__attribute__((target("avx2")))
+static inline uint64_t
+dummy_hash_block_avx2(const uint8_t *data, int stride, int width_bytes,
+                      int height)
+{
+    const __m256i key_step = _mm256_set_epi32(0x85ebca77, 0xc2b2ae3d,
+                                              0x27d4eb2f, 0x165667b1,
+                                              0x2545f491, 0x4f6cdd1d,
+                                              0x9e3779b9, 0x7f4a7c15);
+    const __m256i lane1 = _mm256_set_epi32(0xbf58476d, 0x1ce4e5b9,
+                                           0x94d049bb, 0x133111eb,
+                                           0xd6e8feb8, 0x6659fd93,
+                                           0xff51afd7, 0xed558ccd);
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = acc0;
+    __m256i key = _mm256_set_epi32(0x3c6ef372, 0xa54ff53a, 0x510e527f,
+                                   0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+                                   0x6a09e667, 0xbb67ae85);
+    uint64_t lanes[8], h = 1, tail;
+    int x, y, i;
+
+    for (y = 0; y < height; y++, data += stride) {
+        for (x = 0; x + 64 <= width_bytes; x += 64) {
+            const __m256i *p = (const __m256i *)(data + x);
+
+            acc0 = dummy_hash_accumulate_avx2(acc0, _mm256_loadu_si256(p),
+                                              key);
+            acc1 = dummy_hash_accumulate_avx2(acc1, _mm256_loadu_si256(p + 1),
+                                              _mm256_xor_si256(key, lane1));
+            key = _mm256_add_epi32(key, key_step);
+        }
+        for (; x + 32 <= width_bytes; x += 32) {
+            acc0 = dummy_hash_accumulate_avx2(acc0,
+                _mm256_loadu_si256((const __m256i *)(data + x)), key);
+            key = _mm256_add_epi32(key, key_step);
+        }
+        for (; x + 8 <= width_bytes; x += 8)
+            h = dummy_hash_round(h, dummy_load64(data + x));
+        if (x < width_bytes) {
+            tail = 0;
+            memcpy(&tail, data + x, width_bytes - x);
+            h = dummy_hash_round(h, tail);
+        }
+        h = dummy_hash_round(h, y);
+    }
+    _mm256_storeu_si256((__m256i *)lanes, acc0);
+    _mm256_storeu_si256((__m256i *)lanes + 1, acc1);
+    for (i = 0; i < 8; i++)
+        h = dummy_hash_round(h, lanes[i]);
+    return dummy_hash_final(h);
+}
+#endif
+
+static inline uint64_t
+dummy_hash_block(const uint8_t *data, int stride, int width_bytes, int height)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return dummy_hash_block_avx2(data, stride, width_bytes, height);
+#endif
+#ifdef __SSE2__
+    return dummy_hash_block_sse2(data, stride, width_bytes, height);
+#else
+    return dummy_hash_block_scalar(data, stride, width_bytes, height);
+#endif
+}
+
+#endif /* DUMMY_HASH_H */
@@ -0,0 +1,295 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "xf86Crtc.h"
+#include "os.h"
+
+#include "dummy.h"
+
+/*
+ * Present extension support with emulated vblank.
+ *
+ * There is no real scanout, so vblank of each CRTC is emulated from the
+ * clock, at the refresh rate of its current RandR mode. The timer is armed
+ * only while some client waits for a vblank, an idle screen causes no wakeups
+ * at all. Presented pixmaps are always copied into the window pixmap (which
+ * is what the GUI daemon maps anyway), flipping is not supported.
+ */
+
+#ifdef HAVE_PRESENT_H
+
+#include <present.h>
+
+#define GLAMOR_FOR_XORG
+#include <glamor.h>
+
+/* used when the CRTC has no valid mode */
+#define DUMMY_DEFAULT_REFRESH 60
+
+static struct dummy_vblank *
+dummy_crtc_vblank(xf86CrtcPtr crtc)
+{
+    DUMMYPtr dPtr = DUMMYPTR(crtc->scrn);
+
+    return &dPtr->vblank[(uintptr_t)crtc->driver_private];
+}
+
+static uint64_t
+dummy_crtc_frame_us(xf86CrtcPtr crtc)
+{
+    float refresh = 0;
+
+    if (crtc->enabled)
+        refresh = xf86ModeVRefresh(&crtc->mode);
+    if (refresh <= 0)
+        refresh = DUMMY_DEFAULT_REFRESH;
+    return (uint64_t)(1000000.0 / refresh);
+}
+
+/* Bring the vblank counter up to date with the current time, keeping it
+ * monotonic when the refresh rate changes. Returns the current msc and stores
+ * time of its start in *ust. */
+static uint64_t
+dummy_vblank_update(struct dummy_vblank *vbl, uint64_t *ust)
+{
+    uint64_t now = GetTimeInMicros();
+    uint64_t frame_us = dummy_crtc_frame_us(vbl->crtc);
+    uint64_t frames;
+
+    if (vbl->frame_us == 0) {
+        vbl->ust_base = now;
+        vbl->msc_base = 0;
+        vbl->frame_us = frame_us;
+    } else if (vbl->frame_us != frame_us) {
+        frames = (now - vbl->ust_base) / vbl->frame_us;
+        vbl->msc_base += frames;
+        vbl->ust_base += frames * vbl->frame_us;
+        vbl->frame_us = frame_us;
+    }
+    frames = (now - vbl->ust_base) / vbl->frame_us;
+    if (ust)
+        *ust = vbl->ust_base + frames * vbl->frame_us;
+    return vbl->msc_base + frames;
+}
+
+static CARD32 dummy_vblank_timer(OsTimerPtr timer, CARD32 time, void *arg);
+
+/* (Re)arm the timer for the earliest pending event, or disarm it */
+static CARD32
+dummy_vblank_next_timeout(struct dummy_vblank *vbl)
+{
+    struct genlist *l;
+    struct dummy_vblank_event *event;
+    uint64_t msc, ust, now, target = UINT64_MAX, target_ust;
+
+    for (l = vbl->events.next; l != &vbl->events; l = l->next) {
+        event = l->data;
+        if (event->msc < target)
+            target = event->msc;
+    }
+    if (target == UINT64_MAX)
+        return 0;
+    msc = dummy_vblank_update(vbl, &ust);
+    if (target <= msc)
+        return 1;
+    target_ust = ust + (target - msc) * vbl->frame_us;
+    now = GetTimeInMicros();
+    if (target_ust <= now)
+        return 1;
+    return (target_ust - now + 999) / 1000;
+}
+
+static void
+dummy_vblank_rearm(struct dummy_vblank *vbl)
+{
+    CARD32 timeout = dummy_vblank_next_timeout(vbl);
+
+    if (timeout)
+        vbl->timer = TimerSet(vbl->timer, 0, timeout, dummy_vblank_timer, vbl);
+    else
+        TimerCancel(vbl->timer);
+}
+
+static CARD32
+dummy_vblank_timer(OsTimerPtr timer, CARD32 time, void *arg)
+{
+    struct dummy_vblank *vbl = arg;
+    struct dummy_vblank_event *event;
+    struct genlist *l;
+    uint64_t msc, ust;
+
+    msc = dummy_vblank_update(vbl, &ust);
+    /* present_event_notify() may queue or abort other events, so restart the
+     * lookup after each one */
+    for (;;) {
+        for (l = vbl->events.next; l != &vbl->events; l = l->next) {
+            event = l->data;
+            if (event->msc <= msc)
+                break;
+        }
+        if (l == &vbl->events)
+            break;
+        list_remove(l);
+        present_event_notify(event->event_id, ust, msc);
+        free(event);
+    }
+    /* the return value re-arms the timer */
+    return dummy_vblank_next_timeout(vbl);
+}
+
+static RRCrtcPtr
+dummy_present_get_crtc(WindowPtr window)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(window->drawable.pScreen);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+    xf86CrtcPtr best = NULL;
+    long best_area = 0, area;
+    int i, x1, y1, x2, y2;
+
+    /* the CRTC showing the biggest part of the window */
+    for (i = 0; i < config->num_crtc; i++) {
+        xf86CrtcPtr crtc = config->crtc[i];
+
+        if (!crtc->enabled)
+            continue;
+        x1 = max(window->drawable.x, crtc->x);
+        y1 = max(window->drawable.y, crtc->y);
+        x2 = min(window->drawable.x + window->drawable.width,
+                 crtc->x + crtc->mode.HDisplay);
+        y2 = min(window->drawable.y + window->drawable.height,
+                 crtc->y + crtc->mode.VDisplay);
+        if (x2 <= x1 || y2 <= y1)
+            continue;
+        area = (long)(x2 - x1) * (y2 - y1);
+        if (area > best_area) {
+            best = crtc;
+            best_area = area;
+        }
+    }
+    /* off screen windows fall back to the Present core fake vblank */
+    return best ? best->randr_crtc : NULL;
+}
+
+static int
+dummy_present_get_ust_msc(RRCrtcPtr rr_crtc, uint64_t *ust, uint64_t *msc)
+{
+    xf86CrtcPtr crtc = rr_crtc->devPrivate;
+
+    *msc = dummy_vblank_update(dummy_crtc_vblank(crtc), ust);
+    return Success;
+}
+
+static int
+dummy_present_queue_vblank(RRCrtcPtr rr_crtc, uint64_t event_id, uint64_t msc)
+{
+    xf86CrtcPtr crtc = rr_crtc->devPrivate;
+    struct dummy_vblank *vbl = dummy_crtc_vblank(crtc);
+    struct dummy_vblank_event *event;
+
+    event = malloc(sizeof(*event));
+    if (!event)
+        return BadAlloc;
+    event->event_id = event_id;
+    event->msc = msc;
+    if (!list_insert(&vbl->events, (long)event_id, event)) {
+        free(event);
+        return BadAlloc;
+    }
+    dummy_vblank_rearm(vbl);
+    return Success;
+}
+
+static void
+dummy_present_abort_vblank(RRCrtcPtr rr_crtc, uint64_t event_id, uint64_t msc)
+{
+    xf86CrtcPtr crtc = rr_crtc->devPrivate;
+    struct dummy_vblank *vbl = dummy_crtc_vblank(crtc);
+    struct genlist *l = list_lookup(&vbl->events, (long)event_id);
+
+    if (!l)
+        return;
+    free(l->data);
+    list_remove(l);
+    dummy_vblank_rearm(vbl);
+}
+
+static void
+dummy_present_flush(WindowPtr window)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(window->drawable.pScreen);
+
+    if (DUMMYPTR(pScrn)->glamor)
+        glamor_block_handler(window->drawable.pScreen);
+}
+
+static present_screen_info_rec dummy_present_screen_info = {
+    .version = PRESENT_SCREEN_INFO_VERSION,
+    .get_crtc = dummy_present_get_crtc,
+    .get_ust_msc = dummy_present_get_ust_msc,
+    .queue_vblank = dummy_present_queue_vblank,
+    .abort_vblank = dummy_present_abort_vblank,
+    .flush = dummy_present_flush,
+    .capabilities = PresentCapabilityNone,
+    /* No flip: windows are composite redirected, so Present never considers
+     * them for flipping, and the root window is not shown by the GUI daemon
+     * at all. */
+    .check_flip = NULL,
+    .flip = NULL,
+    .unflip = NULL,
+};
+
+Bool
+DUMMYPresentInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    DUMMYPtr dPtr = DUMMYPTR(pScrn);
+    int i;
+
+    for (i = 0; i < dPtr->num_screens; i++) {
+        struct dummy_vblank *vbl = &dPtr->vblank[i];
+
+        vbl->crtc = dPtr->paCrtcs[i];
+        vbl->timer = NULL;
+        vbl->frame_us = 0;
+        vbl->events.next = &vbl->events;
+        vbl->events.prev = &vbl->events;
+    }
+
+    return present_screen_init(pScreen, &dummy_present_screen_info);
+}
+
+void
+DUMMYPresentFini(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    DUMMYPtr dPtr = DUMMYPTR(pScrn);
+    int i;
+
+    for (i = 0; i < dPtr->num_screens; i++) {
+        struct dummy_vblank *vbl = &dPtr->vblank[i];
+
+        TimerFree(vbl->timer);
+        vbl->timer = NULL;
+        while (vbl->events.next != &vbl->events) {
+            free(vbl->events.next->data);
+            list_remove(vbl->events.next);
+        }
+    }
+}
+
+#else /* HAVE_PRESENT_H */
+
+Bool
+DUMMYPresentInit(ScreenPtr pScreen)
+{
+    return FALSE;
+}
+
+void
+DUMMYPresentFini(ScreenPtr pScreen)
+{
+}
+
+#endif /* HAVE_PRESENT_H */
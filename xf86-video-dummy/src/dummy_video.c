@@ -0,0 +1,419 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "xf86_OSproc.h"
+#include "damage.h"
+
+#include "dummy.h"
+
+/*
+ * Software Xv adaptor, used when glamor is not available (no GPU in the VM).
+ *
+ * Images are converted (BT.601, limited range) and scaled (nearest neighbour)
+ * directly into the destination window pixmap, which is the grant-backed
+ * buffer the GUI daemon shows. Each source row is first converted into a line
+ * buffer, with the hot loop vectorized with SSE2 where available, and then
+ * copied or horizontally scaled into every destination row using it.
+ */
+
+#ifdef XvExtension
+
+#include "fourcc.h"
+#include "dummy_yuv.h"
+
+#ifndef FOURCC_NV12
+#define FOURCC_NV12 0x3231564e
+#endif
+#ifndef XVIMAGE_NV12
+#define XVIMAGE_NV12 \
+   { \
+        FOURCC_NV12, \
+        XvYUV, \
+        LSBFirst, \
+        {'N','V','1','2', \
+          0x00,0x00,0x00,0x10,0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71}, \
+        12, \
+        XvPlanar, \
+        2, \
+        0, 0, 0, 0, \
+        8, 8, 8, \
+        1, 2, 2, \
+        1, 2, 2, \
+        {'Y','U','V', \
+          0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}, \
+        XvTopToBottom \
+   }
+#endif
+
+#define DUMMY_VIDEO_NUM_PORTS 16
+#define DUMMY_VIDEO_MAX_WIDTH 8192
+#define DUMMY_VIDEO_MAX_HEIGHT 8192
+
+static XF86VideoEncodingRec DummyVideoEncoding[] = {
+    { 0, "XV_IMAGE", DUMMY_VIDEO_MAX_WIDTH, DUMMY_VIDEO_MAX_HEIGHT, {1, 1} },
+};
+
+static XF86VideoFormatRec DummyVideoFormats[] = {
+    { 24, TrueColor },
+};
+
+static XF86ImageRec DummyVideoImages[] = {
+    XVIMAGE_YV12,
+    XVIMAGE_I420,
+    XVIMAGE_NV12,
+    XVIMAGE_YUY2,
+};
+
+/* scratch buffers, shared by all ports - Xv requests are handled one at a
+ * time */
+struct dummy_video_scratch {
+    /* converted source row, starting at an even source column */
+    uint32_t line[DUMMY_VIDEO_MAX_WIDTH + 2];
+    /* deinterleaved NV12 / YUY2 source row */
+    uint8_t y[DUMMY_VIDEO_MAX_WIDTH + 2];
+    uint8_t u[DUMMY_VIDEO_MAX_WIDTH / 2 + 1];
+    uint8_t v[DUMMY_VIDEO_MAX_WIDTH / 2 + 1];
+};
+
+static struct dummy_video_scratch *scratch;
+
+static int
+dummy_video_query_image_attributes(ScrnInfoPtr pScrn, int id,
+                                   unsigned short *w, unsigned short *h,
+                                   int *pitches, int *offsets)
+{
+    int size, tmp;
+
+    if (*w > DUMMY_VIDEO_MAX_WIDTH)
+        *w = DUMMY_VIDEO_MAX_WIDTH;
+    if (*h > DUMMY_VIDEO_MAX_HEIGHT)
+        *h = DUMMY_VIDEO_MAX_HEIGHT;
+
+    *w = (*w + 1) & ~1;
+    if (offsets)
+        offsets[0] = 0;
+
+    switch (id) {
+    case FOURCC_YV12:
+    case FOURCC_I420:
+        *h = (*h + 1) & ~1;
+        size = (*w + 3) & ~3;
+        if (pitches)
+            pitches[0] = size;
+        size *= *h;
+        if (offsets)
+            offsets[1] = size;
+        tmp = ((*w >> 1) + 3) & ~3;
+        if (pitches)
+            pitches[1] = pitches[2] = tmp;
+        tmp *= (*h >> 1);
+        size += tmp;
+        if (offsets)
+            offsets[2] = size;
+        size += tmp;
+        break;
+    case FOURCC_NV12:
+        *h = (*h + 1) & ~1;
+        size = (*w + 3) & ~3;
+        if (pitches)
+            pitches[0] = pitches[1] = size;
+        tmp = size * *h;
+        if (offsets)
+            offsets[1] = tmp;
+        size = tmp + size * (*h >> 1);
+        break;
+    case FOURCC_YUY2:
+    default:
+        size = *w << 1;
+        if (pitches)
+            pitches[0] = size;
+        size *= *h;
+        break;
+    }
+
+    return size;
+}
+
+/* Convert source columns [x, x + n) of row sy into scratch->line, which then
+ * holds them starting at index x & 1. */
+static void
+dummy_video_convert_row(int id, const uint8_t *buf,
+                        const int *pitches, const int *offsets,
+                        int sy, int x, int n)
+{
+    const uint8_t *y, *u, *v, *src;
+    int i;
+
+    n += x & 1;
+    x &= ~1;
+
+    switch (id) {
+    case FOURCC_YV12:
+    case FOURCC_I420:
+        y = buf + sy * pitches[0] + x;
+        u = buf + offsets[1] + (sy / 2) * pitches[1] + x / 2;
+        v = buf + offsets[2] + (sy / 2) * pitches[2] + x / 2;
+        if (id == FOURCC_YV12) {
+            /* YV12 has V plane first */
+            const uint8_t *t = u;
+
+            u = v;
+            v = t;
+        }
+        break;
+    case FOURCC_NV12:
+        y = buf + sy * pitches[0] + x;
+        src = buf + offsets[1] + (sy / 2) * pitches[1] + x;
+        for (i = 0; i < (n + 1) / 2; i++) {
+            scratch->u[i] = src[2 * i];
+            scratch->v[i] = src[2 * i + 1];
+        }
+        u = scratch->u;
+        v = scratch->v;
+        break;
+    case FOURCC_YUY2:
+    default:
+        src = buf + sy * pitches[0] + x * 2;
+        for (i = 0; i < (n + 1) / 2; i++) {
+            scratch->y[2 * i] = src[4 * i];
+            scratch->u[i] = src[4 * i + 1];
+            scratch->y[2 * i + 1] = src[4 * i + 2];
+            scratch->v[i] = src[4 * i + 3];
+        }
+        y = scratch->y;
+        u = scratch->u;
+        v = scratch->v;
+        break;
+    }
+
+    yuv_row_to_xrgb(scratch->line, y, u, v, n);
+}
+
+static inline int
+dummy_video_clamp(int value, int min, int max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
+/* ceil(a / b), for b > 0 */
+static inline int64_t
+dummy_video_div_ceil(int64_t a, int64_t b)
+{
+    return a >= 0 ? (a + b - 1) / b : -(-a / b);
+}
+
+/* Trim the destination span [*d1, *d2) to the part whose source, mapped as
+ * src + (d - drw) * src_len / drw_len, lies within [0, size) */
+static void
+dummy_video_clip_span(int src, int src_len, int drw, int drw_len, int size,
+                      int *d1, int *d2)
+{
+    int64_t lo = dummy_video_div_ceil(-(int64_t)src * drw_len, src_len);
+    int64_t hi = dummy_video_div_ceil(((int64_t)size - src) * drw_len, src_len);
+
+    *d1 = drw + (int)(lo < 0 ? 0 : lo > drw_len ? drw_len : lo);
+    *d2 = drw + (int)(hi < 0 ? 0 : hi > drw_len ? drw_len : hi);
+}
+
+static int
+dummy_video_put_image(ScrnInfoPtr pScrn,
+                      short src_x, short src_y, short drw_x, short drw_y,
+                      short src_w, short src_h, short drw_w, short drw_h,
+                      int id, unsigned char *buf, short width, short height,
+                      Bool sync, RegionPtr clipBoxes, pointer data,
+                      DrawablePtr pDraw)
+{
+    ScreenPtr pScreen = pDraw->pScreen;
+    PixmapPtr pixmap;
+    BoxRec dst_box;
+    BoxPtr box;
+    int nbox, x_off = 0, y_off = 0, x1, y1, x2, y2;
+    int dx, dy, sx, sy, sx1, sx2, last_sy, n;
+    int pitches[3], offsets[3];
+    unsigned short w, h;
+    uint8_t *dst_base;
+    uint32_t *dst;
+
+    if (src_w <= 0 || src_h <= 0 || drw_w <= 0 || drw_h <= 0 ||
+            width <= 0 || height <= 0 ||
+            width > DUMMY_VIDEO_MAX_WIDTH || height > DUMMY_VIDEO_MAX_HEIGHT)
+        return Success;
+
+    if (pDraw->type == DRAWABLE_WINDOW)
+        pixmap = pScreen->GetWindowPixmap((WindowPtr)pDraw);
+    else
+        pixmap = (PixmapPtr)pDraw;
+    if (pixmap->drawable.bitsPerPixel != 32 || !pixmap->devPrivate.ptr)
+        return BadMatch;
+#ifdef COMPOSITE
+    /* convert screen coordinates to the (redirected) window pixmap ones */
+    x_off = -pixmap->screen_x;
+    y_off = -pixmap->screen_y;
+#endif
+    dst_base = pixmap->devPrivate.ptr;
+
+    /* the client buffer has the layout reported by QueryImageAttributes */
+    w = width;
+    h = height;
+    dummy_video_query_image_attributes(pScrn, id, &w, &h, pitches, offsets);
+
+    /* only the part of the destination showing the image is drawn, so that
+     * neither stale nor out of bounds data is read from the line buffer */
+    dummy_video_clip_span(src_x, src_w, drw_x, drw_w, width, &x1, &x2);
+    dummy_video_clip_span(src_y, src_h, drw_y, drw_h, height, &y1, &y2);
+    if (x1 >= x2 || y1 >= y2)
+        return Success;
+    dst_box.x1 = x1;
+    dst_box.y1 = y1;
+    dst_box.x2 = x2;
+    dst_box.y2 = y2;
+
+    nbox = RegionNumRects(clipBoxes);
+    box = RegionRects(clipBoxes);
+    for (; nbox--; box++) {
+        BoxRec b = {
+            .x1 = max(box->x1, dst_box.x1),
+            .y1 = max(box->y1, dst_box.y1),
+            .x2 = min(box->x2, dst_box.x2),
+            .y2 = min(box->y2, dst_box.y2),
+        };
+
+        if (b.x1 >= b.x2 || b.y1 >= b.y2)
+            continue;
+
+        /* source columns needed for this box */
+        sx1 = src_x + (int)((int64_t)(b.x1 - drw_x) * src_w / drw_w);
+        sx2 = src_x + (int)((int64_t)(b.x2 - 1 - drw_x) * src_w / drw_w) + 1;
+        sx1 = dummy_video_clamp(sx1, 0, width - 1);
+        sx2 = dummy_video_clamp(sx2, sx1 + 1, width);
+        n = sx2 - sx1;
+
+        last_sy = -1;
+        for (dy = b.y1; dy < b.y2; dy++) {
+            sy = src_y + (int)((int64_t)(dy - drw_y) * src_h / drw_h);
+            sy = dummy_video_clamp(sy, 0, height - 1);
+            /* upscaled rows reuse the previous conversion */
+            if (sy != last_sy) {
+                dummy_video_convert_row(id, buf, pitches, offsets,
+                                        sy, sx1, n);
+                last_sy = sy;
+            }
+
+            dst = (uint32_t *)(dst_base + (dy + y_off) * pixmap->devKind) +
+                b.x1 + x_off;
+            if (src_w == drw_w) {
+                memcpy(dst, scratch->line + (sx1 & 1),
+                       (b.x2 - b.x1) * sizeof(uint32_t));
+                continue;
+            }
+            for (dx = b.x1; dx < b.x2; dx++) {
+                sx = src_x + (int)((int64_t)(dx - drw_x) * src_w / drw_w);
+                sx = dummy_video_clamp(sx, sx1, sx2 - 1);
+                *dst++ = scratch->line[sx - (sx1 & ~1)];
+            }
+        }
+    }
+
+    DamageDamageRegion(pDraw, clipBoxes);
+    return Success;
+}
+
+static void
+dummy_video_stop(ScrnInfoPtr pScrn, pointer data, Bool shutdown)
+{
+}
+
+static int
+dummy_video_set_port_attribute(ScrnInfoPtr pScrn, Atom attribute,
+                               INT32 value, pointer data)
+{
+    return BadMatch;
+}
+
+static int
+dummy_video_get_port_attribute(ScrnInfoPtr pScrn, Atom attribute,
+                               INT32 *value, pointer data)
+{
+    return BadMatch;
+}
+
+static void
+dummy_video_query_best_size(ScrnInfoPtr pScrn, Bool motion,
+                            short vid_w, short vid_h,
+                            short drw_w, short drw_h,
+                            unsigned int *p_w, unsigned int *p_h,
+                            pointer data)
+{
+    *p_w = drw_w;
+    *p_h = drw_h;
+}
+
+void
+DUMMYInitVideo(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    DUMMYPtr dPtr = DUMMYPTR(pScrn);
+    XF86VideoAdaptorPtr adapt;
+    DevUnion *ports;
+    int i;
+
+    if (pScrn->bitsPerPixel != 32) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                "Software XV support needs 32 bpp, disabled.\n");
+        return;
+    }
+
+    scratch = malloc(sizeof(*scratch));
+    adapt = calloc(1, sizeof(XF86VideoAdaptorRec) +
+            DUMMY_VIDEO_NUM_PORTS * sizeof(DevUnion));
+    if (!scratch || !adapt) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                "Failed to allocate software XV adaptor.\n");
+        free(scratch);
+        scratch = NULL;
+        free(adapt);
+        return;
+    }
+    ports = (DevUnion *)&adapt[1];
+    for (i = 0; i < DUMMY_VIDEO_NUM_PORTS; i++)
+        ports[i].val = i;
+
+    adapt->type = XvWindowMask | XvInputMask | XvImageMask;
+    adapt->flags = 0;
+    adapt->name = "Qubes Software Video";
+    adapt->nEncodings = ARRAY_SIZE(DummyVideoEncoding);
+    adapt->pEncodings = DummyVideoEncoding;
+    adapt->nFormats = ARRAY_SIZE(DummyVideoFormats);
+    adapt->pFormats = DummyVideoFormats;
+    adapt->nPorts = DUMMY_VIDEO_NUM_PORTS;
+    adapt->pPortPrivates = ports;
+    adapt->nAttributes = 0;
+    adapt->pAttributes = NULL;
+    adapt->nImages = ARRAY_SIZE(DummyVideoImages);
+    adapt->pImages = DummyVideoImages;
+    adapt->StopVideo = dummy_video_stop;
+    adapt->SetPortAttribute = dummy_video_set_port_attribute;
+    adapt->GetPortAttribute = dummy_video_get_port_attribute;
+    adapt->QueryBestSize = dummy_video_query_best_size;
+    adapt->PutImage = dummy_video_put_image;
+    adapt->QueryImageAttributes = dummy_video_query_image_attributes;
+
+    if (!xf86XVScreenInit(pScreen, &adapt, 1)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                "Failed to initialize software XV support.\n");
+        return;
+    }
+    dPtr->overlayAdaptor = adapt;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Software XV support enabled.\n");
+}
+
+#else /* XvExtension */
+
+void
+DUMMYInitVideo(ScreenPtr pScreen)
+{
+}
+
+#endif /* XvExtension */
@@ -0,0 +1,103 @@
+#ifndef DUMMY_YUV_H
+#define DUMMY_YUV_H
+
+/* YUV to XRGB conversion kernel of the software Xv adaptor. It does not
+ * depend on the X server headers, so gui-agent/tests can build it too. */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Fixed point BT.601 coefficients, scaled by 4096. The SSE2 code multiplies
+ * them by the (value << 7) with _mm_mulhi_epi16, which gives results in 1/8
+ * units; the scalar code does exactly the same so both paths give identical
+ * output.
+ */
+#define YUV_Y   4768    /* 1.164 */
+#define YUV_VR  6537    /* 1.596 */
+#define YUV_UG  (-1605) /* -0.392 */
+#define YUV_VG  (-3330) /* -0.813 */
+#define YUV_UB  8263    /* 2.017 */
+
+static inline int yuv_mul(int value, int coef)
+{
+    return (value * 128 * coef) >> 16;
+}
+
+static inline uint32_t yuv_clamp(int value)
+{
+    value = (value + 4) >> 3;
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static inline uint32_t yuv_pixel(int y, int u, int v)
+{
+    int c = yuv_mul(y - 16, YUV_Y);
+    int d = u - 128;
+    int e = v - 128;
+
+    return 0xff000000 |
+        yuv_clamp(c + yuv_mul(e, YUV_VR)) << 16 |
+        yuv_clamp(c + yuv_mul(d, YUV_UG) + yuv_mul(e, YUV_VG)) << 8 |
+        yuv_clamp(c + yuv_mul(d, YUV_UB));
+}
+
+/* Convert n pixels of planar data with horizontally subsampled chroma; y
+ * starts at an even column, u and v at the matching chroma sample. */
+static inline void
+yuv_row_to_xrgb(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                const uint8_t *v, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
+    const __m128i y_off = _mm_set1_epi16(16);
+    const __m128i uv_off = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi16(4);
+    const __m128i cy = _mm_set1_epi16(YUV_Y);
+    const __m128i cvr = _mm_set1_epi16(YUV_VR);
+    const __m128i cug = _mm_set1_epi16(YUV_UG);
+    const __m128i cvg = _mm_set1_epi16(YUV_VG);
+    const __m128i cub = _mm_set1_epi16(YUV_UB);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i yy, uu, vv, c, r, g, b, bg, ra;
+        int32_t u4, v4;
+
+        yy = _mm_loadl_epi64((const __m128i *)(y + i));
+        yy = _mm_sub_epi16(_mm_unpacklo_epi8(yy, zero), y_off);
+        memcpy(&u4, u + i / 2, 4);
+        memcpy(&v4, v + i / 2, 4);
+        uu = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), zero);
+        vv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), zero);
+        /* each chroma sample covers two pixels */
+        uu = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi16(uu, uu), uv_off), 7);
+        vv = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi16(vv, vv), uv_off), 7);
+
+        c = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(yy, 7), cy), round);
+        r = _mm_add_epi16(c, _mm_mulhi_epi16(vv, cvr));
+        g = _mm_add_epi16(c, _mm_add_epi16(_mm_mulhi_epi16(uu, cug),
+                                           _mm_mulhi_epi16(vv, cvg)));
+        b = _mm_add_epi16(c, _mm_mulhi_epi16(uu, cub));
+        r = _mm_packus_epi16(_mm_srai_epi16(r, 3), zero);
+        g = _mm_packus_epi16(_mm_srai_epi16(g, 3), zero);
+        b = _mm_packus_epi16(_mm_srai_epi16(b, 3), zero);
+
+        /* B G R X byte order in memory */
+        bg = _mm_unpacklo_epi8(b, g);
+        ra = _mm_unpacklo_epi8(r, alpha);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(bg, ra));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = yuv_pixel(y[i], u[i / 2], v[i / 2]);
+}
+
+#endif /* DUMMY_YUV_H */